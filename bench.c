@@ -0,0 +1,541 @@
+/*
+ * Copyright (c) 2013 Cesanta Software Limited
+ * All rights reserved
+ *
+ * This library is dual-licensed: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation. For the terms of this
+ * license, see <http: *www.gnu.org/licenses/>.
+ *
+ * You are free to use this library under the terms of the GNU General
+ * Public License, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * Alternatively, you can license this library under a commercial
+ * license, as set out in <http://cesanta.com/products.html>.
+ */
+
+/*
+ * Throughput benchmark and regression check. Build and run with
+ * `make bench`, or
+ *
+ * cc bench.c frozen.c -o bench -O2 && ./bench [-t min_seconds] [-r runs]
+ *     [-o results.json] [-b baseline.json] [file ...]
+ *
+ * Every public parsing and printing API is run over an in-memory corpus.
+ * JSON documents in `file ...`, like fuzz_corpus/ used by fuzz.c, are added
+ * to the corpus for the APIs that need no document-specific arguments.
+ * Each case is first warmed up, which also finds how many calls take at
+ * least `min_seconds` (0.1 by default), and then timed `runs` times (5 by
+ * default). The median and the median absolute deviation (MAD) of ns per
+ * call are printed, with MB/s of the input (or of the output, for
+ * json_printf) and allocator calls per call.
+ *
+ * `-o` saves the results as JSON. `-b` compares them with results saved
+ * earlier and exits with an error if any case got slower by more than
+ * BENCH_MIN_SLOWDOWN and by more than the noise of both measurements.
+ */
+
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include "frozen.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DEEP_LEVELS 100
+#define BENCH_MAX_RUNS 31
+#define BENCH_MIN_SLOWDOWN 0.05
+
+struct bench_doc {
+  const char *name;
+  void (*gen)(struct json_out *out);   /* Prints the document */
+  int (*scan)(const char *s, int len); /* A typical json_scanf() use */
+  const char *setf_path;               /* Value changed by json_setf() */
+  char *s;
+  int len;
+};
+
+static unsigned long s_num_allocs;
+
+static void *bench_malloc(size_t size, void *user_data) {
+  (void) user_data;
+  s_num_allocs++;
+  return malloc(size);
+}
+
+static void *bench_realloc(void *ptr, size_t size, void *user_data) {
+  (void) user_data;
+  s_num_allocs++;
+  return realloc(ptr, size);
+}
+
+static void bench_free(void *ptr, void *user_data) {
+  (void) user_data;
+  free(ptr);
+}
+
+/* Output is counted and thrown away, so only frozen's own work is timed */
+static int bench_sink(struct json_out *out, const char *buf, size_t len) {
+  out->u.buf.len += len;
+  (void) buf;
+  return len;
+}
+
+static double bench_now(void) {
+#if defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+#else
+  return (double) clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+/* A small RPC request, like the ones exchanged with devices */
+static void gen_rpc(struct json_out *out) {
+  json_printf(out,
+              "{id:%d,method:%Q,params:{config:{wifi:{sta:{enable:%B,"
+              "ssid:%Q,pass:%Q}},debug:{level:%d}},save:%B,reboot:%B}}",
+              1234, "Config.Set", 1, "home-network", "secret", 2, 1, 0);
+}
+
+/* An object with many members */
+static void gen_wide(struct json_out *out) {
+  char key[16];
+  int i;
+  json_printf(out, "{");
+  for (i = 0; i < 1000; i++) {
+    snprintf(key, sizeof(key), "key%d", i);
+    json_printf(out, "%s%Q:%d", i == 0 ? "" : ",", key, i * 7);
+  }
+  json_printf(out, "}");
+}
+
+/* Nested objects */
+static void gen_deep(struct json_out *out) {
+  int i;
+  for (i = 0; i < DEEP_LEVELS; i++) json_printf(out, "{a:");
+  json_printf(out, "%d", 1);
+  for (i = 0; i < DEEP_LEVELS; i++) json_printf(out, "}");
+}
+
+/* An array of numbers */
+static void gen_numbers(struct json_out *out) {
+  int i;
+  json_printf(out, "[");
+  for (i = 0; i < 1000; i++) {
+#if JSON_MINIMAL
+    json_printf(out, "%s%d", i == 0 ? "" : ",", i * 7919 - 1000000);
+#else
+    if (i % 2 == 0) {
+      json_printf(out, "%s%d", i == 0 ? "" : ",", i * 7919 - 1000000);
+    } else {
+      json_printf(out, ",%.6g", (i - 500) * 1.0337e-3);
+    }
+#endif
+  }
+  json_printf(out, "]");
+}
+
+/* An array of long strings, with some escapes and non-ASCII text */
+static void gen_strings(struct json_out *out) {
+  static const char chunk[] =
+      "Lorem ipsum dolor sit amet, \"consectetur\" adipiscing elit\n"
+      "\xd0\xbf\xd1\x80\xd0\xb8\xd0\xb2\xd0\xb5\xd1\x82 ";
+  char str[1024];
+  size_t i;
+  for (i = 0; i + sizeof(chunk) <= sizeof(str); i += sizeof(chunk) - 1) {
+    memcpy(str + i, chunk, sizeof(chunk));
+  }
+  json_printf(out, "[");
+  for (i = 0; i < 100; i++) json_printf(out, "%s%Q", i == 0 ? "" : ",", str);
+  json_printf(out, "]");
+}
+
+/* An array of records of mixed types, like a typical API response */
+static void gen_records(struct json_out *out) {
+  char name[32], email[64];
+  int i;
+  json_printf(out, "[");
+  for (i = 0; i < 200; i++) {
+    snprintf(name, sizeof(name), "user%d", i);
+    snprintf(email, sizeof(email), "user%d@example.com", i);
+    json_printf(out,
+                "%s{id:%d,name:%Q,email:%Q,active:%B,score:%d,"
+                "tags:[%Q,%Q],address:{city:%Q,zip:%Q},manager:null}",
+                i == 0 ? "" : ",", i, name, email, i % 3 != 0, i * 13 % 100,
+                "admin", "staff", "Dublin", "D02 X285");
+  }
+  json_printf(out, "]");
+}
+
+static int scan_rpc(const char *s, int len) {
+  char *method = NULL;
+  int id = 0, save = 0, level = 0;
+  int n = json_scanf(s, len,
+                     "{id:%d, method:%Q, params:{config:{debug:{level:%d}},"
+                     "save:%B}}",
+                     &id, &method, &level, &save);
+  free(method);
+  return n;
+}
+
+static int scan_wide(const char *s, int len) {
+  int a = 0, b = 0;
+  return json_scanf(s, len, "{key0:%d, key999:%d}", &a, &b);
+}
+
+static int scan_token(const char *s, int len) {
+  struct json_token t;
+  return json_scanf(s, len, "%T", &t);
+}
+
+static int scan_records(const char *s, int len) {
+  struct json_token t;
+  char *name = NULL;
+  int id = 0, n = 0;
+  if (json_scanf_array_elem(s, len, "", 100, &t) > 0) {
+    n = json_scanf(t.ptr, t.len, "{id:%d, name:%Q}", &id, &name);
+  }
+  free(name);
+  return n;
+}
+
+static char s_deep_path[DEEP_LEVELS * 2 + 1];
+
+static struct bench_doc s_docs[] = {
+    {"rpc", gen_rpc, scan_rpc, ".params.save", NULL, 0},
+    {"wide", gen_wide, scan_wide, ".key999", NULL, 0},
+    {"deep", gen_deep, scan_token, s_deep_path, NULL, 0},
+    {"numbers", gen_numbers, scan_token, "[999]", NULL, 0},
+    {"strings", gen_strings, scan_token, "[99]", NULL, 0},
+    {"records", gen_records, scan_records, "[199].name", NULL, 0},
+};
+
+#define NUM_DOCS (sizeof(s_docs) / sizeof(s_docs[0]))
+
+/* Load an extra document from a file; it must hold one JSON value */
+static int bench_load(struct bench_doc *d, const char *file_name) {
+  const char *base = strrchr(file_name, '/');
+  memset(d, 0, sizeof(*d));
+  d->name = base != NULL ? base + 1 : file_name;
+  d->scan = scan_token;
+  if ((d->s = json_fread(file_name)) == NULL) return -1;
+  d->len = (int) strlen(d->s);
+  if (json_walk(d->s, d->len, NULL, NULL) != d->len) {
+    free(d->s);
+    return -1;
+  }
+  return 0;
+}
+
+enum bench_api {
+  BENCH_WALK,
+  BENCH_SCANF,
+  BENCH_PRINTF,
+  BENCH_SETF,
+  BENCH_PRETTIFY,
+  BENCH_NEXT,
+  BENCH_NUM_APIS
+};
+
+static const char *s_api_names[] = {
+    "json_walk", "json_scanf", "json_printf", "json_setf", "json_prettify",
+    "json_next_*",
+};
+
+static void bench_walk_cb(void *data, const char *name, size_t name_len,
+                          const char *path, const struct json_token *t) {
+  (*(unsigned long *) data)++;
+  (void) name;
+  (void) name_len;
+  (void) path;
+  (void) t;
+}
+
+/* Run `api` once over `d`, return the number of bytes processed */
+static size_t bench_run(enum bench_api api, const struct bench_doc *d) {
+  struct json_out out = {bench_sink, {{NULL, 0, 0}}};
+  static unsigned long s_count;
+  switch (api) {
+    case BENCH_WALK:
+      json_walk(d->s, d->len, bench_walk_cb, &s_count);
+      break;
+    case BENCH_SCANF:
+      s_count += d->scan(d->s, d->len);
+      break;
+    case BENCH_PRINTF:
+      d->gen(&out);
+      return out.u.buf.len;
+    case BENCH_SETF:
+      json_setf(d->s, d->len, &out, d->setf_path, "%d", 42);
+      break;
+    case BENCH_PRETTIFY:
+      json_prettify(d->s, d->len, &out);
+      break;
+    case BENCH_NEXT: {
+      struct json_token key, val;
+      void *h = NULL;
+      int idx;
+      if (d->s[0] == '{') {
+        while ((h = json_next_key(d->s, d->len, h, "", &key, &val)) != NULL) {
+          s_count++;
+        }
+      } else {
+        while ((h = json_next_elem(d->s, d->len, h, "", &idx, &val)) != NULL) {
+          s_count++;
+        }
+      }
+      break;
+    }
+    default:
+      break;
+  }
+  return d->len;
+}
+
+struct bench_result {
+  const char *api;
+  const char *corpus;
+  double median_ns; /* Median of the runs */
+  double mad_ns;    /* Median absolute deviation of the runs */
+  double mbps;
+  double allocs;
+  /* Private */
+  enum bench_api id;
+  const struct bench_doc *doc;
+  unsigned long calls; /* Number of calls per run */
+  double ns[BENCH_MAX_RUNS];
+};
+
+static int bench_dbl_cmp(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+/* Sort `v,n` and return its median */
+static double bench_median(double *v, int n) {
+  qsort(v, n, sizeof(*v), bench_dbl_cmp);
+  return n % 2 != 0 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+/* Warm up, finding the number of calls that take at least `min_time` */
+static void bench_warmup(struct bench_result *r, double min_time) {
+  unsigned long i, n = 1;
+  double start, elapsed;
+  for (;;) {
+    start = bench_now();
+    for (i = 0; i < n; i++) bench_run(r->id, r->doc);
+    elapsed = bench_now() - start;
+    if (elapsed >= min_time) break;
+    if (elapsed < min_time / 100) {
+      n *= 100;
+    } else {
+      n = (unsigned long) (n * min_time * 1.2 / elapsed) + 1;
+    }
+  }
+  r->calls = n;
+}
+
+/* Time run number `k` of a warmed up case */
+static void bench_time(struct bench_result *r, int k) {
+  unsigned long i, allocs = s_num_allocs;
+  size_t bytes = 0;
+  double start = bench_now();
+  for (i = 0; i < r->calls; i++) bytes += bench_run(r->id, r->doc);
+  r->ns[k] = (bench_now() - start) * 1e9 / r->calls;
+  r->mbps = (double) bytes / r->calls;
+  r->allocs += (double) (s_num_allocs - allocs) / r->calls;
+}
+
+static void bench_stats(struct bench_result *r, int runs) {
+  double dev[BENCH_MAX_RUNS];
+  int k;
+  r->median_ns = bench_median(r->ns, runs);
+  for (k = 0; k < runs; k++) {
+    dev[k] = r->ns[k] > r->median_ns ? r->ns[k] - r->median_ns
+                                     : r->median_ns - r->ns[k];
+  }
+  r->mad_ns = bench_median(dev, runs);
+  r->mbps = r->mbps / r->median_ns * 1e3;
+  r->allocs /= runs;
+  printf("%-14s %-16s %10d %14.1f %10.1f %10.1f %10.2f\n", r->api, r->corpus,
+         r->doc->len, r->median_ns, r->mad_ns, r->mbps, r->allocs);
+}
+
+static int bench_save(const char *file_name, const struct bench_result *r,
+                      int n) {
+  FILE *fp = fopen(file_name, "w");
+  int i;
+  if (fp == NULL) return -1;
+  {
+    struct json_out out = JSON_OUT_FILE(fp);
+    json_printf(&out, "{cases: [\n");
+    for (i = 0; i < n; i++) {
+      json_printf(&out,
+                  "  {api: %Q, corpus: %Q, median_ns: %.1f, mad_ns: %.1f, "
+                  "mb_per_s: %.1f, allocs_per_op: %.2f}%s\n",
+                  r[i].api, r[i].corpus, r[i].median_ns, r[i].mad_ns,
+                  r[i].mbps, r[i].allocs, i + 1 < n ? "," : "");
+    }
+    json_printf(&out, "]}\n");
+  }
+  return fclose(fp) == 0 ? 0 : -1;
+}
+
+static int bench_tok_eq(const struct json_token *t, const char *s) {
+  return (size_t) t->len == strlen(s) && memcmp(t->ptr, s, t->len) == 0;
+}
+
+/*
+ * Compare results `r,n` with the ones saved in `file_name`.
+ * Return the number of cases that got slower, or -1 on error.
+ */
+static int bench_compare(const char *file_name, const struct bench_result *r,
+                         int n) {
+  char *s = json_fread(file_name);
+  struct json_token t, api, corpus;
+  int i, j, len, num_slower = 0;
+  if (s == NULL) return -1;
+  len = (int) strlen(s);
+  printf("\n%-14s %-16s %14s %14s %8s\n", "api", "corpus", "base ns/op",
+         "ns/op", "change");
+  for (j = 0; json_scanf_array_elem(s, len, ".cases", j, &t) > 0; j++) {
+    double median = 0, mad = 0, change, noise;
+    int slower;
+    if (json_scanf(t.ptr, t.len,
+                   "{api: %T, corpus: %T, median_ns: %lf, mad_ns: %lf}", &api,
+                   &corpus, &median, &mad) != 4 ||
+        median <= 0) {
+      continue;
+    }
+    for (i = 0; i < n; i++) {
+      if (bench_tok_eq(&api, r[i].api) && bench_tok_eq(&corpus, r[i].corpus)) {
+        break;
+      }
+    }
+    if (i == n) continue;
+    /*
+     * 1.4826 * MAD estimates the standard deviation of normally distributed
+     * samples. A slowdown within 3 of them, of either run, is noise.
+     */
+    change = r[i].median_ns / median - 1;
+    noise = 3 * 1.4826 * (r[i].mad_ns + mad);
+    slower = change > BENCH_MIN_SLOWDOWN && r[i].median_ns - median > noise;
+    printf("%-14s %-16s %14.1f %14.1f %+7.1f%%%s\n", r[i].api, r[i].corpus,
+           median, r[i].median_ns, change * 100, slower ? "  SLOWER" : "");
+    num_slower += slower;
+  }
+  free(s);
+  return num_slower;
+}
+
+int main(int argc, char *argv[]) {
+  struct json_allocator allocator = {bench_malloc, bench_realloc, bench_free,
+                                     NULL};
+  struct bench_doc *docs;
+  struct bench_result *results;
+  const char *out_file = NULL, *base_file = NULL;
+  double min_time = 0.1;
+  int api, j, k, runs = 5, num_results = 0, num_slower = 0;
+  size_t i, num_docs = NUM_DOCS;
+
+  docs = (struct bench_doc *) malloc(sizeof(*docs) * (NUM_DOCS + argc));
+  memcpy(docs, s_docs, sizeof(s_docs));
+
+  for (i = 1; i < (size_t) argc; i++) {
+    if (strcmp(argv[i], "-t") == 0 && i + 1 < (size_t) argc) {
+      min_time = atof(argv[++i]);
+    } else if (strcmp(argv[i], "-r") == 0 && i + 1 < (size_t) argc) {
+      runs = atoi(argv[++i]);
+      if (runs < 1) runs = 1;
+      if (runs > BENCH_MAX_RUNS) runs = BENCH_MAX_RUNS;
+    } else if (strcmp(argv[i], "-o") == 0 && i + 1 < (size_t) argc) {
+      out_file = argv[++i];
+    } else if (strcmp(argv[i], "-b") == 0 && i + 1 < (size_t) argc) {
+      base_file = argv[++i];
+    } else if (argv[i][0] != '-') {
+      if (bench_load(&docs[num_docs], argv[i]) == 0) {
+        num_docs++;
+      } else {
+        fprintf(stderr, "skipping %s: not a JSON document\n", argv[i]);
+      }
+    } else {
+      fprintf(stderr,
+              "Usage: %s [-t min_seconds] [-r runs] [-o results.json] "
+              "[-b baseline.json] [file ...]\n",
+              argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  for (i = 0; i < DEEP_LEVELS; i++) memcpy(s_deep_path + i * 2, ".a", 2);
+  json_set_allocator(&allocator);
+
+  for (i = 0; i < NUM_DOCS; i++) {
+    struct bench_doc *d = &docs[i];
+    struct json_out sink = {bench_sink, {{NULL, 0, 0}}};
+    d->gen(&sink);
+    d->len = (int) sink.u.buf.len;
+    d->s = (char *) malloc(d->len + 1);
+    {
+      struct json_out out = JSON_OUT_BUF(d->s, d->len + 1);
+      d->gen(&out);
+    }
+    if (json_walk(d->s, d->len, NULL, NULL) != d->len) {
+      fprintf(stderr, "corpus %s is not valid JSON\n", d->name);
+      return EXIT_FAILURE;
+    }
+  }
+
+  results = (struct bench_result *) malloc(sizeof(*results) * BENCH_NUM_APIS *
+                                           num_docs);
+  for (api = 0; api < BENCH_NUM_APIS; api++) {
+    for (i = 0; i < num_docs; i++) {
+      struct bench_result *r;
+      /* Documents from files have no generator and no json_setf() path */
+      if (docs[i].gen == NULL && (api == BENCH_PRINTF || api == BENCH_SETF)) {
+        continue;
+      }
+      r = &results[num_results++];
+      memset(r, 0, sizeof(*r));
+      r->api = s_api_names[api];
+      r->corpus = docs[i].name;
+      r->id = (enum bench_api) api;
+      r->doc = &docs[i];
+      bench_warmup(r, min_time);
+    }
+  }
+  /*
+   * Runs of all cases are interleaved, so that a change in machine load
+   * shows up as spread in every case rather than as a shift in some.
+   */
+  for (k = 0; k < runs; k++) {
+    for (j = 0; j < num_results; j++) bench_time(&results[j], k);
+  }
+  printf("%-14s %-16s %10s %14s %10s %10s %10s\n", "api", "corpus", "bytes",
+         "ns/op", "MAD", "MB/s", "allocs/op");
+  for (j = 0; j < num_results; j++) bench_stats(&results[j], runs);
+  fflush(stdout);
+
+  if (out_file != NULL && bench_save(out_file, results, num_results) != 0) {
+    fprintf(stderr, "cannot write %s\n", out_file);
+    num_slower = -1;
+  }
+  if (base_file != NULL && num_slower == 0 &&
+      (num_slower = bench_compare(base_file, results, num_results)) < 0) {
+    fprintf(stderr, "cannot read %s\n", base_file);
+  }
+  if (num_slower > 0) fprintf(stderr, "%d case(s) got slower\n", num_slower);
+
+  for (i = 0; i < num_docs; i++) free(docs[i].s);
+  free(docs);
+  free(results);
+  return num_slower == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
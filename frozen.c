@@ -16,19 +16,50 @@
  * limitations under the License.
  */
 
+#ifndef CS_FROZEN_FROZEN_C_
+#define CS_FROZEN_FROZEN_C_
+
 #define _CRT_SECURE_NO_WARNINGS /* Disable deprecation warning in VS2005+ */
 
+/* For mmap() and posix_madvise() with -std=c99, and 64-bit file sizes */
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200112L
+#endif
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+#endif
+
 #include "frozen.h"
 
 #include <ctype.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 
+#if JSON_ENABLE_MMAP && defined(_WIN32)
+#include <windows.h>
+#elif JSON_ENABLE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/* Temporary files are created exclusively, with the mode of the original */
+#if !defined(_WIN32) && (defined(__unix__) || defined(__APPLE__))
+#define JSON_POSIX_FILES 1
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #if !defined(WEAK)
-#if (defined(__GNUC__) || defined(__TI_COMPILER_VERSION__)) && !defined(_WIN32)
+#if (defined(__GNUC__) || defined(__TI_COMPILER_VERSION__)) && \
+    !defined(_WIN32) && !FROZEN_HEADER_ONLY
 #define WEAK __attribute__((weak))
 #else
 #define WEAK
@@ -73,19 +104,125 @@ typedef unsigned _int64 uint64_t;
 #define JSON_ENABLE_ARRAY 1
 #endif
 
-struct frozen {
+#ifndef JSON_ENABLE_SIMD
+#if !JSON_MINIMAL && (defined(__SSE2__) || defined(_M_X64) || \
+                      (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define JSON_ENABLE_SIMD 1
+#else
+#define JSON_ENABLE_SIMD 0
+#endif
+#endif
+
+#if JSON_ENABLE_SIMD
+#include <emmintrin.h>
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+#endif
+
+#if JSON_ENABLE_HEAP
+static void *json_default_malloc(size_t size, void *user_data) {
+  (void) user_data;
+  return malloc(size);
+}
+
+static void *json_default_realloc(void *ptr, size_t size, void *user_data) {
+  (void) user_data;
+  return realloc(ptr, size);
+}
+
+static void json_default_free(void *ptr, void *user_data) {
+  (void) user_data;
+  free(ptr);
+}
+
+#define JSON_DEFAULT_ALLOCATOR \
+  { json_default_malloc, json_default_realloc, json_default_free, NULL }
+#else
+/* No heap: allocations fail unless the user installs an allocator */
+#define JSON_DEFAULT_ALLOCATOR \
+  { NULL, NULL, NULL, NULL }
+#endif /* JSON_ENABLE_HEAP */
+
+static const struct json_allocator json_default_allocator =
+    JSON_DEFAULT_ALLOCATOR;
+static struct json_allocator json_cur_allocator = JSON_DEFAULT_ALLOCATOR;
+
+void json_set_allocator(const struct json_allocator *allocator) WEAK;
+void json_set_allocator(const struct json_allocator *allocator) {
+  json_cur_allocator = allocator == NULL ? json_default_allocator : *allocator;
+}
+
+/* Run `stmt` with `cs` pointing to the call counters, if they are on */
+#if JSON_ENABLE_STATS
+static struct json_call_stats json_cur_call_stats;
+#define JSON_CALL_STATS(stmt)                                \
+  do {                                                       \
+    struct json_call_stats *cs = &json_cur_call_stats;       \
+    stmt;                                                    \
+  } while (0)
+#else
+#define JSON_CALL_STATS(stmt) \
+  do {                        \
+  } while (0)
+#endif
+
+void json_take_call_stats(struct json_call_stats *stats) WEAK;
+void json_take_call_stats(struct json_call_stats *stats) {
+#if JSON_ENABLE_STATS
+  *stats = json_cur_call_stats;
+  memset(&json_cur_call_stats, 0, sizeof(json_cur_call_stats));
+#else
+  memset(stats, 0, sizeof(*stats));
+#endif
+}
+
+static void *json_malloc(size_t size) {
+  if (json_cur_allocator.malloc_fn == NULL) return NULL;
+  JSON_CALL_STATS(cs->allocs++; cs->alloc_bytes += size);
+  return json_cur_allocator.malloc_fn(size, json_cur_allocator.user_data);
+}
+
+static void *json_realloc(void *ptr, size_t size) {
+  if (json_cur_allocator.realloc_fn == NULL) return NULL;
+  JSON_CALL_STATS(cs->allocs++; cs->alloc_bytes += size);
+  return json_cur_allocator.realloc_fn(ptr, size,
+                                       json_cur_allocator.user_data);
+}
+
+static void json_free(void *ptr) {
+  if (ptr != NULL && json_cur_allocator.free_fn != NULL) {
+    JSON_CALL_STATS(cs->frees++);
+    json_cur_allocator.free_fn(ptr, json_cur_allocator.user_data);
+  }
+}
+
+/* All output goes through here, so that it can be counted */
+static int json_out_print(struct json_out *out, const char *buf, size_t len) {
+  JSON_CALL_STATS(cs->printer_calls++; cs->printed_bytes += len);
+  return out->printer(out, buf, len);
+}
+
+struct json_parser {
   const char *end;
   const char *cur;
 
   const char *cur_name;
   size_t cur_name_len;
   int limit;
+  int strict_utf8;
+  int in_key; /* Whether an object key is being parsed */
+#if JSON_ENABLE_STATS
+  struct json_walk_stats *stats;
+  int start_limit; /* Initial `limit`, to measure depth */
+#endif
 
   /* For callback API */
   char path[JSON_MAX_PATH_LEN];
   size_t path_len;
   void *callback_data;
   json_walk_callback_t callback;
+  json_walk_sz_callback_t callback_sz; /* Used if `callback` is NULL */
 };
 
 struct fstate {
@@ -97,15 +234,43 @@ struct fstate {
   struct fstate fstate = {(ptr), (fr)->path_len}; \
   json_append_to_path((fr), (str), (len));
 
+/* Run `stmt` with `st` pointing to the walk statistics, if they are on */
+#if JSON_ENABLE_STATS
+#define JSON_STATS(fr, stmt)                        \
+  do {                                              \
+    struct json_walk_stats *st = (fr)->stats;       \
+    if (st != NULL) {                               \
+      stmt;                                         \
+    }                                               \
+  } while (0)
+#else
+#define JSON_STATS(fr, stmt) \
+  do {                       \
+  } while (0)
+#endif
+
+/* Whether to report a token, keys are reported only for truncated paths */
+#define JSON_REPORTED(fr)                        \
+  (!(fr)->in_key || (fr)->path_len == 0 ||       \
+   (fr)->path[(fr)->path_len - 1] != '.')
+
 #define CALL_BACK(fr, tok, value, len)                                        \
   do {                                                                        \
-    if ((fr)->callback &&                                                     \
-        ((fr)->path_len == 0 || (fr)->path[(fr)->path_len - 1] != '.')) {     \
-      struct json_token t = {(value), (int) (len), (tok)};                    \
-                                                                              \
+    if (JSON_REPORTED(fr)) {                                                  \
+      JSON_STATS(fr, st->tokens[tok]++);                                      \
+    }                                                                         \
+    if (((fr)->callback || (fr)->callback_sz) && JSON_REPORTED(fr)) {         \
+      JSON_STATS(fr, st->callbacks++);                                        \
       /* Call the callback with the given value and current name */           \
-      (fr)->callback((fr)->callback_data, (fr)->cur_name, (fr)->cur_name_len, \
-                     (fr)->path, &t);                                         \
+      if ((fr)->callback) {                                                   \
+        struct json_token t = {(value), (int) (len), (tok)};                  \
+        (fr)->callback((fr)->callback_data, (fr)->cur_name,                   \
+                       (fr)->cur_name_len, (fr)->path, &t);                   \
+      } else {                                                                \
+        struct json_token_sz t = {(value), (size_t) (len), (tok)};            \
+        (fr)->callback_sz((fr)->callback_data, (fr)->cur_name,                \
+                          (fr)->cur_name_len, (fr)->path, &t);                \
+      }                                                                       \
                                                                               \
       /* Reset the name */                                                    \
       (fr)->cur_name = NULL;                                                  \
@@ -113,23 +278,29 @@ struct fstate {
     }                                                                         \
   } while (0)
 
-static int json_append_to_path(struct frozen *f, const char *str, int size) {
+static int json_append_to_path(struct json_parser *f, const char *str,
+                               int size) {
   int n = f->path_len;
   int left = sizeof(f->path) - n - 1;
-  if (size > left) size = left;
+  if (size > left) {
+    JSON_STATS(f, st->truncated_paths++);
+    size = left;
+  }
   memcpy(f->path + n, str, size);
   f->path[n + size] = '\0';
   f->path_len += size;
+  JSON_STATS(f, if (f->path_len > st->max_path_len) st->max_path_len =
+                    f->path_len);
   return n;
 }
 
-static void json_truncate_path(struct frozen *f, size_t len) {
+static void json_truncate_path(struct json_parser *f, size_t len) {
   f->path_len = len;
   f->path[len] = '\0';
 }
 
-static int json_parse_object(struct frozen *f);
-static int json_parse_value(struct frozen *f);
+static int json_parse_object(struct json_parser *f);
+static int json_parse_value(struct json_parser *f);
 
 #define EXPECT(cond, err_code)      \
   do {                              \
@@ -144,7 +315,7 @@ static int json_parse_value(struct frozen *f);
 
 #define END_OF_STRING (-1)
 
-static int json_left(const struct frozen *f) {
+static ptrdiff_t json_left(const struct json_parser *f) {
   return f->end - f->cur;
 }
 
@@ -152,16 +323,20 @@ static int json_isspace(int ch) {
   return ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n';
 }
 
-static void json_skip_whitespaces(struct frozen *f) {
+static void json_skip_whitespaces(struct json_parser *f) {
+#if JSON_ENABLE_STATS
+  const char *start = f->cur;
+#endif
   while (f->cur < f->end && json_isspace(*f->cur)) f->cur++;
+  JSON_STATS(f, st->whitespace += f->cur - start);
 }
 
-static int json_cur(struct frozen *f) {
+static int json_cur(struct json_parser *f) {
   json_skip_whitespaces(f);
   return f->cur >= f->end ? END_OF_STRING : *(unsigned char *) f->cur;
 }
 
-static int json_test_and_skip(struct frozen *f, int expected) {
+static int json_test_and_skip(struct json_parser *f, int expected) {
   int ch = json_cur(f);
   if (ch == expected) {
     f->cur++;
@@ -183,7 +358,9 @@ static int json_isxdigit(int ch) {
          (ch >= 'A' && ch <= 'F');
 }
 
-static int json_get_escape_len(const char *s, int len) {
+/* `len` counts from the backslash before `s` */
+static int json_get_escape_len(const char *s, ptrdiff_t len) {
+  if (len < 2) return JSON_STRING_INCOMPLETE;
   switch (*s) {
     case 'u':
       return len < 6 ? JSON_STRING_INCOMPLETE
@@ -199,27 +376,93 @@ static int json_get_escape_len(const char *s, int len) {
     case 'n':
     case 'r':
     case 't':
-      return len < 2 ? JSON_STRING_INCOMPLETE : 1;
+      return 1;
     default:
       return JSON_STRING_INVALID;
   }
 }
 
+/* Return the length of the identifier at `s`, which starts with a letter */
+static ptrdiff_t json_identifier_len(const char *s, const char *end) {
+  const char *p = s;
+  while (p < end && (*p == '_' || json_isalpha(*p) || json_isdigit(*p))) p++;
+  return p - s;
+}
+
 /* identifier = letter { letter | digit | '_' } */
-static int json_parse_identifier(struct frozen *f) {
+static int json_parse_identifier(struct json_parser *f) {
   EXPECT(json_isalpha(json_cur(f)), JSON_STRING_INVALID);
   {
     SET_STATE(f, f->cur, "", 0);
-    while (f->cur < f->end &&
-           (*f->cur == '_' || json_isalpha(*f->cur) || json_isdigit(*f->cur))) {
-      f->cur++;
-    }
+    f->cur += json_identifier_len(f->cur, f->end);
     json_truncate_path(f, fstate.path_len);
     CALL_BACK(f, JSON_TYPE_STRING, fstate.ptr, f->cur - fstate.ptr);
   }
   return 0;
 }
 
+#if JSON_ENABLE_SIMD
+static int json_ctz(unsigned int x) {
+#if defined(__GNUC__)
+  return __builtin_ctz(x);
+#else
+  int n = 0;
+  while ((x & 1) == 0) x >>= 1, n++;
+  return n;
+#endif
+}
+#endif /* JSON_ENABLE_SIMD */
+
+#if JSON_ENABLE_SIMD
+/*
+ * Return the length of the leading part of `p,len` made of printable ASCII
+ * characters other than quote and backslash, rounded down to 16 bytes.
+ */
+static ptrdiff_t json_str_run(const char *p, ptrdiff_t len) {
+  const __m128i ctl = _mm_set1_epi8(0x1f);
+  const __m128i quote = _mm_set1_epi8('"'), bslash = _mm_set1_epi8('\\');
+  ptrdiff_t i = 0;
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (p + i));
+    __m128i m = _mm_or_si128(
+        _mm_cmpeq_epi8(_mm_min_epu8(v, ctl), v),
+        _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, bslash)));
+    /* Bytes with the high bit set start or continue UTF-8 sequences */
+    int mask = _mm_movemask_epi8(m) | _mm_movemask_epi8(v);
+    if (mask != 0) return i + json_ctz((unsigned int) mask);
+  }
+  return i;
+}
+#endif /* JSON_ENABLE_SIMD */
+
+/*
+ * Return the length of the well-formed UTF-8 sequence at `s`, as defined by
+ * RFC 3629: no overlong forms, surrogates or code points above U+10FFFF.
+ */
+static int json_get_utf8_char_len_strict(const unsigned char *s,
+                                         ptrdiff_t left) {
+  unsigned char lo = 0x80, hi = 0xbf;
+  int i, len;
+  if (s[0] < 0x80) return 1;
+  if (s[0] < 0xc2 || s[0] > 0xf4) return JSON_STRING_INVALID;
+  if (s[0] < 0xe0) {
+    len = 2;
+  } else if (s[0] < 0xf0) {
+    len = 3;
+    if (s[0] == 0xe0) lo = 0xa0;
+    if (s[0] == 0xed) hi = 0x9f;
+  } else {
+    len = 4;
+    if (s[0] == 0xf0) lo = 0x90;
+    if (s[0] == 0xf4) hi = 0x8f;
+  }
+  for (i = 1; i < len; i++, lo = 0x80, hi = 0xbf) {
+    if (i >= left) return JSON_STRING_INCOMPLETE;
+    if (s[i] < lo || s[i] > hi) return JSON_STRING_INVALID;
+  }
+  return len;
+}
+
 static int json_get_utf8_char_len(unsigned char ch) {
   if ((ch & 0x80) == 0) return 1;
   switch (ch & 0xf0) {
@@ -232,68 +475,105 @@ static int json_get_utf8_char_len(unsigned char ch) {
   }
 }
 
+/*
+ * Return the length of the string contents at `s`, which follows the opening
+ * quote, up to the closing quote; or a negative error code.
+ */
+static ptrdiff_t json_string_len(const char *s, const char *end,
+                                 int strict_utf8) {
+  const char *p = s;
+  int n, ch, len = 0;
+  for (; p < end; p += len) {
+#if JSON_ENABLE_SIMD
+    /* Skip plain ASCII 16 bytes at a time */
+    if ((p += json_str_run(p, end - p)) >= end) break;
+#endif
+    ch = *(const unsigned char *) p;
+    if (strict_utf8 && ch >= 0x80) {
+      len = json_get_utf8_char_len_strict((const unsigned char *) p, end - p);
+      EXPECT(len > 0, len);
+    } else {
+      len = json_get_utf8_char_len((unsigned char) ch);
+    }
+    EXPECT(ch >= 32 && len > 0, JSON_STRING_INVALID); /* No control chars */
+    EXPECT(len <= end - p, JSON_STRING_INCOMPLETE);
+    if (ch == '\\') {
+      EXPECT((n = json_get_escape_len(p + 1, end - p)) > 0, n);
+      len += n;
+    } else if (ch == '"') {
+      return p - s;
+    }
+  }
+  return JSON_STRING_INCOMPLETE;
+}
+
 /* string = '"' { quoted_printable_chars } '"' */
-static int json_parse_string(struct frozen *f) {
-  int n, ch = 0, len = 0;
+static int json_parse_string(struct json_parser *f) {
+  ptrdiff_t n;
   TRY(json_test_and_skip(f, '"'));
   {
     SET_STATE(f, f->cur, "", 0);
-    for (; f->cur < f->end; f->cur += len) {
-      ch = *(unsigned char *) f->cur;
-      len = json_get_utf8_char_len((unsigned char) ch);
-      EXPECT(ch >= 32 && len > 0, JSON_STRING_INVALID); /* No control chars */
-      EXPECT(len <= json_left(f), JSON_STRING_INCOMPLETE);
-      if (ch == '\\') {
-        EXPECT((n = json_get_escape_len(f->cur + 1, json_left(f))) > 0, n);
-        len += n;
-      } else if (ch == '"') {
-        json_truncate_path(f, fstate.path_len);
-        CALL_BACK(f, JSON_TYPE_STRING, fstate.ptr, f->cur - fstate.ptr);
-        f->cur++;
-        break;
-      };
-    }
+    n = json_string_len(f->cur, f->end, f->strict_utf8);
+    EXPECT(n >= 0, (int) n);
+    f->cur += n;
+    json_truncate_path(f, fstate.path_len);
+    CALL_BACK(f, JSON_TYPE_STRING, fstate.ptr, f->cur - fstate.ptr);
+    f->cur++;
   }
-  return ch == '"' ? 0 : JSON_STRING_INCOMPLETE;
+  return 0;
 }
 
-/* number = [ '-' ] digit+ [ '.' digit+ ] [ ['e'|'E'] ['+'|'-'] digit+ ] */
-static int json_parse_number(struct frozen *f) {
-  int ch = json_cur(f);
-  SET_STATE(f, f->cur, "", 0);
-  if (ch == '-') f->cur++;
-  EXPECT(f->cur < f->end, JSON_STRING_INCOMPLETE);
-  if (f->cur + 1 < f->end && f->cur[0] == '0' && f->cur[1] == 'x') {
-    f->cur += 2;
-    EXPECT(f->cur < f->end, JSON_STRING_INCOMPLETE);
-    EXPECT(json_isxdigit(f->cur[0]), JSON_STRING_INVALID);
-    while (f->cur < f->end && json_isxdigit(f->cur[0])) f->cur++;
+/*
+ * Return the length of the number at `s`, or a negative error code.
+ * number = [ '-' ] digit+ [ '.' digit+ ] [ ['e'|'E'] ['+'|'-'] digit+ ]
+ */
+static ptrdiff_t json_number_len(const char *s, const char *end) {
+  const char *p = s;
+  if (p < end && *p == '-') p++;
+  EXPECT(p < end, JSON_STRING_INCOMPLETE);
+  if (p + 1 < end && p[0] == '0' && p[1] == 'x') {
+    p += 2;
+    EXPECT(p < end, JSON_STRING_INCOMPLETE);
+    EXPECT(json_isxdigit(p[0]), JSON_STRING_INVALID);
+    while (p < end && json_isxdigit(p[0])) p++;
   } else {
-    EXPECT(json_isdigit(f->cur[0]), JSON_STRING_INVALID);
-    while (f->cur < f->end && json_isdigit(f->cur[0])) f->cur++;
-    if (f->cur < f->end && f->cur[0] == '.') {
-      f->cur++;
-      EXPECT(f->cur < f->end, JSON_STRING_INCOMPLETE);
-      EXPECT(json_isdigit(f->cur[0]), JSON_STRING_INVALID);
-      while (f->cur < f->end && json_isdigit(f->cur[0])) f->cur++;
-    }
-    if (f->cur < f->end && (f->cur[0] == 'e' || f->cur[0] == 'E')) {
-      f->cur++;
-      EXPECT(f->cur < f->end, JSON_STRING_INCOMPLETE);
-      if ((f->cur[0] == '+' || f->cur[0] == '-')) f->cur++;
-      EXPECT(f->cur < f->end, JSON_STRING_INCOMPLETE);
-      EXPECT(json_isdigit(f->cur[0]), JSON_STRING_INVALID);
-      while (f->cur < f->end && json_isdigit(f->cur[0])) f->cur++;
+    EXPECT(json_isdigit(p[0]), JSON_STRING_INVALID);
+    while (p < end && json_isdigit(p[0])) p++;
+    if (p < end && p[0] == '.') {
+      p++;
+      EXPECT(p < end, JSON_STRING_INCOMPLETE);
+      EXPECT(json_isdigit(p[0]), JSON_STRING_INVALID);
+      while (p < end && json_isdigit(p[0])) p++;
+    }
+    if (p < end && (p[0] == 'e' || p[0] == 'E')) {
+      p++;
+      EXPECT(p < end, JSON_STRING_INCOMPLETE);
+      if ((p[0] == '+' || p[0] == '-')) p++;
+      EXPECT(p < end, JSON_STRING_INCOMPLETE);
+      EXPECT(json_isdigit(p[0]), JSON_STRING_INVALID);
+      while (p < end && json_isdigit(p[0])) p++;
     }
   }
-  json_truncate_path(f, fstate.path_len);
-  CALL_BACK(f, JSON_TYPE_NUMBER, fstate.ptr, f->cur - fstate.ptr);
+  return p - s;
+}
+
+static int json_parse_number(struct json_parser *f) {
+  ptrdiff_t n;
+  json_skip_whitespaces(f);
+  {
+    SET_STATE(f, f->cur, "", 0);
+    n = json_number_len(f->cur, f->end);
+    EXPECT(n >= 0, (int) n);
+    f->cur += n;
+    json_truncate_path(f, fstate.path_len);
+    CALL_BACK(f, JSON_TYPE_NUMBER, fstate.ptr, f->cur - fstate.ptr);
+  }
   return 0;
 }
 
 #if JSON_ENABLE_ARRAY
 /* array = '[' [ value { ',' value } ] ']' */
-static int json_parse_array(struct frozen *f) {
+static int json_parse_array(struct json_parser *f) {
   int i = 0, current_path_len;
   char buf[20];
   CALL_BACK(f, JSON_TYPE_ARRAY_START, NULL, 0);
@@ -321,9 +601,10 @@ static int json_parse_array(struct frozen *f) {
 }
 #endif /* JSON_ENABLE_ARRAY */
 
-static int json_expect(struct frozen *f, const char *s, int len,
+static int json_expect(struct json_parser *f, const char *s, int len,
                        enum json_token_type tok_type) {
-  int i, n = json_left(f);
+  int i;
+  ptrdiff_t n = json_left(f);
   SET_STATE(f, f->cur, "", 0);
   for (i = 0; i < len; i++) {
     if (i >= n) return JSON_STRING_INCOMPLETE;
@@ -338,11 +619,13 @@ static int json_expect(struct frozen *f, const char *s, int len,
 }
 
 /* value = 'null' | 'true' | 'false' | number | string | array | object */
-static int json_parse_value(struct frozen *f) {
+static int json_parse_value(struct json_parser *f) {
   int ch = json_cur(f);
 
   if (--f->limit <= 0)
     return JSON_DEPTH_LIMIT;
+  JSON_STATS(f, if (f->start_limit - f->limit > st->max_depth) st->max_depth =
+                    f->start_limit - f->limit);
 
   switch (ch) {
     case '"':
@@ -387,8 +670,9 @@ static int json_parse_value(struct frozen *f) {
 }
 
 /* key = identifier | string */
-static int json_parse_key(struct frozen *f) {
+static int json_parse_key(struct json_parser *f) {
   int ch = json_cur(f);
+  f->in_key = 1;
   if (json_isalpha(ch)) {
     TRY(json_parse_identifier(f));
   } else if (ch == '"') {
@@ -396,11 +680,12 @@ static int json_parse_key(struct frozen *f) {
   } else {
     return ch == END_OF_STRING ? JSON_STRING_INCOMPLETE : JSON_STRING_INVALID;
   }
+  f->in_key = 0;
   return 0;
 }
 
 /* pair = key ':' value */
-static int json_parse_pair(struct frozen *f) {
+static int json_parse_pair(struct json_parser *f) {
   int current_path_len;
   const char *tok;
   json_skip_whitespaces(f);
@@ -418,7 +703,7 @@ static int json_parse_pair(struct frozen *f) {
 }
 
 /* object = '{' pair { ',' pair } '}' */
-static int json_parse_object(struct frozen *f) {
+static int json_parse_object(struct json_parser *f) {
   CALL_BACK(f, JSON_TYPE_OBJECT_START, NULL, 0);
   TRY(json_test_and_skip(f, '{'));
   {
@@ -434,35 +719,78 @@ static int json_parse_object(struct frozen *f) {
   return 0;
 }
 
-static int json_doit(struct frozen *f) {
+static int json_doit(struct json_parser *f) {
   if (f->cur == 0 || f->end < f->cur) return JSON_STRING_INVALID;
   if (f->end == f->cur) return JSON_STRING_INCOMPLETE;
   return json_parse_value(f);
 }
 
+/*
+ * Escape table used by json_escape(): 0 means that the byte is printed as is,
+ * 'u' means that it is printed as \u00XX, anything else is the character that
+ * follows the backslash. Bytes >= 0x80 are parts of UTF-8 sequences and are
+ * passed through.
+ */
+static const char json_esc_tab[256] = {
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    0, 0, '"', 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, '\\', 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 'u'
+};
+
+/* Return the length of the leading part of `p,len` that needs no escaping */
+static size_t json_esc_run(const char *p, size_t len) {
+  size_t i = 0;
+#if JSON_ENABLE_SIMD
+  const __m128i ctl = _mm_set1_epi8(0x1f), del = _mm_set1_epi8(0x7f);
+  const __m128i quote = _mm_set1_epi8('"'), bslash = _mm_set1_epi8('\\');
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (p + i));
+    __m128i m = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(v, ctl), v),
+                     _mm_cmpeq_epi8(v, del)),
+        _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, bslash)));
+    int mask = _mm_movemask_epi8(m);
+    if (mask != 0) return i + json_ctz((unsigned int) mask);
+  }
+#endif
+  while (i < len && json_esc_tab[((const unsigned char *) p)[i]] == 0) i++;
+  return i;
+}
+
 int json_escape(struct json_out *out, const char *p, size_t len) WEAK;
 int json_escape(struct json_out *out, const char *p, size_t len) {
-  size_t i, cl, n = 0;
-  const char *hex_digits = "0123456789abcdef";
-  const char *specials = "btnvfr";
-
-  for (i = 0; i < len; i++) {
-    unsigned char ch = ((unsigned char *) p)[i];
-    if (ch == '"' || ch == '\\') {
-      n += out->printer(out, "\\", 1);
-      n += out->printer(out, p + i, 1);
-    } else if (ch >= '\b' && ch <= '\r') {
-      n += out->printer(out, "\\", 1);
-      n += out->printer(out, &specials[ch - '\b'], 1);
-    } else if (isprint(ch)) {
-      n += out->printer(out, p + i, 1);
-    } else if ((cl = json_get_utf8_char_len(ch)) == 1) {
-      n += out->printer(out, "\\u00", 4);
-      n += out->printer(out, &hex_digits[(ch >> 4) % 0xf], 1);
-      n += out->printer(out, &hex_digits[ch % 0xf], 1);
+  static const char hex_digits[] = "0123456789abcdef";
+  char esc[6] = {'\\', 'u', '0', '0', 0, 0};
+  size_t i = 0, n = 0;
+
+  while (i < len) {
+    size_t run = json_esc_run(p + i, len - i);
+    if (run > 0) {
+      /* Print the whole run of bytes that need no escaping at once */
+      n += json_out_print(out, p + i, run);
+      i += run;
     } else {
-      n += out->printer(out, p + i, cl);
-      i += cl - 1;
+      unsigned char ch = ((const unsigned char *) p)[i++];
+      if ((esc[1] = json_esc_tab[ch]) == 'u') {
+        esc[4] = hex_digits[ch >> 4];
+        esc[5] = hex_digits[ch & 0xf];
+        n += json_out_print(out, esc, sizeof(esc));
+      } else {
+        n += json_out_print(out, esc, 2);
+      }
     }
   }
 
@@ -489,61 +817,103 @@ int json_printer_file(struct json_out *out, const char *buf, size_t len) {
 }
 
 #if JSON_ENABLE_BASE64
-static int b64idx(int c) {
-  if (c < 26) {
-    return c + 'A';
-  } else if (c < 52) {
-    return c - 26 + 'a';
-  } else if (c < 62) {
-    return c - 52 + '0';
-  } else {
-    return c == 62 ? '+' : '/';
-  }
+static const char b64_tab[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/* Reverse of b64_tab for 7-bit characters, 64 marks invalid characters */
+static const unsigned char b64_rev_tab[128] = {
+    64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+    64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+    64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 62, 64, 64, 64, 63,
+    52, 53, 54, 55, 56, 57, 58, 59, 60, 61, 64, 64, 64, 64, 64, 64,
+    64, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14,
+    15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 64, 64, 64, 64, 64,
+    64, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+    41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, 64, 64, 64, 64, 64
+};
+
+#define B64REV(c) \
+  ((unsigned char) (c) < 128 ? b64_rev_tab[(unsigned char) (c)] : 64)
+
+#if JSON_ENABLE_SIMD && defined(__SSSE3__)
+/* Encode 12 bytes at `p` into 16 base64 chars. Reads 16 bytes from `p`. */
+static __m128i b64enc12(const unsigned char *p) {
+  const __m128i shift_lut =
+      _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                    '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                    '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+  __m128i in = _mm_loadu_si128((const __m128i *) p), t0, t1, res;
+  /* Spread 3-byte groups over 4-byte lanes, then extract 6-bit indices */
+  in = _mm_shuffle_epi8(
+      in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+  t0 = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)),
+                       _mm_set1_epi32(0x04000040));
+  t1 = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)),
+                       _mm_set1_epi32(0x01000010));
+  in = _mm_or_si128(t0, t1);
+  /* Map indices to ASCII by adding a per-range offset */
+  res = _mm_subs_epu8(in, _mm_set1_epi8(51));
+  res = _mm_or_si128(res, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), in),
+                                        _mm_set1_epi8(13)));
+  return _mm_add_epi8(_mm_shuffle_epi8(shift_lut, res), in);
 }
+#endif
 
-static int b64rev(int c) {
-  if (c >= 'A' && c <= 'Z') {
-    return c - 'A';
-  } else if (c >= 'a' && c <= 'z') {
-    return c + 26 - 'a';
-  } else if (c >= '0' && c <= '9') {
-    return c + 52 - '0';
-  } else if (c == '+') {
-    return 62;
-  } else if (c == '/') {
-    return 63;
-  } else {
-    return 64;
+static int b64enc(struct json_out *out, const unsigned char *p, int n) {
+  char buf[256];
+  int i = 0, len = 0;
+  while (i < n) {
+    int j = 0;
+#if JSON_ENABLE_SIMD && defined(__SSSE3__)
+    for (; i + 16 <= n && j + 16 <= (int) sizeof(buf); i += 12, j += 16) {
+      _mm_storeu_si128((__m128i *) (buf + j), b64enc12(p + i));
+    }
+#endif
+    for (; i + 3 <= n && j + 4 <= (int) sizeof(buf); i += 3, j += 4) {
+      unsigned long v = (unsigned long) p[i] << 16 | p[i + 1] << 8 | p[i + 2];
+      buf[j] = b64_tab[v >> 18];
+      buf[j + 1] = b64_tab[(v >> 12) & 63];
+      buf[j + 2] = b64_tab[(v >> 6) & 63];
+      buf[j + 3] = b64_tab[v & 63];
+    }
+    if (i < n && i + 3 > n && j + 4 <= (int) sizeof(buf)) {
+      /* One or two trailing bytes, padded with '=' */
+      unsigned long v = (unsigned long) p[i] << 16;
+      if (i + 1 < n) v |= p[i + 1] << 8;
+      buf[j] = b64_tab[v >> 18];
+      buf[j + 1] = b64_tab[(v >> 12) & 63];
+      buf[j + 2] = i + 1 < n ? b64_tab[(v >> 6) & 63] : '=';
+      buf[j + 3] = '=';
+      i = n;
+      j += 4;
+    }
+    len += json_out_print(out, buf, j);
   }
+  return len;
 }
 
-static int b64enc(struct json_out *out, const unsigned char *p, int n) {
-  char buf[4];
-  int i, len = 0;
-  for (i = 0; i < n; i += 3) {
-    int a = p[i], b = i + 1 < n ? p[i + 1] : 0, c = i + 2 < n ? p[i + 2] : 0;
-    buf[0] = b64idx(a >> 2);
-    buf[1] = b64idx((a & 3) << 4 | (b >> 4));
-    buf[2] = b64idx((b & 15) << 2 | (c >> 6));
-    buf[3] = b64idx(c & 63);
-    if (i + 1 >= n) buf[2] = '=';
-    if (i + 2 >= n) buf[3] = '=';
-    len += out->printer(out, buf, sizeof(buf));
+/* Return the number of bytes b64dec() produces for `src,n` */
+static size_t b64declen(const char *src, size_t n) {
+  const char *end = src + n;
+  size_t len = 0;
+  for (; src + 3 < end; src += 4) {
+    len += src[2] == '=' ? 1 : src[3] == '=' ? 2 : 3;
   }
   return len;
 }
 
-static int b64dec(const char *src, int n, char *dst) {
+static size_t b64dec(const char *src, size_t n, char *dst) {
   const char *end = src + n;
-  int len = 0;
+  size_t len = 0;
   while (src + 3 < end) {
-    int a = b64rev(src[0]), b = b64rev(src[1]), c = b64rev(src[2]),
-        d = b64rev(src[3]);
-    dst[len++] = (a << 2) | (b >> 4);
+    unsigned long v = (unsigned long) B64REV(src[0]) << 18 |
+                      (unsigned long) B64REV(src[1]) << 12 |
+                      B64REV(src[2]) << 6 | B64REV(src[3]);
+    dst[len++] = (char) (v >> 16);
     if (src[2] != '=') {
-      dst[len++] = (b << 4) | (c >> 2);
+      dst[len++] = (char) (v >> 8);
       if (src[3] != '=') {
-        dst[len++] = (c << 6) | d;
+        dst[len++] = (char) v;
       }
     }
     src += 4;
@@ -552,12 +922,86 @@ static int b64dec(const char *src, int n, char *dst) {
 }
 #endif /* JSON_ENABLE_BASE64 */
 
+/* Hex digit value; also accepts upper case digits */
+#define HEXTOI(x) (((x) & 0xf) + ((x) >> 6 & 1) * 9)
+
+#if JSON_ENABLE_HEX
 static unsigned char hexdec(const char *s) {
-#define HEXTOI(x) (x >= '0' && x <= '9' ? x - '0' : x - 'W')
-  int a = tolower(*(const unsigned char *) s);
-  int b = tolower(*(const unsigned char *) (s + 1));
-  return (HEXTOI(a) << 4) | HEXTOI(b);
+  int a = *(const unsigned char *) s;
+  int b = *(const unsigned char *) (s + 1);
+  return (unsigned char) ((HEXTOI(a) << 4) | HEXTOI(b));
+}
+
+static const char hex_tab[] = "0123456789abcdef";
+
+#if JSON_ENABLE_SIMD
+/* Encode 16 bytes at `p` into 32 hex digits at `dst` */
+static void hexenc16(char *dst, const unsigned char *p) {
+  const __m128i mask = _mm_set1_epi8(0xf), nine = _mm_set1_epi8(9);
+  const __m128i zero = _mm_set1_epi8('0'), af = _mm_set1_epi8('a' - '0' - 10);
+  __m128i v = _mm_loadu_si128((const __m128i *) p);
+  __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+  __m128i lo = _mm_and_si128(v, mask);
+  __m128i a = _mm_unpacklo_epi8(hi, lo), b = _mm_unpackhi_epi8(hi, lo);
+  a = _mm_add_epi8(_mm_add_epi8(a, zero),
+                   _mm_and_si128(_mm_cmpgt_epi8(a, nine), af));
+  b = _mm_add_epi8(_mm_add_epi8(b, zero),
+                   _mm_and_si128(_mm_cmpgt_epi8(b, nine), af));
+  _mm_storeu_si128((__m128i *) dst, a);
+  _mm_storeu_si128((__m128i *) (dst + 16), b);
+}
+
+/* Decode 32 hex digits at `s` into 16 bytes, same as hexdec() does */
+static __m128i hexdec16(const char *s) {
+  const __m128i mask = _mm_set1_epi8(0xf), bit6 = _mm_set1_epi8(0x40);
+  const __m128i nine = _mm_set1_epi8(9), low = _mm_set1_epi16(0xff);
+  __m128i a = _mm_loadu_si128((const __m128i *) s);
+  __m128i b = _mm_loadu_si128((const __m128i *) (s + 16));
+  a = _mm_add_epi8(_mm_and_si128(a, mask),
+                   _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(a, bit6), bit6),
+                                 nine));
+  b = _mm_add_epi8(_mm_and_si128(b, mask),
+                   _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(b, bit6), bit6),
+                                 nine));
+  /* Each 16-bit lane holds the high nibble in the low byte and vice versa */
+  a = _mm_and_si128(
+      _mm_or_si128(_mm_slli_epi16(a, 4), _mm_srli_epi16(a, 8)), low);
+  b = _mm_and_si128(
+      _mm_or_si128(_mm_slli_epi16(b, 4), _mm_srli_epi16(b, 8)), low);
+  return _mm_packus_epi16(a, b);
+}
+#endif /* JSON_ENABLE_SIMD */
+
+static int hexenc(struct json_out *out, const unsigned char *p, int n) {
+  char buf[256];
+  int i = 0, len = 0;
+  while (i < n) {
+    int j = 0;
+#if JSON_ENABLE_SIMD
+    for (; i + 16 <= n && j + 32 <= (int) sizeof(buf); i += 16, j += 32) {
+      hexenc16(buf + j, p + i);
+    }
+#endif
+    for (; i < n && j + 2 <= (int) sizeof(buf); i++, j += 2) {
+      buf[j] = hex_tab[p[i] >> 4];
+      buf[j + 1] = hex_tab[p[i] & 0xf];
+    }
+    len += json_out_print(out, buf, j);
+  }
+  return len;
+}
+
+/* Decode `n` bytes from `2 * n` hex digits at `src` into `dst` */
+static void hexdec_buf(const char *src, size_t n, char *dst) {
+  size_t i = 0;
+#if JSON_ENABLE_SIMD
+  for (; i + 16 <= n; i += 16) {
+    _mm_storeu_si128((__m128i *) (dst + i), hexdec16(src + 2 * i));
+  }
+#endif
+  for (; i < n; i++) dst[i] = (char) hexdec(src + 2 * i);
 }
+#endif /* JSON_ENABLE_HEX */
 
 int json_vprintf(struct json_out *out, const char *fmt, va_list xap) WEAK;
 int json_vprintf(struct json_out *out, const char *fmt, va_list xap) {
@@ -568,49 +1012,50 @@ int json_vprintf(struct json_out *out, const char *fmt, va_list xap) {
 
   while (*fmt != '\0') {
     if (strchr(":, \r\n\t[]{}\"", *fmt) != NULL) {
-      len += out->printer(out, fmt, 1);
+      len += json_out_print(out, fmt, 1);
       fmt++;
     } else if (fmt[0] == '%') {
-      char buf[21];
+      char buf[JSON_PRINTF_BUF_SIZE];
       size_t skip = 2;
 
       if (fmt[1] == 'l' && fmt[2] == 'l' && (fmt[3] == 'd' || fmt[3] == 'u')) {
         int64_t val = va_arg(ap, int64_t);
         const char *fmt2 = fmt[3] == 'u' ? "%" UINT64_FMT : "%" INT64_FMT;
         snprintf(buf, sizeof(buf), fmt2, val);
-        len += out->printer(out, buf, strlen(buf));
+        len += json_out_print(out, buf, strlen(buf));
         skip += 2;
       } else if (fmt[1] == 'z' && fmt[2] == 'u') {
         size_t val = va_arg(ap, size_t);
         snprintf(buf, sizeof(buf), "%lu", (unsigned long) val);
-        len += out->printer(out, buf, strlen(buf));
+        len += json_out_print(out, buf, strlen(buf));
         skip += 1;
       } else if (fmt[1] == 'M') {
         json_printf_callback_t f = va_arg(ap, json_printf_callback_t);
-        len += f(out, &ap);
+        int n = f(out, &ap);
+        if (n < 0) {
+          va_end(ap);
+          return n;
+        }
+        len += n;
       } else if (fmt[1] == 'B') {
         int val = va_arg(ap, int);
         const char *str = val ? "true" : "false";
-        len += out->printer(out, str, strlen(str));
+        len += json_out_print(out, str, strlen(str));
       } else if (fmt[1] == 'H') {
 #if JSON_ENABLE_HEX
-        const char *hex = "0123456789abcdef";
-        int i, n = va_arg(ap, int);
+        int n = va_arg(ap, int);
         const unsigned char *p = va_arg(ap, const unsigned char *);
-        len += out->printer(out, quote, 1);
-        for (i = 0; i < n; i++) {
-          len += out->printer(out, &hex[(p[i] >> 4) & 0xf], 1);
-          len += out->printer(out, &hex[p[i] & 0xf], 1);
-        }
-        len += out->printer(out, quote, 1);
+        len += json_out_print(out, quote, 1);
+        len += hexenc(out, p, n);
+        len += json_out_print(out, quote, 1);
 #endif /* JSON_ENABLE_HEX */
       } else if (fmt[1] == 'V') {
 #if JSON_ENABLE_BASE64
         const unsigned char *p = va_arg(ap, const unsigned char *);
         int n = va_arg(ap, int);
-        len += out->printer(out, quote, 1);
+        len += json_out_print(out, quote, 1);
         len += b64enc(out, p, n);
-        len += out->printer(out, quote, 1);
+        len += json_out_print(out, quote, 1);
 #endif /* JSON_ENABLE_BASE64 */
       } else if (fmt[1] == 'Q' ||
                  (fmt[1] == '.' && fmt[2] == '*' && fmt[3] == 'Q')) {
@@ -624,15 +1069,34 @@ int json_vprintf(struct json_out *out, const char *fmt, va_list xap) {
         p = va_arg(ap, char *);
 
         if (p == NULL) {
-          len += out->printer(out, null, 4);
+          len += json_out_print(out, null, 4);
         } else {
           if (fmt[1] == 'Q') {
             l = strlen(p);
           }
-          len += out->printer(out, quote, 1);
+          len += json_out_print(out, quote, 1);
           len += json_escape(out, p, l);
-          len += out->printer(out, quote, 1);
+          len += json_out_print(out, quote, 1);
+        }
+      } else if (fmt[1] == 's' ||
+                 (fmt[1] == '.' && fmt[2] == '*' && fmt[3] == 's')) {
+        /* Print strings as is, without copying them into `buf` */
+        int prec = -1;
+        size_t l = 0;
+        const char *p;
+
+        if (fmt[1] == '.') {
+          prec = va_arg(ap, int);
+          skip += 2;
+        }
+        p = va_arg(ap, const char *);
+        if (p == NULL) p = "(null)";
+        if (prec < 0) {
+          l = strlen(p);
+        } else {
+          while (l < (size_t) prec && p[l] != '\0') l++;
         }
+        len += json_out_print(out, p, l);
       } else {
         /*
          * we delegate printing to the system printf.
@@ -640,9 +1104,9 @@ int json_vprintf(struct json_out *out, const char *fmt, va_list xap) {
          * printf, as you can see below we still have to parse the format
          * types.
          *
-         * Currently, %s with strings longer than 20 chars will require
-         * double-buffering (an auxiliary buffer will be allocated from heap).
-         * TODO(dfrank): reimplement %s and %.*s in order to avoid that.
+         * Conversions longer than `buf` require double-buffering: an
+         * auxiliary buffer is taken from the allocator. If that fails,
+         * printing stops with JSON_NO_MEMORY.
          */
 
         const char *end_of_format_specifier = "sdfFeEgGlhuIcx.*-0123456789";
@@ -651,8 +1115,15 @@ int json_vprintf(struct json_out *out, const char *fmt, va_list xap) {
         int need_len, size = sizeof(buf);
         char fmt2[20];
         va_list ap_copy;
-        strncpy(fmt2, fmt,
-                n + 1 > (int) sizeof(fmt2) ? sizeof(fmt2) : (size_t) n + 1);
+        /*
+         * A conversion too long for fmt2 is an error: cutting it would make
+         * vsnprintf() consume other arguments than the code below skips
+         */
+        if (n > (int) sizeof(fmt2) - 2) {
+          va_end(ap);
+          return JSON_STRING_INVALID;
+        }
+        memcpy(fmt2, fmt, n + 1);
         fmt2[n + 1] = '\0';
 
         va_copy(ap_copy, ap);
@@ -666,9 +1137,9 @@ int json_vprintf(struct json_out *out, const char *fmt, va_list xap) {
            */
           pbuf = NULL;
           while (need_len < 0) {
-            free(pbuf);
+            json_free(pbuf);
             size *= 2;
-            if ((pbuf = (char *) malloc(size)) == NULL) break;
+            if ((pbuf = (char *) json_malloc(size)) == NULL) break;
             va_copy(ap_copy, ap);
             need_len = vsnprintf(pbuf, size, fmt2, ap_copy);
             va_end(ap_copy);
@@ -678,15 +1149,15 @@ int json_vprintf(struct json_out *out, const char *fmt, va_list xap) {
            * resulting string doesn't fit into a stack-allocated buffer `buf`,
            * so we need to allocate a new buffer from heap and use it
            */
-          if ((pbuf = (char *) malloc(need_len + 1)) != NULL) {
+          if ((pbuf = (char *) json_malloc(need_len + 1)) != NULL) {
             va_copy(ap_copy, ap);
             vsnprintf(pbuf, need_len + 1, fmt2, ap_copy);
             va_end(ap_copy);
           }
         }
         if (pbuf == NULL) {
-          buf[0] = '\0';
-          pbuf = buf;
+          va_end(ap);
+          return JSON_NO_MEMORY;
         }
 
         /*
@@ -722,25 +1193,25 @@ int json_vprintf(struct json_out *out, const char *fmt, va_list xap) {
           }
         }
 
-        len += out->printer(out, pbuf, strlen(pbuf));
+        len += json_out_print(out, pbuf, strlen(pbuf));
         skip = n + 1;
 
         /* If buffer was allocated from heap, free it */
         if (pbuf != buf) {
-          free(pbuf);
+          json_free(pbuf);
           pbuf = NULL;
         }
       }
       fmt += skip;
     } else if (*fmt == '_' || json_isalpha(*fmt)) {
-      len += out->printer(out, quote, 1);
+      len += json_out_print(out, quote, 1);
       while (*fmt == '_' || json_isalpha(*fmt) || json_isdigit(*fmt)) {
-        len += out->printer(out, fmt, 1);
+        len += json_out_print(out, fmt, 1);
         fmt++;
       }
-      len += out->printer(out, quote, 1);
+      len += json_out_print(out, quote, 1);
     } else {
-      len += out->printer(out, fmt, 1);
+      len += json_out_print(out, fmt, 1);
       fmt++;
     }
   }
@@ -761,7 +1232,7 @@ int json_printf(struct json_out *out, const char *fmt, ...) {
 
 int json_printf_array(struct json_out *out, va_list *ap) WEAK;
 int json_printf_array(struct json_out *out, va_list *ap) {
-  int len = 0;
+  int n, len = 0;
   char *arr = va_arg(*ap, char *);
   size_t i, arr_size = va_arg(*ap, size_t);
   size_t elem_size = va_arg(*ap, size_t);
@@ -776,10 +1247,12 @@ int json_printf_array(struct json_out *out, va_list *ap) {
            elem_size > sizeof(val) ? sizeof(val) : elem_size);
     if (i > 0) len += json_printf(out, ", ");
     if (strpbrk(fmt, "efg") != NULL) {
-      len += json_printf(out, fmt, val.d);
+      n = json_printf(out, fmt, val.d);
     } else {
-      len += json_printf(out, fmt, val.i);
+      n = json_printf(out, fmt, val.i);
     }
+    if (n < 0) return n;
+    len += n;
   }
   len += json_printf(out, "]", 1);
   return len;
@@ -831,7 +1304,7 @@ int json_walk_args(const char *json_string, int json_string_length,
 int json_walk_args(const char *json_string, int json_string_length,
 		   const struct frozen_args *args)
 {
-  struct frozen frozen[1];
+  struct json_parser frozen[1];
 
   memset(frozen, 0, sizeof(*frozen));
   frozen->end = json_string + json_string_length;
@@ -843,6 +1316,12 @@ int json_walk_args(const char *json_string, int json_string_length,
     frozen->callback = args->callback;
     frozen->callback_data = args->callback_data;
     frozen->limit = args->limit;
+    frozen->strict_utf8 = args->strict_utf8;
+    if (args->stats != NULL) memset(args->stats, 0, sizeof(*args->stats));
+#if JSON_ENABLE_STATS
+    frozen->stats = args->stats;
+    frozen->start_limit = args->limit;
+#endif
   }
 
   TRY(json_doit(frozen));
@@ -852,6 +1331,25 @@ int json_walk_args(const char *json_string, int json_string_length,
   return (frozen->cur - json_string);
 }
 
+ptrdiff_t json_walk_sz(const char *json_string, size_t json_string_length,
+                       json_walk_sz_callback_t callback,
+                       void *callback_data) WEAK;
+ptrdiff_t json_walk_sz(const char *json_string, size_t json_string_length,
+                       json_walk_sz_callback_t callback, void *callback_data) {
+  struct json_parser frozen[1];
+
+  memset(frozen, 0, sizeof(*frozen));
+  frozen->end = json_string + json_string_length;
+  frozen->cur = json_string;
+  frozen->limit = JSON_MAX_DEPTH;
+  frozen->callback_sz = callback;
+  frozen->callback_data = callback_data;
+
+  TRY(json_doit(frozen));
+
+  return (frozen->cur - json_string);
+}
+
 struct scan_array_info {
   int found;
   char path[JSON_MAX_PATH_LEN];
@@ -892,66 +1390,242 @@ struct json_scanf_info {
   void *target;
   void *user_data;
   int type;
+  ptrdiff_t size; /* Size of the caller's buffer for %.*Q, %.*V, %.*H, or -1 */
+  int sz;         /* json_scanf_sz(): lengths are ptrdiff_t, tokens are _sz */
+  char *alloc;    /* Result of %Q, %V, %H allocated for an earlier match */
 };
 
-int json_unescape(const char *src, int slen, char *dst, int dlen) WEAK;
-int json_unescape(const char *src, int slen, char *dst, int dlen) {
-  char *send = (char *) src + slen, *dend = dst + dlen, *orig_dst = dst, *p;
-  const char *esc1 = "\"\\/bfnrt", *esc2 = "\"\\/\b\f\n\r\t";
+/* Store an allocated result; a later duplicate key replaces an earlier one */
+static void json_scanf_set_alloc(struct json_scanf_info *info, char **dst,
+                                 char *p) {
+  json_free(info->alloc);
+  info->alloc = *dst = p;
+}
 
-  while (src < send) {
-    if (*src == '\\') {
-      if (++src >= send) return JSON_STRING_INCOMPLETE;
-      if (*src == 'u') {
-        if (send - src < 5) return JSON_STRING_INCOMPLETE;
-        /* Here we go: this is a \u.... escape. Process simple one-byte chars */
-        if (src[1] == '0' && src[2] == '0') {
-          /* This is \u00xx character from the ASCII range */
-          if (dst < dend) *dst = hexdec(src + 3);
-          src += 4;
-        } else {
-          /* Complex \uXXXX escapes drag utf8 lib... Do it at some stage */
-          return JSON_STRING_INVALID;
-        }
-      } else if ((p = (char *) strchr(esc1, *src)) != NULL) {
-        if (dst < dend) *dst = esc2[p - esc1];
-      } else {
+/* Length placeholders are `int *`, or `ptrdiff_t *` for json_scanf_sz() */
+static ptrdiff_t json_scanf_get_len(const struct json_scanf_info *info,
+                                    const void *target) {
+  return info->sz ? *(const ptrdiff_t *) target : *(const int *) target;
+}
+
+static void json_scanf_set_len(const struct json_scanf_info *info,
+                               void *target, ptrdiff_t n) {
+  if (info->sz) {
+    *(ptrdiff_t *) target = n;
+  } else {
+    *(int *) target = (int) n;
+  }
+}
+
+/* Return the length of the leading part of `p,len` without backslashes */
+static size_t json_unesc_run(const char *p, size_t len) {
+  size_t i = 0;
+#if JSON_ENABLE_SIMD
+  const __m128i bslash = _mm_set1_epi8('\\');
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (p + i));
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, bslash));
+    if (mask != 0) return i + json_ctz((unsigned int) mask);
+  }
+#endif
+  while (i < len && p[i] != '\\') i++;
+  return i;
+}
+
+/* Decode 4 hex digits at `s`, or return -1 if they are not all hex */
+static long json_hex4(const char *s) {
+  long v = 0;
+  int i;
+  for (i = 0; i < 4; i++) {
+    int ch = ((const unsigned char *) s)[i];
+    if (!json_isxdigit(ch)) return -1;
+    v = v << 4 | HEXTOI(ch);
+  }
+  return v;
+}
+
+/* Encode code point `cp` as UTF-8 into `buf`, return the number of bytes */
+static int json_utf8_encode(long cp, char *buf) {
+  if (cp < 0x80) {
+    buf[0] = (char) cp;
+    return 1;
+  } else if (cp < 0x800) {
+    buf[0] = (char) (0xc0 | cp >> 6);
+    buf[1] = (char) (0x80 | (cp & 0x3f));
+    return 2;
+  } else if (cp < 0x10000) {
+    buf[0] = (char) (0xe0 | cp >> 12);
+    buf[1] = (char) (0x80 | (cp >> 6 & 0x3f));
+    buf[2] = (char) (0x80 | (cp & 0x3f));
+    return 3;
+  }
+  buf[0] = (char) (0xf0 | cp >> 18);
+  buf[1] = (char) (0x80 | (cp >> 12 & 0x3f));
+  buf[2] = (char) (0x80 | (cp >> 6 & 0x3f));
+  buf[3] = (char) (0x80 | (cp & 0x3f));
+  return 4;
+}
+
+/*
+ * Decode the escape at `*src`, which points to a backslash, into `buf` and
+ * move `*src` past it. Return the number of decoded bytes, or negative error.
+ */
+static int json_unescape_one(const char **src, const char *send, char *buf) {
+  const char *p = *src;
+  long cp, lo;
+  int k = 1;
+  if (++p >= send) return JSON_STRING_INCOMPLETE;
+  switch (*p) {
+    case '"':
+    case '\\':
+    case '/':
+      buf[0] = *p;
+      break;
+    case 'b':
+      buf[0] = '\b';
+      break;
+    case 'f':
+      buf[0] = '\f';
+      break;
+    case 'n':
+      buf[0] = '\n';
+      break;
+    case 'r':
+      buf[0] = '\r';
+      break;
+    case 't':
+      buf[0] = '\t';
+      break;
+    case 'u':
+      if (send - p < 5) return JSON_STRING_INCOMPLETE;
+      if ((cp = json_hex4(p + 1)) < 0) return JSON_STRING_INVALID;
+      p += 4;
+      if (cp >= 0xd800 && cp <= 0xdbff) {
+        /* A high surrogate must be followed by an escaped low surrogate */
+        if (send - p < 7) return JSON_STRING_INCOMPLETE;
+        lo = p[1] == '\\' && p[2] == 'u' ? json_hex4(p + 3) : -1;
+        if (lo < 0xdc00 || lo > 0xdfff) return JSON_STRING_INVALID;
+        cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+        p += 6;
+      } else if (cp >= 0xdc00 && cp <= 0xdfff) {
         return JSON_STRING_INVALID;
       }
-    } else {
-      if (dst < dend) *dst = *src;
+      k = json_utf8_encode(cp, buf);
+      break;
+    default:
+      return JSON_STRING_INVALID;
+  }
+  *src = p + 1;
+  return k;
+}
+
+ptrdiff_t json_unescape_sz(const char *src, size_t slen, char *dst,
+                           size_t dlen) WEAK;
+ptrdiff_t json_unescape_sz(const char *src, size_t slen, char *dst,
+                           size_t dlen) {
+  const char *send = src + slen;
+  size_t n = 0;
+  char buf[4];
+  int i, k;
+
+  while (src < send) {
+    /* Copy the whole run up to the next backslash at once */
+    size_t run = json_unesc_run(src, send - src);
+    if (run > 0) {
+      /* src and dst may overlap */
+      if (n < dlen) memmove(dst + n, src, run < dlen - n ? run : dlen - n);
+      n += run;
+      src += run;
+      continue;
+    }
+    if ((k = json_unescape_one(&src, send, buf)) < 0) return k;
+    /* Decoded bytes never outrun the escape, so in-place decoding works */
+    for (i = 0; i < k; i++, n++) {
+      if (n < dlen) dst[n] = buf[i];
     }
-    dst++;
-    src++;
   }
 
-  return dst - orig_dst;
+  return (ptrdiff_t) n;
 }
 
-static void json_scanf_cb(void *callback_data, const char *name,
-                          size_t name_len, const char *path,
-                          const struct json_token *token) {
-  struct json_scanf_info *info = (struct json_scanf_info *) callback_data;
-  char buf[32]; /* Must be enough to hold numbers */
-
-  (void) name;
-  (void) name_len;
+int json_unescape(const char *src, int slen, char *dst, int dlen) WEAK;
+int json_unescape(const char *src, int slen, char *dst, int dlen) {
+  return (int) json_unescape_sz(src, slen < 0 ? 0 : slen, dst,
+                                dlen < 0 ? 0 : dlen);
+}
 
-  if (token->ptr == NULL) {
-    /*
-     * We're not interested here in the events for which we have no value;
-     * namely, JSON_TYPE_OBJECT_START and JSON_TYPE_ARRAY_START
-     */
-    return;
-  }
+/*
+ * Handle %.*Q, %.*V and %.*H: decode the token into the caller's buffer.
+ * The conversion is counted only if the NUL-terminated result fits.
+ */
+static void json_scanf_to_buf(struct json_scanf_info *info,
+                              const struct json_token_sz *token) {
+  char *dst = (char *) info->user_data;
+  ptrdiff_t n = -1, size = info->size;
 
-  if (strcmp(path, info->path) != 0) {
-    /* It's not the path we're looking for, so, just ignore this callback */
+  if (token->type == JSON_TYPE_NULL) {
+    json_scanf_set_len(info, info->target, -1);
     return;
   }
 
   switch (info->type) {
-    case 'B':
+    case 'Q':
+      n = json_unescape_sz(token->ptr, token->len, dst,
+                           size > 0 ? size - 1 : 0);
+      break;
+#if JSON_ENABLE_HEX
+    case 'H':
+      n = token->len / 2;
+      if (n < size) hexdec_buf(token->ptr, n, dst);
+      break;
+#endif
+#if JSON_ENABLE_BASE64
+    case 'V':
+      n = (ptrdiff_t) b64declen(token->ptr, token->len);
+      if (n < size) n = (ptrdiff_t) b64dec(token->ptr, token->len, dst);
+      break;
+#endif
+    default:
+      return;
+  }
+
+  if (n < 0) return;
+  json_scanf_set_len(info, info->target, n);
+  if (n < size) {
+    dst[n] = '\0';
+    info->num_conversions++;
+  }
+}
+
+static void json_scanf_cb(void *callback_data, const char *name,
+                          size_t name_len, const char *path,
+                          const struct json_token_sz *token) {
+  struct json_scanf_info *info = (struct json_scanf_info *) callback_data;
+  char buf[32]; /* Must be enough to hold numbers */
+
+  (void) name;
+  (void) name_len;
+
+  if (token->ptr == NULL) {
+    /*
+     * We're not interested here in the events for which we have no value;
+     * namely, JSON_TYPE_OBJECT_START and JSON_TYPE_ARRAY_START
+     */
+    return;
+  }
+
+  if (strcmp(path, info->path) != 0) {
+    /* It's not the path we're looking for, so, just ignore this callback */
+    return;
+  }
+
+  if (info->size >= 0) {
+    json_scanf_to_buf(info, token);
+    return;
+  }
+
+  switch (info->type) {
+    case 'B':
       info->num_conversions++;
       switch (sizeof(bool)) {
         case sizeof(char):
@@ -969,41 +1643,42 @@ static void json_scanf_cb(void *callback_data, const char *name,
       union {
         void *p;
         json_scanner_t f;
+        json_scanner_sz_t f_sz;
       } u = {info->target};
       info->num_conversions++;
-      u.f(token->ptr, token->len, info->user_data);
+      if (info->sz) {
+        u.f_sz(token->ptr, token->len, info->user_data);
+      } else {
+        u.f(token->ptr, (int) token->len, info->user_data);
+      }
       break;
     }
     case 'Q': {
-      char **dst = (char **) info->target;
+      char **dst = (char **) info->target, *p;
       if (token->type == JSON_TYPE_NULL) {
-        *dst = NULL;
-      } else {
-        int unescaped_len = json_unescape(token->ptr, token->len, NULL, 0);
-        if (unescaped_len >= 0 &&
-            (*dst = (char *) malloc(unescaped_len + 1)) != NULL) {
+        json_scanf_set_alloc(info, dst, NULL);
+      } else if ((p = (char *) json_malloc(token->len + 1)) != NULL) {
+        /* Unescaped string is never longer than the escaped one */
+        ptrdiff_t n = json_unescape_sz(token->ptr, token->len, p, token->len);
+        if (n >= 0) {
+          p[n] = '\0';
+          json_scanf_set_alloc(info, dst, p);
           info->num_conversions++;
-          if (json_unescape(token->ptr, token->len, *dst, unescaped_len) ==
-              unescaped_len) {
-            (*dst)[unescaped_len] = '\0';
-          } else {
-            free(*dst);
-            *dst = NULL;
-          }
+        } else {
+          json_free(p);
         }
       }
       break;
     }
     case 'H': {
 #if JSON_ENABLE_HEX
-      char **dst = (char **) info->user_data;
-      int i, len = token->len / 2;
-      *(int *) info->target = len;
-      if ((*dst = (char *) malloc(len + 1)) != NULL) {
-        for (i = 0; i < len; i++) {
-          (*dst)[i] = hexdec(token->ptr + 2 * i);
-        }
-        (*dst)[len] = '\0';
+      char **dst = (char **) info->user_data, *p;
+      size_t len = token->len / 2;
+      json_scanf_set_len(info, info->target, len);
+      if ((p = (char *) json_malloc(len + 1)) != NULL) {
+        hexdec_buf(token->ptr, len, p);
+        p[len] = '\0';
+        json_scanf_set_alloc(info, dst, p);
         info->num_conversions++;
       }
 #endif /* JSON_ENABLE_HEX */
@@ -1011,12 +1686,13 @@ static void json_scanf_cb(void *callback_data, const char *name,
     }
     case 'V': {
 #if JSON_ENABLE_BASE64
-      char **dst = (char **) info->target;
-      int len = token->len * 4 / 3 + 2;
-      if ((*dst = (char *) malloc(len + 1)) != NULL) {
-        int n = b64dec(token->ptr, token->len, *dst);
-        (*dst)[n] = '\0';
-        *(int *) info->user_data = n;
+      char **dst = (char **) info->target, *p;
+      size_t len = token->len / 4 * 3 + 3;
+      if ((p = (char *) json_malloc(len + 1)) != NULL) {
+        size_t n = b64dec(token->ptr, token->len, p);
+        p[n] = '\0';
+        json_scanf_set_len(info, info->user_data, n);
+        json_scanf_set_alloc(info, dst, p);
         info->num_conversions++;
       }
 #endif /* JSON_ENABLE_BASE64 */
@@ -1024,10 +1700,17 @@ static void json_scanf_cb(void *callback_data, const char *name,
     }
     case 'T':
       info->num_conversions++;
-      *(struct json_token *) info->target = *token;
+      if (info->sz) {
+        *(struct json_token_sz *) info->target = *token;
+      } else {
+        struct json_token *t = (struct json_token *) info->target;
+        t->ptr = token->ptr;
+        t->len = (int) token->len;
+        t->type = token->type;
+      }
       break;
     default:
-      if (token->len >= (int) sizeof(buf)) break;
+      if (token->len >= sizeof(buf)) break;
       /* Before converting, copy into tmp buffer in order to 0-terminate it */
       memcpy(buf, token->ptr, token->len);
       buf[token->len] = '\0';
@@ -1065,12 +1748,13 @@ static void json_scanf_cb(void *callback_data, const char *name,
   }
 }
 
-int json_vscanf(const char *s, int len, const char *fmt, va_list ap) WEAK;
-int json_vscanf(const char *s, int len, const char *fmt, va_list ap) {
+static int json_vscanf_common(const char *s, size_t len, const char *fmt,
+                              va_list ap, int sz) {
   char path[JSON_MAX_PATH_LEN] = "", fmtbuf[20];
   int i = 0;
   char *p = NULL;
-  struct json_scanf_info info = {0, path, fmtbuf, NULL, NULL, 0};
+  struct json_scanf_info info = {0, path, fmtbuf, NULL, NULL, 0, -1, 0, NULL};
+  info.sz = sz;
 
   while (fmt[i] != '\0') {
     if (fmt[i] == '{') {
@@ -1082,17 +1766,22 @@ int json_vscanf(const char *s, int len, const char *fmt, va_list ap) {
     } else if (fmt[i] == '%') {
       info.target = va_arg(ap, void *);
       info.type = fmt[i + 1];
+      info.size = -1;
+      info.alloc = NULL;
       switch (fmt[i + 1]) {
-        case 'M':
-        case 'V':
-        case 'H':
-          info.user_data = va_arg(ap, void *);
+        case '.':
+          if (fmt[i + 2] == '*' && fmt[i + 3] != '\0' &&
+              strchr("QVH", fmt[i + 3]) != NULL) {
+            /* %.*Q, %.*V, %.*H: decode into a caller-supplied buffer */
+            info.type = fmt[i + 3];
+            info.size = json_scanf_get_len(&info, info.target);
+            /* A length set to -1 by a null value means no room */
+            if (info.size < 0) info.size = 0;
+            info.user_data = va_arg(ap, void *);
+            i += 4;
+            break;
+          }
         /* FALLTHROUGH */
-        case 'B':
-        case 'Q':
-        case 'T':
-          i += 2;
-          break;
         default: {
           const char *delims = ", \t\r\n]}";
           int conv_len = strcspn(fmt + i + 1, delims) + 1;
@@ -1103,8 +1792,18 @@ int json_vscanf(const char *s, int len, const char *fmt, va_list ap) {
             i += strspn(fmt + i, delims);
           break;
         }
+        case 'M':
+        case 'V':
+        case 'H':
+          info.user_data = va_arg(ap, void *);
+        /* FALLTHROUGH */
+        case 'B':
+        case 'Q':
+        case 'T':
+          i += 2;
+          break;
       }
-      json_walk(s, len, json_scanf_cb, &info);
+      json_walk_sz(s, len, json_scanf_cb, &info);
     } else if (json_isalpha(fmt[i]) || json_get_utf8_char_len(fmt[i]) > 1) {
       char *pe;
       const char *delims = ": \r\n\t";
@@ -1121,6 +1820,27 @@ int json_vscanf(const char *s, int len, const char *fmt, va_list ap) {
   return info.num_conversions;
 }
 
+int json_vscanf(const char *s, int len, const char *fmt, va_list ap) WEAK;
+int json_vscanf(const char *s, int len, const char *fmt, va_list ap) {
+  return json_vscanf_common(s, len < 0 ? 0 : len, fmt, ap, 0);
+}
+
+int json_vscanf_sz(const char *s, size_t len, const char *fmt,
+                   va_list ap) WEAK;
+int json_vscanf_sz(const char *s, size_t len, const char *fmt, va_list ap) {
+  return json_vscanf_common(s, len, fmt, ap, 1);
+}
+
+int json_scanf_sz(const char *str, size_t len, const char *fmt, ...) WEAK;
+int json_scanf_sz(const char *str, size_t len, const char *fmt, ...) {
+  int result;
+  va_list ap;
+  va_start(ap, fmt);
+  result = json_vscanf_sz(str, len, fmt, ap);
+  va_end(ap);
+  return result;
+}
+
 int json_scanf(const char *str, int len, const char *fmt, ...) WEAK;
 int json_scanf(const char *str, int len, const char *fmt, ...) {
   int result;
@@ -1131,6 +1851,297 @@ int json_scanf(const char *str, int len, const char *fmt, ...) {
   return result;
 }
 
+struct json_struct_info {
+  const struct json_field *fields;  /* Descriptors of the current struct */
+  int num_fields;
+  char *base;                       /* The current struct */
+  int depth;                        /* Number of entered objects */
+  int skip;                         /* Depth of skipped containers */
+  const struct json_field *skipped; /* Field of the skipped container */
+  const struct json_field *stack[JSON_MAX_STRUCT_DEPTH]; /* Entered fields */
+  const struct json_field *root;    /* Descriptors of the top-level struct */
+  int num_root;
+  int num_conversions;
+  struct json_struct_error *err;
+};
+
+static void json_struct_mismatch(struct json_struct_info *info,
+                                 const struct json_field *f,
+                                 const struct json_token *token) {
+  struct json_struct_error *err = info->err;
+  if (err == NULL) return;
+  if (err->num_errors++ == 0) {
+    err->field = f;
+    err->token = *token;
+  }
+}
+
+static const struct json_field *json_struct_find(
+    const struct json_struct_info *info, const char *name, size_t name_len) {
+  int i;
+  if (name == NULL) return NULL;
+  for (i = 0; i < info->num_fields; i++) {
+    const char *n = info->fields[i].name;
+    if (strncmp(n, name, name_len) == 0 && n[name_len] == '\0') {
+      return &info->fields[i];
+    }
+  }
+  return NULL;
+}
+
+/* Parse an integer number without fraction or exponent, return 0 if not */
+static int json_struct_int64(const struct json_token *token, int64_t *v) {
+  const char *p = token->ptr, *end = token->ptr + token->len;
+  uint64_t n = 0, max = ((uint64_t) 1 << 63) - 1;
+  int neg = 0;
+
+  if (p < end && *p == '-') {
+    neg = 1;
+    max++;
+    p++;
+  }
+  if (p == end) return 0;
+  for (; p < end; p++) {
+    unsigned d = (unsigned) (*p - '0');
+    if (d > 9 || n > (max - d) / 10) return 0;
+    n = n * 10 + d;
+  }
+  /* -(n - 1) - 1 does not overflow for n == 2^63 */
+  *v = neg ? -(int64_t) (n - 1) - 1 : (int64_t) n;
+  return 1;
+}
+
+/* Decode a scalar `token` into field `f`, return 0 on mismatch */
+static int json_struct_scalar(char *dst, const struct json_field *f,
+                              const struct json_token *token) {
+  int64_t i64;
+
+  switch (f->type) {
+    case JSON_FIELD_BOOL:
+      if (token->type != JSON_TYPE_TRUE && token->type != JSON_TYPE_FALSE) {
+        return 0;
+      }
+      *(bool *) dst = (token->type == JSON_TYPE_TRUE);
+      return 1;
+    case JSON_FIELD_INT:
+      if (token->type != JSON_TYPE_NUMBER || !json_struct_int64(token, &i64) ||
+          i64 < INT_MIN || i64 > INT_MAX) {
+        return 0;
+      }
+      *(int *) dst = (int) i64;
+      return 1;
+    case JSON_FIELD_INT64:
+      if (token->type != JSON_TYPE_NUMBER || !json_struct_int64(token, &i64)) {
+        return 0;
+      }
+      *(int64_t *) dst = i64;
+      return 1;
+#if !JSON_MINIMAL
+    case JSON_FIELD_DOUBLE: {
+      char buf[64];
+      if (token->type != JSON_TYPE_NUMBER || token->len >= (int) sizeof(buf)) {
+        return 0;
+      }
+      /* Before converting, copy into tmp buffer in order to 0-terminate it */
+      memcpy(buf, token->ptr, token->len);
+      buf[token->len] = '\0';
+      *(double *) dst = strtod(buf, NULL);
+      return 1;
+    }
+#endif
+    case JSON_FIELD_STRING: {
+      int n = token->len;
+      if (token->type != JSON_TYPE_STRING) return 0;
+      if (memchr(token->ptr, '\\', n) == NULL) {
+        if ((size_t) n >= f->size) return 0;
+        memcpy(dst, token->ptr, n);
+      } else {
+        /* Count first, so that dst is left unchanged on a mismatch */
+        n = json_unescape(token->ptr, token->len, NULL, 0);
+        if (n < 0 || (size_t) n >= f->size) return 0;
+        json_unescape(token->ptr, token->len, dst, n);
+      }
+      dst[n] = '\0';
+      return 1;
+    }
+    case JSON_FIELD_TOKEN:
+      *(struct json_token *) dst = *token;
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+static void json_scanf_struct_cb(void *callback_data, const char *name,
+                                 size_t name_len, const char *path,
+                                 const struct json_token *token) {
+  struct json_struct_info *info = (struct json_struct_info *) callback_data;
+  const struct json_field *f;
+
+  (void) path;
+
+  switch (token->type) {
+    case JSON_TYPE_OBJECT_START:
+    case JSON_TYPE_ARRAY_START:
+      if (info->skip > 0) {
+        info->skip++;
+        return;
+      }
+      if (info->depth == 0 && name == NULL) {
+        /* The top-level value */
+        if (token->type == JSON_TYPE_OBJECT_START) {
+          info->depth = 1;
+        } else {
+          info->skip = 1;
+        }
+        return;
+      }
+      f = json_struct_find(info, name, name_len);
+      if (f != NULL && f->type == JSON_FIELD_OBJECT &&
+          token->type == JSON_TYPE_OBJECT_START &&
+          info->depth <= JSON_MAX_STRUCT_DEPTH) {
+        info->stack[info->depth - 1] = f;
+        info->depth++;
+        info->fields = f->fields;
+        info->num_fields = f->num_fields;
+        info->base += f->offset;
+        return;
+      }
+      /* Decoded or reported when the container ends */
+      info->skipped = f;
+      info->skip = 1;
+      return;
+    case JSON_TYPE_OBJECT_END:
+    case JSON_TYPE_ARRAY_END:
+      if (info->skip > 0) {
+        if (--info->skip == 0 && (f = info->skipped) != NULL) {
+          if (f->type == JSON_FIELD_TOKEN) {
+            *(struct json_token *) (info->base + f->offset) = *token;
+            info->num_conversions++;
+          } else {
+            json_struct_mismatch(info, f, token);
+          }
+          info->skipped = NULL;
+        }
+        return;
+      }
+      if (--info->depth > 0) {
+        f = info->stack[info->depth - 1];
+        info->base -= f->offset;
+        if (info->depth == 1) {
+          info->fields = info->root;
+          info->num_fields = info->num_root;
+        } else {
+          info->fields = info->stack[info->depth - 2]->fields;
+          info->num_fields = info->stack[info->depth - 2]->num_fields;
+        }
+      }
+      return;
+    default:
+      if (info->skip > 0 || info->depth == 0) return;
+      f = json_struct_find(info, name, name_len);
+      if (f == NULL || token->type == JSON_TYPE_NULL) return;
+      if (json_struct_scalar(info->base + f->offset, f, token)) {
+        info->num_conversions++;
+      } else {
+        json_struct_mismatch(info, f, token);
+      }
+      return;
+  }
+}
+
+int json_scanf_struct(const char *s, int len, const struct json_field *fields,
+                      int num_fields, void *dst,
+                      struct json_struct_error *err) WEAK;
+int json_scanf_struct(const char *s, int len, const struct json_field *fields,
+                      int num_fields, void *dst,
+                      struct json_struct_error *err) {
+  struct json_struct_info info;
+  int res;
+
+  memset(&info, 0, sizeof(info));
+  info.fields = info.root = fields;
+  info.num_fields = info.num_root = num_fields;
+  info.base = (char *) dst;
+  info.err = err;
+  if (err != NULL) memset(err, 0, sizeof(*err));
+
+  res = json_walk(s, len, json_scanf_struct_cb, &info);
+  return res < 0 ? res : info.num_conversions;
+}
+
+#if !JSON_MINIMAL
+static int json_printf_double(struct json_out *out, double d) {
+  char buf[32];
+
+  /* NaN and infinities */
+  if (d != d || d - d != 0) return json_out_print(out, "null", 4);
+  /* Shortest of the two precisions that reads back as the same number */
+  snprintf(buf, sizeof(buf), "%.15g", d);
+  if (strtod(buf, NULL) != d) snprintf(buf, sizeof(buf), "%.17g", d);
+  return json_out_print(out, buf, strlen(buf));
+}
+#endif
+
+int json_printf_struct(struct json_out *out, const struct json_field *fields,
+                       int num_fields, const void *src) WEAK;
+int json_printf_struct(struct json_out *out, const struct json_field *fields,
+                       int num_fields, const void *src) {
+  int i, n, len = 0;
+
+  len += json_out_print(out, "{", 1);
+  for (i = 0; i < num_fields; i++) {
+    const struct json_field *f = &fields[i];
+    const char *p = (const char *) src + f->offset;
+
+    if (i > 0) len += json_out_print(out, ",", 1);
+    len += json_printf(out, "%Q:", f->name);
+    switch (f->type) {
+      case JSON_FIELD_BOOL:
+        n = json_printf(out, "%B", (int) *(const bool *) p);
+        break;
+      case JSON_FIELD_INT:
+        n = json_printf(out, "%d", *(const int *) p);
+        break;
+      case JSON_FIELD_INT64:
+        n = json_printf(out, "%lld", *(const int64_t *) p);
+        break;
+#if !JSON_MINIMAL
+      case JSON_FIELD_DOUBLE:
+        n = json_printf_double(out, *(const double *) p);
+        break;
+#endif
+      case JSON_FIELD_STRING: {
+        size_t l = 0;
+        while (l < f->size && p[l] != '\0') l++;
+        n = json_printf(out, "%.*Q", (int) l, p);
+        break;
+      }
+      case JSON_FIELD_TOKEN: {
+        const struct json_token *t = (const struct json_token *) p;
+        if (t->ptr == NULL) {
+          n = json_out_print(out, "null", 4);
+        } else if (t->type == JSON_TYPE_STRING) {
+          n = json_printf(out, "\"%.*s\"", t->len, t->ptr);
+        } else {
+          n = json_out_print(out, t->ptr, t->len);
+        }
+        break;
+      }
+      case JSON_FIELD_OBJECT:
+        n = json_printf_struct(out, f->fields, f->num_fields, p);
+        break;
+      default:
+        n = json_out_print(out, "null", 4);
+        break;
+    }
+    if (n < 0) return n;
+    len += n;
+  }
+  len += json_out_print(out, "}", 1);
+  return len;
+}
+
 int json_vfprintf(const char *file_name, const char *fmt, va_list ap) WEAK;
 int json_vfprintf(const char *file_name, const char *fmt, va_list ap) {
   int res = -1;
@@ -1163,10 +2174,10 @@ char *json_fread(const char *path) {
     fclose(fp);
   } else {
     long size = ftell(fp);
-    if (size > 0 && (data = (char *) malloc(size + 1)) != NULL) {
+    if (size > 0 && (data = (char *) json_malloc(size + 1)) != NULL) {
       fseek(fp, 0, SEEK_SET); /* Some platforms might not have rewind(), Oo */
       if (fread(data, 1, size, fp) != (size_t) size) {
-        free(data);
+        json_free(data);
         data = NULL;
       } else {
         data[size] = '\0';
@@ -1177,13 +2188,118 @@ char *json_fread(const char *path) {
   return data;
 }
 
+enum json_mmap_type { JSON_MMAP_NONE, JSON_MMAP_MAPPED, JSON_MMAP_HEAP };
+
+/* Read the whole stream into memory from the allocator */
+static int json_mmap_read(struct json_mmap *m, FILE *fp) {
+  size_t size = 0, n;
+  char *buf = NULL, *p;
+  do {
+    if (m->len == size) {
+      size = size == 0 ? 4096 : size * 2;
+      if (size <= m->len || (p = (char *) json_realloc(buf, size)) == NULL) {
+        json_free(buf);
+        return JSON_NO_MEMORY;
+      }
+      buf = p;
+    }
+    n = fread(buf + m->len, 1, size - m->len, fp);
+    m->len += n;
+  } while (n > 0);
+  if (ferror(fp)) {
+    json_free(buf);
+    return -1;
+  }
+  m->ptr = buf;
+  m->type = JSON_MMAP_HEAP;
+  return 0;
+}
+
+int json_mmap_open(struct json_mmap *m, const char *file_name) WEAK;
+int json_mmap_open(struct json_mmap *m, const char *file_name) {
+  FILE *fp;
+  int res;
+  memset(m, 0, sizeof(*m));
+  m->ptr = "";
+#if JSON_ENABLE_MMAP && defined(_WIN32)
+  {
+    HANDLE fh = CreateFileA(file_name, GENERIC_READ, FILE_SHARE_READ, NULL,
+                            OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    HANDLE mh = NULL;
+    DWORD high = 0, low;
+    uint64_t size;
+    void *view = NULL;
+    if (fh == INVALID_HANDLE_VALUE) return -1;
+    low = GetFileSize(fh, &high);
+    size = ((uint64_t) high << 32) | low;
+    if (size > 0 && size <= (size_t) -1 &&
+        (mh = CreateFileMappingA(fh, NULL, PAGE_READONLY, 0, 0, NULL)) !=
+            NULL) {
+      view = MapViewOfFile(mh, FILE_MAP_READ, 0, 0, 0);
+      CloseHandle(mh);
+    }
+    CloseHandle(fh);
+    if (view != NULL) {
+      m->ptr = (const char *) view;
+      m->len = (size_t) size;
+      m->type = JSON_MMAP_MAPPED;
+      return 0;
+    }
+  }
+#elif JSON_ENABLE_MMAP
+  {
+    int fd = open(file_name, O_RDONLY);
+    struct stat st;
+    void *view = MAP_FAILED;
+    if (fd < 0) return -1;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+        (uint64_t) st.st_size <= (size_t) -1) {
+      view = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (view != MAP_FAILED) {
+#ifdef POSIX_MADV_SEQUENTIAL
+      /*
+       * The parser reads front to back: ask for aggressive read-ahead.
+       * Not declared if a header-only user included system headers in
+       * strict ISO mode before frozen.h.
+       */
+      posix_madvise(view, (size_t) st.st_size, POSIX_MADV_SEQUENTIAL);
+#endif
+      m->ptr = (const char *) view;
+      m->len = (size_t) st.st_size;
+      m->type = JSON_MMAP_MAPPED;
+      return 0;
+    }
+  }
+#endif /* JSON_ENABLE_MMAP */
+
+  /* Pipes, empty files and platforms without mmap are read */
+  if ((fp = fopen(file_name, "rb")) == NULL) return -1;
+  res = json_mmap_read(m, fp);
+  fclose(fp);
+  if (res < 0) memset(m, 0, sizeof(*m));
+  return res;
+}
+
+void json_mmap_close(struct json_mmap *m) WEAK;
+void json_mmap_close(struct json_mmap *m) {
+  if (m->type == JSON_MMAP_HEAP) {
+    json_free((void *) m->ptr);
+  } else if (m->type == JSON_MMAP_MAPPED) {
+#if JSON_ENABLE_MMAP && defined(_WIN32)
+    UnmapViewOfFile(m->ptr);
+#elif JSON_ENABLE_MMAP
+    munmap((void *) m->ptr, m->len);
+#endif
+  }
+  memset(m, 0, sizeof(*m));
+}
+
 struct json_setf_data {
-  const char *json_path;
-  const char *base; /* Pointer to the source JSON string */
-  int matched;      /* Matched part of json_path */
-  int pos;          /* Offset of the mutated value begin */
-  int end;          /* Offset of the mutated value end */
-  int prev;         /* Offset of the previous token end */
+  const char *base;         /* Pointer to the source JSON string */
+  struct json_setf_op *ops; /* Mutations being tracked */
+  int num_ops;
 };
 
 static int get_matched_prefix_len(const char *s1, const char *s2) {
@@ -1192,28 +2308,48 @@ static int get_matched_prefix_len(const char *s1, const char *s2) {
   return i;
 }
 
-static void json_vsetf_cb(void *userdata, const char *name, size_t name_len,
-                          const char *path, const struct json_token *t) {
-  struct json_setf_data *data = (struct json_setf_data *) userdata;
-  int off, len = get_matched_prefix_len(path, data->json_path);
-  if (t->ptr == NULL) return;
-  off = t->ptr - data->base;
-  if (len > data->matched) data->matched = len;
+static void json_setf_track(struct json_setf_op *op, const char *path,
+                            const struct json_token_sz *t, ptrdiff_t off) {
+  int len = get_matched_prefix_len(path, op->json_path);
+  ptrdiff_t end = off + t->len;
+
+  /*
+   * Entering the matched object/array. Stop tracking previous value ends,
+   * so that they do not point inside it.
+   */
+  if (t->ptr == NULL) {
+    if (strcmp(path, op->json_path) == 0) op->found = -1;
+    return;
+  }
+  if (len > op->matched) op->matched = len;
+  if (t->type == JSON_TYPE_STRING) off--, end++; /* Include the quotes */
+
+  /*
+   * If the deepest existing parent of a missing path is an empty object or
+   * array, set the mutation position right after its opening brace/bracket
+   */
+  if (op->pos == 0 && path[len] == '\0' && op->prev <= off &&
+      (op->json_path[len] == '.' || op->json_path[len] == '[') &&
+      (t->type == JSON_TYPE_OBJECT_END || t->type == JSON_TYPE_ARRAY_END)) {
+    op->pos = op->end = op->prev = off + 1;
+    op->matched = len + 1;
+  }
 
   /*
    * If there is no exact path match, set the mutation position to tbe end
    * of the object or array
    */
-  if (len < data->matched && data->pos == 0 &&
+  if (len < op->matched && op->pos == 0 &&
       (t->type == JSON_TYPE_OBJECT_END || t->type == JSON_TYPE_ARRAY_END)) {
-    data->pos = data->end = data->prev;
+    op->pos = op->end = op->prev;
   }
 
   /* Exact path match. Set mutation position to the value of this token */
-  if (strcmp(path, data->json_path) == 0 && t->type != JSON_TYPE_OBJECT_START &&
+  if (strcmp(path, op->json_path) == 0 && t->type != JSON_TYPE_OBJECT_START &&
       t->type != JSON_TYPE_ARRAY_START) {
-    data->pos = off;
-    data->end = off + t->len;
+    op->pos = off;
+    op->end = end;
+    op->found = 1;
   }
 
   /*
@@ -1224,46 +2360,72 @@ static void json_vsetf_cb(void *userdata, const char *name, size_t name_len,
    * of the object/array, we catch the end of the object/array and see
    * whether the object/array start is closer then previously stored prev.
    */
-  if (data->pos == 0) {
-    data->prev = off + t->len; /* pos is not yet set */
-  } else if ((t->ptr[0] == '[' || t->ptr[0] == '{') && off + 1 < data->pos &&
-             off + 1 > data->prev) {
-    data->prev = off + 1;
+  if (op->pos == 0) {
+    if (op->found == 0) op->prev = end; /* pos is not yet set */
+  } else if ((t->ptr[0] == '[' || t->ptr[0] == '{') && off + 1 <= op->pos &&
+             off + 1 > op->prev) {
+    op->prev = off + 1;
+  }
+}
+
+static void json_vsetf_cb(void *userdata, const char *name, size_t name_len,
+                          const char *path, const struct json_token_sz *t) {
+  struct json_setf_data *data = (struct json_setf_data *) userdata;
+  ptrdiff_t off = t->ptr == NULL ? 0 : t->ptr - data->base;
+  int i;
+  for (i = 0; i < data->num_ops; i++) {
+    json_setf_track(&data->ops[i], path, t, off);
   }
   (void) name;
   (void) name_len;
 }
 
-int json_vsetf(const char *s, int len, struct json_out *out,
-               const char *json_path, const char *json_fmt, va_list ap) WEAK;
-int json_vsetf(const char *s, int len, struct json_out *out,
-               const char *json_path, const char *json_fmt, va_list ap) {
+static ptrdiff_t json_setf_walk(const char *s, size_t len,
+                                struct json_setf_op *ops, int num_ops) {
   struct json_setf_data data;
-  memset(&data, 0, sizeof(data));
-  data.json_path = json_path;
+  int i;
+  for (i = 0; i < num_ops; i++) {
+    ops[i].applied = ops[i].matched = ops[i].pos = ops[i].prev = 0;
+    ops[i].found = 0;
+    ops[i].end = (ptrdiff_t) len;
+    ops[i].index = i;
+  }
   data.base = s;
-  data.end = len;
-  json_walk(s, len, json_vsetf_cb, &data);
+  data.ops = ops;
+  data.num_ops = num_ops;
+  return json_walk_sz(s, len, json_vsetf_cb, &data);
+}
+
+static int json_vsetf_common(const char *s, size_t len, struct json_out *out,
+                             const char *json_path, const char *json_fmt,
+                             va_list ap) {
+  struct json_setf_op op;
+  int prev_ch;
+  op.json_path = json_path;
+  op.value = NULL;
+  json_setf_walk(s, len, &op, 1);
+  /* Character before the matched part, nothing if the match is at start */
+  prev_ch = op.prev > 0 ? s[op.prev - 1] : '\0';
   if (json_fmt == NULL) {
     /* Deletion codepath */
-    json_printf(out, "%.*s", data.prev, s);
+    json_out_print(out, s, op.prev);
     /* Trim comma after the value that begins at object/array start */
-    if (s[data.prev - 1] == '{' || s[data.prev - 1] == '[') {
-      int i = data.end;
-      while (i < len && json_isspace(s[i])) i++;
-      if (s[i] == ',') data.end = i + 1; /* Point after comma */
+    if (prev_ch == '{' || prev_ch == '[') {
+      ptrdiff_t i = op.end;
+      while (i < (ptrdiff_t) len && json_isspace(s[i])) i++;
+      if (i < (ptrdiff_t) len && s[i] == ',') op.end = i + 1;
     }
-    json_printf(out, "%.*s", len - data.end, s + data.end);
+    json_out_print(out, s + op.end, len - op.end);
   } else {
     /* Modification codepath */
-    int n, off = data.matched, depth = 0;
+    int n, off = op.matched, depth = 0;
 
     /* Print the unchanged beginning */
-    json_printf(out, "%.*s", data.pos, s);
+    json_out_print(out, s, op.pos);
 
     /* Add missing keys */
     while ((n = strcspn(&json_path[off], ".[")) > 0) {
-      if (s[data.prev - 1] != '{' && s[data.prev - 1] != '[' && depth == 0) {
+      if (prev_ch != '{' && prev_ch != '[' && depth == 0) {
         json_printf(out, ",");
       }
       if (off > 0 && json_path[off - 1] != '.') break;
@@ -1276,19 +2438,47 @@ int json_vsetf(const char *s, int len, struct json_out *out,
       }
     }
     /* Print the new value */
-    json_vprintf(out, json_fmt, ap);
+    if ((n = json_vprintf(out, json_fmt, ap)) < 0) return n;
 
     /* Close brackets/braces of the added missing keys */
-    for (; off > data.matched; off--) {
+    for (; off > op.matched; off--) {
       int ch = json_path[off];
       const char *p = ch == '.' ? "}" : ch == '[' ? "]" : "";
       json_printf(out, "%s", p);
     }
 
     /* Print the rest of the unchanged string */
-    json_printf(out, "%.*s", len - data.end, s + data.end);
+    json_out_print(out, s + op.end, len - op.end);
   }
-  return data.end > data.pos ? 1 : 0;
+  return op.end > op.pos ? 1 : 0;
+}
+
+int json_vsetf(const char *s, int len, struct json_out *out,
+               const char *json_path, const char *json_fmt, va_list ap) WEAK;
+int json_vsetf(const char *s, int len, struct json_out *out,
+               const char *json_path, const char *json_fmt, va_list ap) {
+  return json_vsetf_common(s, len < 0 ? 0 : len, out, json_path, json_fmt,
+                           ap);
+}
+
+int json_vsetf_sz(const char *s, size_t len, struct json_out *out,
+                  const char *json_path, const char *json_fmt,
+                  va_list ap) WEAK;
+int json_vsetf_sz(const char *s, size_t len, struct json_out *out,
+                  const char *json_path, const char *json_fmt, va_list ap) {
+  return json_vsetf_common(s, len, out, json_path, json_fmt, ap);
+}
+
+int json_setf_sz(const char *s, size_t len, struct json_out *out,
+                 const char *json_path, const char *json_fmt, ...) WEAK;
+int json_setf_sz(const char *s, size_t len, struct json_out *out,
+                 const char *json_path, const char *json_fmt, ...) {
+  int result;
+  va_list ap;
+  va_start(ap, json_fmt);
+  result = json_vsetf_sz(s, len, out, json_path, json_fmt, ap);
+  va_end(ap);
+  return result;
 }
 
 int json_setf(const char *s, int len, struct json_out *out,
@@ -1303,100 +2493,2279 @@ int json_setf(const char *s, int len, struct json_out *out,
   return result;
 }
 
-struct prettify_data {
-  struct json_out *out;
-  int level;
-  int last_token;
-};
+/* Print `s,len` to `out`, remembering the last non-space character printed */
+static void json_setf_put(struct json_out *out, const char *s, int len,
+                          int *last) {
+  int i = len;
+  while (i > 0 && json_isspace(s[i - 1])) i--;
+  if (i > 0) *last = s[i - 1];
+  if (len > 0) json_out_print(out, s, len);
+}
 
-static void indent(struct json_out *out, int level) {
-  while (level-- > 0) out->printer(out, "  ", 2);
+static int json_setf_is_insert(const struct json_setf_op *op) {
+  return op->value != NULL && !op->found;
 }
 
-static void print_key(struct prettify_data *pd, const char *path,
-                      const char *name, int name_len) {
-  if (pd->last_token != JSON_TYPE_INVALID &&
-      pd->last_token != JSON_TYPE_ARRAY_START &&
-      pd->last_token != JSON_TYPE_OBJECT_START) {
-    pd->out->printer(pd->out, ",", 1);
-  }
-  if (path[0] != '\0') pd->out->printer(pd->out, "\n", 1);
-  indent(pd->out, pd->level);
-  if (path[0] != '\0' && path[strlen(path) - 1] != ']') {
-    pd->out->printer(pd->out, "\"", 1);
-    pd->out->printer(pd->out, name, (int) name_len);
-    pd->out->printer(pd->out, "\"", 1);
-    pd->out->printer(pd->out, ": ", 2);
-  }
+static ptrdiff_t json_setf_start(const struct json_setf_op *op) {
+  return op->value == NULL ? op->prev : op->pos;
 }
 
-static void prettify_cb(void *userdata, const char *name, size_t name_len,
-                        const char *path, const struct json_token *t) {
-  struct prettify_data *pd = (struct prettify_data *) userdata;
-  switch (t->type) {
-    case JSON_TYPE_OBJECT_START:
-    case JSON_TYPE_ARRAY_START:
-      print_key(pd, path, name, name_len);
-      pd->out->printer(pd->out, t->type == JSON_TYPE_ARRAY_START ? "[" : "{",
-                       1);
-      pd->level++;
-      break;
-    case JSON_TYPE_OBJECT_END:
-    case JSON_TYPE_ARRAY_END:
-      pd->level--;
-      if (pd->last_token != JSON_TYPE_INVALID &&
-          pd->last_token != JSON_TYPE_ARRAY_START &&
-          pd->last_token != JSON_TYPE_OBJECT_START) {
-        pd->out->printer(pd->out, "\n", 1);
-        indent(pd->out, pd->level);
-      }
-      pd->out->printer(pd->out, t->type == JSON_TYPE_ARRAY_END ? "]" : "}", 1);
-      break;
-    case JSON_TYPE_NUMBER:
-    case JSON_TYPE_NULL:
-    case JSON_TYPE_TRUE:
-    case JSON_TYPE_FALSE:
-    case JSON_TYPE_STRING:
-      print_key(pd, path, name, name_len);
-      if (t->type == JSON_TYPE_STRING) pd->out->printer(pd->out, "\"", 1);
-      pd->out->printer(pd->out, t->ptr, t->len);
-      if (t->type == JSON_TYPE_STRING) pd->out->printer(pd->out, "\"", 1);
-      break;
-    default:
-      break;
+/*
+ * Order by position in the source string. Insertions at the same position
+ * are ordered by the missing part of their path, so that the ones creating
+ * the same missing object or array are next to each other.
+ */
+static int json_setf_pos_cmp(const void *a, const void *b) {
+  const struct json_setf_op *x = (const struct json_setf_op *) a;
+  const struct json_setf_op *y = (const struct json_setf_op *) b;
+  ptrdiff_t sx = json_setf_start(x), sy = json_setf_start(y);
+  int diff = sx < sy ? -1 : sx > sy;
+  if (diff == 0) diff = json_setf_is_insert(x) - json_setf_is_insert(y);
+  if (diff == 0 && json_setf_is_insert(x) && x->json_path != NULL &&
+      y->json_path != NULL) {
+    diff = strcmp(x->json_path + x->matched, y->json_path + y->matched);
   }
-  pd->last_token = t->type;
+  return diff != 0 ? diff : x->index - y->index;
 }
 
-int json_prettify(const char *s, int len, struct json_out *out) WEAK;
-int json_prettify(const char *s, int len, struct json_out *out) {
-  struct prettify_data pd = {out, 0, JSON_TYPE_INVALID};
-  return json_walk(s, len, prettify_cb, &pd);
+static int json_setf_index_cmp(const void *a, const void *b) {
+  return ((const struct json_setf_op *) a)->index -
+         ((const struct json_setf_op *) b)->index;
 }
 
-int json_prettify_file(const char *file_name) WEAK;
-int json_prettify_file(const char *file_name) {
-  int res = -1;
-  char *s = json_fread(file_name);
-  FILE *fp;
-  if (s != NULL && (fp = fopen(file_name, "wb")) != NULL) {
-    struct json_out out = JSON_OUT_FILE(fp);
-    res = json_prettify(s, strlen(s), &out);
-    if (res < 0) {
-      /* On error, restore the old content */
-      fclose(fp);
-      fp = fopen(file_name, "wb");
-      fseek(fp, 0, SEEK_SET);
-      fwrite(s, 1, strlen(s), fp);
+/*
+ * Given the missing parts `p1` and `p2` of two paths inserted at the same
+ * position, return the length of the `p1` prefix up to and including the
+ * last object or array opener that `p2` opens too, or 0 if there is none.
+ */
+static int json_setf_shared(const char *p1, const char *p2) {
+  int n, off = 0, shared = 0;
+  while ((n = (int) strcspn(p1 + off, ".[")) > 0) {
+    if (off > 0 && p1[off - 1] != '.') break;
+    off += n;
+    if (p1[off] == '\0' || strncmp(p1, p2, off + 1) != 0) break;
+    shared = ++off;
+  }
+  return shared;
+}
+
+/*
+ * Insert the value of `op`, adding missing keys starting from `off`.
+ * Brackets and braces opened at offsets before `keep` are left open.
+ */
+static void json_setf_insert(struct json_out *out,
+                             const struct json_setf_op *op, int off, int keep,
+                             int *last) {
+  const char *path = op->json_path;
+  int n;
+  if (strcspn(path + off, ".[") > 0 && *last != '{' && *last != '[') {
+    json_setf_put(out, ",", 1, last);
+  }
+  while ((n = (int) strcspn(path + off, ".[")) > 0) {
+    if (off > 0 && path[off - 1] != '.') break;
+    json_printf(out, "%.*Q:", n, path + off);
+    *last = ':';
+    off += n;
+    if (path[off] != '\0') {
+      json_setf_put(out, path[off] == '.' ? "{" : "[", 1, last);
+      off++;
+    }
+  }
+  json_setf_put(out, op->value, strlen(op->value), last);
+  for (; off > keep; off--) {
+    if (path[off] == '.') json_setf_put(out, "}", 1, last);
+    if (path[off] == '[') json_setf_put(out, "]", 1, last);
+  }
+}
+
+/*
+ * Apply mutations whose positions are set, by json_setf_walk() or by the
+ * caller. An insertion without `json_path` inserts `value`, an object member
+ * or an array element, as is, adding a comma if needed.
+ */
+static int json_setf_apply(const char *s, int len, struct json_out *out,
+                           struct json_setf_op *ops, int num_ops) {
+  int i, j, cursor = 0, last = 0, num_applied = 0;
+
+  if (num_ops > 0) qsort(ops, num_ops, sizeof(*ops), json_setf_pos_cmp);
+
+  /*
+   * Print the result in one pass, in the order of positions. A mutation
+   * which begins inside the region changed by a previous one is skipped.
+   */
+  for (i = 0; i < num_ops; i = j) {
+    struct json_setf_op *op = &ops[i];
+    j = i + 1;
+    if (op->value == NULL) {
+      /* Deletion. Start where the previous deletion ended, if it did so */
+      int start = op->prev > cursor ? op->prev : cursor, end = op->end;
+      if (!op->found || op->pos < cursor) continue;
+      json_setf_put(out, s + cursor, start - cursor, &last);
+      /* Trim comma after the value that now begins at object/array start */
+      if (last == '{' || last == '[') {
+        int k = end;
+        while (k < len && json_isspace(s[k])) k++;
+        if (k < len && s[k] == ',') end = k + 1;
+      }
+      cursor = end;
+      op->applied = 1;
+    } else if (op->found) {
+      /* Modification */
+      if (op->pos < cursor) continue;
+      json_setf_put(out, s + cursor, op->pos - cursor, &last);
+      json_setf_put(out, op->value, strlen(op->value), &last);
+      cursor = op->end;
+      op->applied = 1;
+    } else if (op->json_path == NULL) {
+      /* Member or element given as is */
+      if (op->pos < cursor) continue;
+      json_setf_put(out, s + cursor, op->pos - cursor, &last);
+      if (last != '{' && last != '[') json_setf_put(out, ",", 1, &last);
+      json_setf_put(out, op->value, strlen(op->value), &last);
+      cursor = op->pos;
+      op->applied = 1;
+    } else {
+      /* Insertions at the same position, merging common missing keys */
+      int shared = 0, next;
+      while (j < num_ops && json_setf_is_insert(&ops[j]) &&
+             ops[j].pos == op->pos) {
+        j++;
+      }
+      if (op->pos < cursor || op->end != op->pos) continue;
+      json_setf_put(out, s + cursor, op->pos - cursor, &last);
+      cursor = op->pos;
+      for (; op < &ops[j]; op++, shared = next) {
+        const char *p = op->json_path + op->matched;
+        next = op + 1 < &ops[j]
+                   ? json_setf_shared(p, op[1].json_path + op[1].matched)
+                   : 0;
+        json_setf_insert(out, op, op->matched + shared,
+                         next > 0 ? op->matched + next - 1 : op->matched,
+                         &last);
+        op->applied = 1;
+      }
+    }
+  }
+  json_setf_put(out, s + cursor, len - cursor, &last);
+
+  /* Restore the original order of mutations */
+  if (num_ops > 0) qsort(ops, num_ops, sizeof(*ops), json_setf_index_cmp);
+  for (i = 0; i < num_ops; i++) num_applied += ops[i].applied;
+  return num_applied;
+}
+
+int json_setf_batch(const char *s, int len, struct json_out *out,
+                    struct json_setf_op *ops, int num_ops) WEAK;
+int json_setf_batch(const char *s, int len, struct json_out *out,
+                    struct json_setf_op *ops, int num_ops) {
+  ptrdiff_t n;
+
+  /* Find positions of all mutations in one walk */
+  if ((n = json_setf_walk(s, len < 0 ? 0 : len, ops, num_ops)) < 0) {
+    return (int) n;
+  }
+  return json_setf_apply(s, len, out, ops, num_ops);
+}
+
+int json_vsetf_inplace(char *s, int len, int size, const char *json_path,
+                       const char *json_fmt, va_list ap) WEAK;
+int json_vsetf_inplace(char *s, int len, int size, const char *json_path,
+                       const char *json_fmt, va_list ap) {
+  struct json_setf_op op;
+  char *buf;
+  int n;
+  op.json_path = json_path;
+  op.value = NULL;
+  json_setf_walk(s, len < 0 ? 0 : len, &op, 1);
+
+  if (op.found == 1 && json_fmt == NULL) {
+    /* Deletion: blank out the key, the value and the comma */
+    int end = op.end, prev_ch = op.prev > 0 ? s[op.prev - 1] : '\0';
+    if (prev_ch == '{' || prev_ch == '[') {
+      int i = end;
+      while (i < len && json_isspace(s[i])) i++;
+      if (i < len && s[i] == ',') end = i + 1;
+    }
+    memset(s + op.prev, ' ', end - op.prev);
+    return len;
+  } else if (op.found == 1) {
+    /* Modification: if the new value fits, overwrite it and pad with spaces */
+    char tmp[64];
+    struct json_out out = JSON_OUT_BUF(tmp, sizeof(tmp));
+    int avail = op.end - op.pos;
+    va_list ap_copy;
+    va_copy(ap_copy, ap);
+    n = json_vprintf(&out, json_fmt, ap_copy);
+    va_end(ap_copy);
+    if (n >= 0 && n < (int) sizeof(tmp) && n <= avail) {
+      memcpy(s + op.pos, tmp, n);
+      memset(s + op.pos + n, ' ', avail - n);
+      return len;
+    }
+  } else if (json_fmt == NULL) {
+    return len; /* Nothing to delete */
+  }
+
+  /* The value grows, or keys are added: rewrite the whole string */
+  if ((buf = (char *) json_malloc(size)) == NULL) return JSON_NO_MEMORY;
+  {
+    struct json_out out = JSON_OUT_BUF(buf, (size_t) size);
+    int res = json_vsetf(s, len, &out, json_path, json_fmt, ap);
+    n = res < 0 ? res : (int) out.u.buf.len;
+  }
+  if (n >= 0 && n < size) memcpy(s, buf, n + 1);
+  json_free(buf);
+  return n < 0 ? n : n < size ? n : JSON_NO_MEMORY;
+}
+
+int json_setf_inplace(char *s, int len, int size, const char *json_path,
+                      const char *json_fmt, ...) WEAK;
+int json_setf_inplace(char *s, int len, int size, const char *json_path,
+                      const char *json_fmt, ...) {
+  int result;
+  va_list ap;
+  va_start(ap, json_fmt);
+  result = json_vsetf_inplace(s, len, size, json_path, json_fmt, ap);
+  va_end(ap);
+  return result;
+}
+
+/* Output to a buffer that grows as needed */
+struct json_grow_out {
+  struct json_out out; /* Must be the first member */
+  int failed;          /* Set when the buffer could not grow */
+};
+
+static int json_grow_reserve(struct json_grow_out *g, size_t n) {
+  size_t need = g->out.u.buf.len + n + 1;
+  if (g->failed) return -1;
+  if (need > g->out.u.buf.size) {
+    size_t size = need > 2 * g->out.u.buf.size ? need : 2 * g->out.u.buf.size;
+    char *p = (char *) json_realloc(g->out.u.buf.buf, size);
+    if (p == NULL) {
+      g->failed = 1;
+      return -1;
+    }
+    g->out.u.buf.buf = p;
+    g->out.u.buf.size = size;
+  }
+  return 0;
+}
+
+static int json_printer_grow(struct json_out *out, const char *buf,
+                             size_t len) {
+  struct json_grow_out *g = (struct json_grow_out *) out;
+  if (json_grow_reserve(g, len) != 0) return 0;
+  memcpy(out->u.buf.buf + out->u.buf.len, buf, len);
+  out->u.buf.len += len;
+  out->u.buf.buf[out->u.buf.len] = '\0';
+  return len;
+}
+
+static void json_grow_init(struct json_grow_out *g) {
+  memset(g, 0, sizeof(*g));
+  g->out.printer = json_printer_grow;
+}
+
+/* Append `s,len` and a terminating NUL, return the offset of the copy */
+static int json_grow_add(struct json_grow_out *g, const char *s, int len) {
+  int off = (int) g->out.u.buf.len;
+  json_printer_grow(&g->out, s, len);
+  json_printer_grow(&g->out, "", 1);
+  return off;
+}
+
+/* Whole value text of a token, including the quotes of a string */
+static void json_token_text(const struct json_token *t, const char **p,
+                            int *len) {
+  int q = t->type == JSON_TYPE_STRING ? 1 : 0;
+  *p = t->ptr - q;
+  *len = t->len + 2 * q;
+}
+
+/* Whether every `~` in JSON pointer `ptr,len` starts a `~0` or `~1` escape */
+static int json_pointer_valid(const char *ptr, int len) {
+  int i;
+  if (len > 0 && ptr[0] != '/') return 0;
+  for (i = 0; i < len; i++) {
+    if (ptr[i] == '~' && (i + 1 >= len || (ptr[i + 1] != '0' &&
+                                           ptr[i + 1] != '1'))) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Decode `~0` and `~1` escapes of reference token `seg,len` into `dst` */
+static int json_pointer_decode(const char *seg, int len, char *dst) {
+  int i, n = 0;
+  for (i = 0; i < len; i++) {
+    dst[n++] = seg[i] != '~' ? seg[i] : seg[++i] == '1' ? '/' : '~';
+  }
+  return n;
+}
+
+/*
+ * Cursor over the decoded bytes of a string escaped as in JSON text, or of
+ * a JSON pointer reference token if `pointer` is set. Escapes are decoded
+ * one at a time, so strings are compared without a buffer.
+ */
+struct json_decoder {
+  const char *p, *end;
+  int pointer;
+  int n, i; /* Bytes of the current escape in `buf`, and the next one */
+  char buf[4];
+};
+
+static void json_decoder_init(struct json_decoder *d, const char *s, int len,
+                              int pointer) {
+  d->p = s;
+  d->end = s + len;
+  d->pointer = pointer;
+  d->n = d->i = 0;
+}
+
+/* Return the next decoded byte, 256 at the end, or negative error */
+static int json_decoder_next(struct json_decoder *d) {
+  if (d->i < d->n) return (unsigned char) d->buf[d->i++];
+  if (d->p >= d->end) return 256;
+  if (*d->p != (d->pointer ? '~' : '\\')) return (unsigned char) *d->p++;
+  if (d->pointer) {
+    if (d->end - d->p < 2) return JSON_STRING_INVALID;
+    d->p += 2;
+    return d->p[-1] == '1' ? '/' : '~';
+  }
+  if ((d->n = json_unescape_one(&d->p, d->end, d->buf)) < 0) return d->n;
+  d->i = 1;
+  return (unsigned char) d->buf[0];
+}
+
+/* Return 1 if the decoded bytes of `a` and `b` are equal */
+static int json_decoded_equal(struct json_decoder *a,
+                              struct json_decoder *b) {
+  int x, y;
+  do {
+    x = json_decoder_next(a);
+    y = json_decoder_next(b);
+  } while (x == y && x >= 0 && x < 256);
+  return x == y && x == 256;
+}
+
+/*
+ * Return 1 if reference token `seg,len` of a valid JSON pointer names the
+ * key or index `name,name_len`, which is escaped as in JSON text.
+ */
+static int json_pointer_names(const char *seg, int len, const char *name,
+                              int name_len) {
+  struct json_decoder a, b;
+  if (memchr(seg, '~', len) == NULL && memchr(name, '\\', name_len) == NULL) {
+    return len == name_len && memcmp(seg, name, len) == 0;
+  }
+  json_decoder_init(&a, seg, len, 1);
+  json_decoder_init(&b, name, name_len, 0);
+  return json_decoded_equal(&a, &b);
+}
+
+/* Length of the parent of JSON pointer `ptr,len`, or -1 for the root */
+static int json_pointer_parent_len(const char *ptr, int len) {
+  if (len == 0 || ptr[0] != '/') return -1;
+  while (ptr[--len] != '/') {
+  }
+  return len;
+}
+
+/*
+ * Return array index from the last segment of `ptr,len`, or -1. Leading
+ * zeros are not allowed, as in RFC 6901.
+ */
+static int json_pointer_index(const char *ptr, int len) {
+  int i = json_pointer_parent_len(ptr, len) + 1, idx = 0;
+  if (i <= 0 || i >= len || len - i > 9) return -1;
+  if (ptr[i] == '0' && len - i > 1) return -1;
+  for (; i < len; i++) {
+    if (!json_isdigit(ptr[i])) return -1;
+    idx = idx * 10 + ptr[i] - '0';
+  }
+  return idx;
+}
+
+static int json_pointer_is_push(const char *ptr, int len) {
+  return len >= 2 && ptr[len - 2] == '/' && ptr[len - 1] == '-';
+}
+
+enum json_patch_type {
+  JSON_PATCH_OP_ADD,
+  JSON_PATCH_OP_REMOVE,
+  JSON_PATCH_OP_REPLACE,
+  JSON_PATCH_OP_MOVE,
+  JSON_PATCH_OP_COPY,
+  JSON_PATCH_OP_TEST
+};
+
+/* Location of a JSON pointer in the document */
+struct json_patch_ref {
+  const char *ptr;
+  int ptr_len; /* Pointer length, or -1 if not used */
+  int found;   /* Whether the value is present */
+  int type;    /* Value type */
+  int pos;     /* Offset of the value begin */
+  int end;     /* Offset of the value end */
+  int start;   /* Offset of the member begin, including the key */
+  int prev;    /* Offset where deletion of the member begins */
+
+  /* Objects and arrays entered on the way to the value */
+  int depth;       /* Their number */
+  int off;         /* Length of the pointer to the innermost one */
+  const char *key; /* Key of the value, once it is entered */
+
+  /* For arrays */
+  int num_elems; /* Number of elements */
+  int want;      /* Index of the element to find, or -1 */
+  int elem_pos;  /* Offset of the wanted element begin, or -1 */
+  int elem_end;  /* Offset of the wanted element end */
+};
+
+struct json_patch_op {
+  int type; /* enum json_patch_type, or -1 */
+  struct json_token path, from, value;
+  struct json_patch_ref target, parent, source;
+};
+
+struct json_patch_ctx {
+  struct json_patch_op *ops;
+  int num_ops;
+  int begin, end; /* Operations of the current round */
+  int error;
+  const char *doc; /* Document of the current round */
+  int depth;       /* Number of objects and arrays open in the walk */
+  struct json_setf_op *setf;
+  int num_setf, max_setf;
+  struct json_grow_out scratch; /* Values for json_setf_apply() */
+};
+
+static void json_patch_parse_cb(void *userdata, const char *name,
+                                size_t name_len, const char *path,
+                                const struct json_token *t) {
+  struct json_patch_ctx *ctx = (struct json_patch_ctx *) userdata;
+  static const char *names[] = {"add",  "remove", "replace",
+                                "move", "copy",   "test"};
+  struct json_patch_op *op;
+  const char *field;
+  int i, n;
+  if (path[0] == '\0') {
+    if (t->type != JSON_TYPE_ARRAY_START && t->type != JSON_TYPE_ARRAY_END) {
+      ctx->error = JSON_PATCH_FAILED; /* Patch must be an array */
+    }
+    return;
+  }
+  if (ctx->error != 0 || t->ptr == NULL) return;
+  i = atoi(path + 1);
+  field = strchr(path, ']') + 1;
+  if (i >= ctx->num_ops) {
+    op = (struct json_patch_op *) json_realloc(ctx->ops, (i + 1) * sizeof(*op));
+    if (op == NULL) {
+      ctx->error = JSON_NO_MEMORY;
+      return;
+    }
+    ctx->ops = op;
+    for (n = ctx->num_ops; n <= i; n++) {
+      memset(&op[n], 0, sizeof(op[n]));
+      op[n].type = -1;
+    }
+    ctx->num_ops = i + 1;
+  }
+  op = &ctx->ops[i];
+  if (*field == '\0' && t->type != JSON_TYPE_OBJECT_END) {
+    ctx->error = JSON_PATCH_FAILED; /* Operation must be an object */
+  } else if (*field == '.' && strpbrk(field + 1, ".[") == NULL) {
+    if (strcmp(field, ".value") == 0) {
+      op->value = *t;
+    } else if (t->type != JSON_TYPE_STRING) {
+      /* Other members are strings */
+    } else if (strcmp(field, ".path") == 0) {
+      op->path = *t;
+    } else if (strcmp(field, ".from") == 0) {
+      op->from = *t;
+    } else if (strcmp(field, ".op") == 0) {
+      for (n = 0; n < (int) (sizeof(names) / sizeof(names[0])); n++) {
+        if ((int) strlen(names[n]) == t->len &&
+            strncmp(names[n], t->ptr, t->len) == 0) {
+          op->type = n;
+        }
+      }
+    }
+  }
+  (void) name;
+  (void) name_len;
+}
+
+/* Whether JSON pointers `a` and `b` are equal, or one contains the other */
+static int json_pointer_overlap(const char *a, int alen, const char *b,
+                                int blen) {
+  int n = alen < blen ? alen : blen;
+  return memcmp(a, b, n) == 0 &&
+         (alen == blen || (alen < blen ? b[n] : a[n]) == '/');
+}
+
+/*
+ * The part of the document an operation reads or writes. Adding or removing
+ * an array element shifts other elements, so that writes the whole array.
+ */
+struct json_patch_area {
+  const char *ptr;
+  int len, write, push;
+};
+
+static int json_patch_areas(const struct json_patch_op *op,
+                            struct json_patch_area *areas) {
+  int i, n = 0;
+  for (i = 0; i < 2; i++) {
+    const struct json_token *t = i == 0 ? &op->from : &op->path;
+    struct json_patch_area *a = &areas[n];
+    if (t->ptr == NULL || (i == 0 && op->type != JSON_PATCH_OP_MOVE &&
+                           op->type != JSON_PATCH_OP_COPY)) {
+      continue;
+    }
+    a->ptr = t->ptr;
+    a->len = t->len;
+    a->write = op->type != JSON_PATCH_OP_TEST &&
+               (i == 1 || op->type == JSON_PATCH_OP_MOVE);
+    a->push = i == 1 && op->type != JSON_PATCH_OP_REPLACE &&
+              json_pointer_is_push(t->ptr, t->len);
+    if (a->write && op->type != JSON_PATCH_OP_REPLACE &&
+        (a->push || json_pointer_index(t->ptr, t->len) >= 0)) {
+      a->len = json_pointer_parent_len(t->ptr, t->len);
+    }
+    n++;
+  }
+  return n;
+}
+
+/*
+ * Return 1 if operation `b` depends on what an earlier operation `a` writes,
+ * so it must be applied in a later round. Appends to the same array are
+ * fine, json_setf_batch() keeps their order.
+ */
+static int json_patch_depends(const struct json_patch_op *a,
+                              const struct json_patch_op *b) {
+  struct json_patch_area aa[2], ba[2];
+  int i, j, na = json_patch_areas(a, aa), nb = json_patch_areas(b, ba);
+  for (i = 0; i < na; i++) {
+    for (j = 0; j < nb; j++) {
+      if (aa[i].write &&
+          json_pointer_overlap(aa[i].ptr, aa[i].len, ba[j].ptr, ba[j].len) &&
+          !(aa[i].push && ba[j].push && aa[i].len == ba[j].len)) {
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+/*
+ * Find where the member with value at `pos` begins, `*start`, and where its
+ * deletion begins, `*prev`: at the preceding comma, or after the opening
+ * bracket. `key` is the key of an object member as passed to json_walk()
+ * callbacks, unused for array elements.
+ */
+static void json_member_span(const char *doc, int pos, const char *key,
+                             int *start, int *prev) {
+  int i = pos;
+  while (i > 0 && json_isspace(doc[i - 1])) i--;
+  if (i > 0 && doc[i - 1] == ':') {
+    i = (int) (key - doc);
+    if (i > 0 && doc[i - 1] == '"') i--;
+  }
+  *start = i;
+  while (i > 0 && json_isspace(doc[i - 1])) i--;
+  *prev = i > 0 && doc[i - 1] == ',' ? i - 1 : i;
+}
+
+static void json_patch_found(struct json_patch_ctx *ctx,
+                             struct json_patch_ref *ref, const char *key,
+                             const struct json_token *t) {
+  const char *p;
+  int len;
+  json_token_text(t, &p, &len);
+  ref->found = 1;
+  ref->type = t->type;
+  ref->pos = (int) (p - ctx->doc);
+  ref->end = ref->pos + len;
+  json_member_span(ctx->doc, ref->pos, key, &ref->start, &ref->prev);
+}
+
+/*
+ * Follow JSON pointer `ref` through a token `t` with `depth` objects and
+ * arrays around it. Keys are compared with reference tokens one by one,
+ * so any key can be addressed. Count elements of the value, and find
+ * element `want`.
+ */
+static void json_patch_track(struct json_patch_ctx *ctx,
+                             struct json_patch_ref *ref, const char *name,
+                             size_t name_len, const struct json_token *t,
+                             int depth) {
+  int n = ref->off, is_end = t->type == JSON_TYPE_OBJECT_END ||
+                             t->type == JSON_TYPE_ARRAY_END;
+  if (ref->ptr_len < 0 || ref->found) return;
+  if (is_end && ref->depth == depth + 1) {
+    /* Leaving the value, or an object or array on the way to it */
+    if (ref->off == ref->ptr_len) {
+      json_patch_found(ctx, ref, ref->key, t);
+    } else {
+      ref->depth = depth;
+      ref->off = depth > 0 ? json_pointer_parent_len(ref->ptr, ref->off) : 0;
+    }
+    return;
+  }
+  if (ref->depth != depth) return;
+  if (depth > 0 && ref->off == ref->ptr_len) {
+    /* A member or element of the value. Objects and arrays count at end */
+    const char *p;
+    int len;
+    if (t->ptr == NULL) return;
+    json_token_text(t, &p, &len);
+    if (ref->num_elems++ == ref->want) {
+      ref->elem_pos = (int) (p - ctx->doc);
+      ref->elem_end = ref->elem_pos + len;
+    }
+    return;
+  }
+  if (is_end) return;
+  if (depth > 0) {
+    /* Does the key or index match the next reference token? */
+    const char *seg = ref->ptr + ref->off + 1;
+    for (n = ref->off + 1; n < ref->ptr_len && ref->ptr[n] != '/'; n++) {
+    }
+    if (!json_pointer_names(seg, (int) (ref->ptr + n - seg), name,
+                            (int) name_len)) {
+      return;
+    }
+  }
+  if (t->ptr == NULL) {
+    ref->depth = depth + 1;
+    ref->off = n;
+    ref->key = name;
+  } else if (n == ref->ptr_len) {
+    json_patch_found(ctx, ref, name, t);
+  }
+}
+
+static void json_patch_resolve_cb(void *userdata, const char *name,
+                                  size_t name_len, const char *path,
+                                  const struct json_token *t) {
+  struct json_patch_ctx *ctx = (struct json_patch_ctx *) userdata;
+  int i, depth;
+  if (t->type == JSON_TYPE_OBJECT_END || t->type == JSON_TYPE_ARRAY_END) {
+    ctx->depth--;
+  } else if (name == NULL && ctx->depth > 0) {
+    return; /* A key, reported when the path is truncated */
+  }
+  depth = ctx->depth;
+  if (t->ptr == NULL) ctx->depth++;
+  for (i = ctx->begin; i < ctx->end; i++) {
+    json_patch_track(ctx, &ctx->ops[i].target, name, name_len, t, depth);
+    json_patch_track(ctx, &ctx->ops[i].parent, name, name_len, t, depth);
+    json_patch_track(ctx, &ctx->ops[i].source, name, name_len, t, depth);
+  }
+  (void) path;
+}
+
+static void json_patch_ref_init(struct json_patch_ref *ref, const char *ptr,
+                                int ptr_len, int want) {
+  memset(ref, 0, sizeof(*ref));
+  ref->ptr = ptr;
+  ref->ptr_len = ptr_len;
+  ref->want = want;
+  ref->elem_pos = -1;
+}
+
+/* Whether a move operation reorders elements of the same array */
+static int json_patch_same_array(const struct json_patch_op *op) {
+  const struct json_token *from = &op->from, *path = &op->path;
+  int n = op->type == JSON_PATCH_OP_MOVE
+              ? json_pointer_parent_len(from->ptr, from->len)
+              : -1;
+  return n >= 0 &&
+         n == json_pointer_parent_len(path->ptr, path->len) &&
+         memcmp(from->ptr, path->ptr, n) == 0 &&
+         json_pointer_index(from->ptr, from->len) >= 0 &&
+         (json_pointer_index(path->ptr, path->len) >= 0 ||
+          json_pointer_is_push(path->ptr, path->len));
+}
+
+/*
+ * Queue a mutation for json_setf_apply(): replace `pos..end` with the value
+ * at offset `value` of the scratch buffer, or delete the member that spans
+ * `prev..end` if `value` is -1. If `insert` is set, insert the member at
+ * offset `value` at `pos` instead.
+ */
+static int json_patch_setf(struct json_patch_ctx *ctx, int insert, int prev,
+                           int pos, int end, int value) {
+  struct json_setf_op *op;
+  if (ctx->num_setf >= ctx->max_setf) {
+    int max = ctx->max_setf * 2 + 8;
+    struct json_setf_op *p = (struct json_setf_op *) json_realloc(
+        ctx->setf, max * sizeof(*p));
+    if (p == NULL) return JSON_NO_MEMORY;
+    ctx->setf = p;
+    ctx->max_setf = max;
+  }
+  op = &ctx->setf[ctx->num_setf];
+  memset(op, 0, sizeof(*op));
+  op->found = !insert;
+  op->prev = prev;
+  op->pos = pos;
+  op->end = end;
+  /* Keep the offset until the scratch buffer stops growing, then fix up */
+  op->matched = value;
+  op->index = ctx->num_setf++;
+  return 0;
+}
+
+static int json_patch_replace(struct json_patch_ctx *ctx,
+                              const struct json_patch_ref *ref, int value) {
+  return json_patch_setf(ctx, 0, ref->pos, ref->pos, ref->end, value);
+}
+
+static int json_patch_remove(struct json_patch_ctx *ctx,
+                             const struct json_patch_ref *ref) {
+  return json_patch_setf(ctx, 0, ref->prev, ref->start, ref->end, -1);
+}
+
+/* Insert member or element at offset `value` at the end of `parent,len` */
+static int json_patch_append(struct json_patch_ctx *ctx, const char *parent,
+                             int len, int value) {
+  int pos = (int) (parent - ctx->doc) + len - 1;
+  while (json_isspace(ctx->doc[pos - 1])) pos--;
+  return json_patch_setf(ctx, 1, pos, pos, pos, value);
+}
+
+/* Insert value `val,len` before element `idx` of array `parent` */
+static int json_patch_insert(struct json_patch_ctx *ctx,
+                             const struct json_patch_ref *parent, int idx,
+                             const char *val, int len) {
+  struct json_grow_out *g = &ctx->scratch;
+  int off = (int) g->out.u.buf.len;
+  if (idx == parent->num_elems) {
+    return json_patch_append(ctx, ctx->doc + parent->pos,
+                             parent->end - parent->pos,
+                             json_grow_add(g, val, len));
+  }
+  if (idx < 0 || idx != parent->want || parent->elem_pos < 0) {
+    return JSON_PATCH_FAILED;
+  }
+  /* Replace the element with the new value followed by the element */
+  json_printer_grow(&g->out, val, len);
+  json_printer_grow(&g->out, ",", 1);
+  json_grow_add(g, ctx->doc + parent->elem_pos,
+                parent->elem_end - parent->elem_pos);
+  return json_patch_setf(ctx, 0, parent->elem_pos, parent->elem_pos,
+                         parent->elem_end, off);
+}
+
+static int json_patch_add(struct json_patch_ctx *ctx,
+                          const struct json_patch_op *op, const char *val,
+                          int len) {
+  const struct json_patch_ref *parent = &op->parent, *target = &op->target;
+  struct json_grow_out *g = &ctx->scratch;
+  if (op->path.len == 0) {
+    if (!target->found) return JSON_PATCH_FAILED;
+    return json_patch_replace(ctx, target, json_grow_add(g, val, len));
+  } else if (!parent->found) {
+    return JSON_PATCH_FAILED;
+  } else if (parent->type == JSON_TYPE_ARRAY_END) {
+    int idx = json_pointer_is_push(op->path.ptr, op->path.len)
+                  ? parent->num_elems
+                  : json_pointer_index(op->path.ptr, op->path.len);
+    return json_patch_insert(ctx, parent, idx, val, len);
+  } else if (parent->type == JSON_TYPE_OBJECT_END) {
+    const char *seg = op->path.ptr + parent->ptr_len + 1;
+    int n, off = (int) g->out.u.buf.len;
+    char *key;
+    if (target->found) {
+      return json_patch_replace(ctx, target, json_grow_add(g, val, len));
+    }
+    /* New member: the key is decoded, and quoted as a JSON string */
+    n = op->path.len - parent->ptr_len - 1;
+    if ((key = (char *) json_malloc(n + 1)) == NULL) return JSON_NO_MEMORY;
+    json_printf(&g->out, "%.*Q:", json_pointer_decode(seg, n, key), key);
+    json_free(key);
+    json_grow_add(g, val, len);
+    return json_patch_append(ctx, ctx->doc + parent->pos,
+                             parent->end - parent->pos, off);
+  }
+  return JSON_PATCH_FAILED;
+}
+
+static int json_patch_move(struct json_patch_ctx *ctx,
+                           const struct json_patch_op *op) {
+  const struct json_patch_ref *parent = &op->parent, *source = &op->source;
+  const char *val = ctx->doc + source->pos;
+  int res, len = source->end - source->pos;
+  if (!source->found || op->from.len == 0) return JSON_PATCH_FAILED;
+  if (json_pointer_overlap(op->from.ptr, op->from.len, op->path.ptr,
+                           op->path.len)) {
+    if (op->from.len == op->path.len) return 0; /* Move to itself */
+    if (op->from.len < op->path.len) return JSON_PATCH_FAILED; /* To child */
+  }
+  if (json_patch_same_array(op) && parent->found &&
+      parent->type == JSON_TYPE_ARRAY_END) {
+    /* Index after the removal, translated to the original array */
+    int from = json_pointer_index(op->from.ptr, op->from.len);
+    int idx = json_pointer_is_push(op->path.ptr, op->path.len)
+                  ? parent->num_elems
+                  : parent->want;
+    if (idx == from || idx == from + 1) return 0;
+    if ((res = json_patch_remove(ctx, source)) != 0) return res;
+    return json_patch_insert(ctx, parent, idx, val, len);
+  }
+  if ((res = json_patch_remove(ctx, source)) != 0) return res;
+  return json_patch_add(ctx, op, val, len);
+}
+
+struct json_member {
+  struct json_token key, val;
+};
+
+struct json_members {
+  struct json_member *members;
+  int num_members;
+  int depth;             /* Objects and arrays around the current token */
+  struct json_token key; /* Key of the object or array being entered */
+  int error;
+};
+
+static void json_members_cb(void *userdata, const char *name,
+                            size_t name_len, const char *path,
+                            const struct json_token *t) {
+  struct json_members *d = (struct json_members *) userdata;
+  struct json_member *m;
+  if (t->type == JSON_TYPE_OBJECT_END || t->type == JSON_TYPE_ARRAY_END) {
+    if (--d->depth != 1) return;
+  } else if (name == NULL && d->depth > 0) {
+    return; /* A key, reported when the path is truncated */
+  } else if (t->ptr == NULL) {
+    if (d->depth++ == 1) {
+      d->key.ptr = name;
+      d->key.len = (int) name_len;
+    }
+    return;
+  } else if (d->depth != 1) {
+    return;
+  } else {
+    d->key.ptr = name;
+    d->key.len = (int) name_len;
+  }
+  m = (struct json_member *) json_realloc(
+      d->members, (d->num_members + 1) * sizeof(*m));
+  if (m == NULL) {
+    d->error = JSON_NO_MEMORY;
+    return;
+  }
+  m[d->num_members].key = d->key;
+  m[d->num_members].val = *t;
+  d->members = m;
+  d->num_members++;
+  (void) path;
+}
+
+/*
+ * Collect keys and values of object, or elements of array `s,len` in one
+ * walk. Return their number, or negative error. The caller must free
+ * `*members` with json_free().
+ */
+static int json_members(const char *s, int len, struct json_member **members) {
+  struct json_members d;
+  int n;
+  memset(&d, 0, sizeof(d));
+  n = json_walk(s, len, json_members_cb, &d);
+  *members = d.members;
+  return n < 0 ? n : d.error < 0 ? d.error : d.num_members;
+}
+
+/* Return 1 if strings `a,alen` and `b,blen`, as in JSON text, are equal */
+static int json_equal_strings(const char *a, int alen, const char *b,
+                              int blen) {
+  struct json_decoder x, y;
+  json_decoder_init(&x, a, alen, 0);
+  json_decoder_init(&y, b, blen, 0);
+  return json_decoded_equal(&x, &y);
+}
+
+/* Return 1 if object keys `a` and `b`, as in JSON text, are equal */
+static int json_key_equal(const struct json_token *a,
+                          const struct json_token *b) {
+  if (memchr(a->ptr, '\\', a->len) == NULL &&
+      memchr(b->ptr, '\\', b->len) == NULL) {
+    return a->len == b->len && memcmp(a->ptr, b->ptr, a->len) == 0;
+  }
+  return json_equal_strings(a->ptr, a->len, b->ptr, b->len);
+}
+
+/*
+ * Return 1 if JSON values `a,alen` and `b,blen` are equal, as in RFC 6902,
+ * 0 if not, or negative error.
+ */
+static int json_equal(const char *a, int alen, const char *b, int blen) {
+  struct json_member *ma = NULL, *mb = NULL;
+  int i, j, n, m, result = 0;
+  if (alen == blen && memcmp(a, b, alen) == 0) return 1;
+  if (alen == 0 || blen == 0) return 0;
+  if (a[0] == '"' && b[0] == '"' && alen > 1 && blen > 1) {
+    return json_equal_strings(a + 1, alen - 2, b + 1, blen - 2);
+  } else if ((a[0] == '-' || json_isdigit(a[0])) &&
+             (b[0] == '-' || json_isdigit(b[0]))) {
+    char x[50], y[50];
+    if (alen >= (int) sizeof(x) || blen >= (int) sizeof(y)) return 0;
+    memcpy(x, a, alen);
+    memcpy(y, b, blen);
+    x[alen] = y[blen] = '\0';
+    return strtod(x, NULL) == strtod(y, NULL);
+  } else if ((a[0] != '{' && a[0] != '[') || a[0] != b[0]) {
+    return 0;
+  }
+
+  /* Objects and arrays: compare members, in any order for objects */
+  n = json_members(a, alen, &ma);
+  m = n < 0 ? n : json_members(b, blen, &mb);
+  if (m < 0) {
+    result = m;
+  } else if (m == n) {
+    for (i = 0, result = 1; i < n && result == 1; i++) {
+      const char *pa, *pb;
+      int la, lb;
+      for (j = a[0] == '[' ? i : 0; j < n; j++) {
+        if (a[0] == '[' || json_key_equal(&ma[i].key, &mb[j].key)) break;
+      }
+      if (j == n) {
+        result = 0;
+        break;
+      }
+      json_token_text(&ma[i].val, &pa, &la);
+      json_token_text(&mb[j].val, &pb, &lb);
+      result = json_equal(pa, la, pb, lb);
+    }
+  }
+  json_free(ma);
+  json_free(mb);
+  return result;
+}
+
+static int json_patch_build(struct json_patch_ctx *ctx,
+                            const struct json_patch_op *op) {
+  const struct json_patch_ref *target = &op->target, *source = &op->source;
+  const char *val;
+  int len, res;
+  json_token_text(&op->value, &val, &len);
+  switch (op->type) {
+    case JSON_PATCH_OP_ADD:
+      return json_patch_add(ctx, op, val, len);
+    case JSON_PATCH_OP_REMOVE:
+      if (!target->found || op->path.len == 0) return JSON_PATCH_FAILED;
+      return json_patch_remove(ctx, target);
+    case JSON_PATCH_OP_REPLACE:
+      if (!target->found) return JSON_PATCH_FAILED;
+      return json_patch_replace(ctx, target,
+                                json_grow_add(&ctx->scratch, val, len));
+    case JSON_PATCH_OP_MOVE:
+      return json_patch_move(ctx, op);
+    case JSON_PATCH_OP_COPY:
+      if (!source->found) return JSON_PATCH_FAILED;
+      return json_patch_add(ctx, op, ctx->doc + source->pos,
+                            source->end - source->pos);
+    case JSON_PATCH_OP_TEST:
+      if (!target->found) return JSON_PATCH_FAILED;
+      res = json_equal(ctx->doc + target->pos, target->end - target->pos, val,
+                       len);
+      return res < 0 ? res : res ? 0 : JSON_PATCH_FAILED;
+  }
+  return JSON_PATCH_FAILED;
+}
+
+/* Apply the queued mutations of `doc,len`, printing the result to `out` */
+static int json_patch_apply(struct json_patch_ctx *ctx, const char *doc,
+                            int len, struct json_out *out) {
+  char *buf = ctx->scratch.out.u.buf.buf;
+  int i;
+  if (ctx->scratch.failed) return JSON_NO_MEMORY;
+  for (i = 0; i < ctx->num_setf; i++) {
+    struct json_setf_op *op = &ctx->setf[i];
+    op->value = op->matched < 0 ? NULL : buf + op->matched;
+    op->matched = 0;
+  }
+  return json_setf_apply(doc, len, out, ctx->setf, ctx->num_setf);
+}
+
+/* Locate the values used by the operations in one walk, then apply them */
+static int json_patch_round(struct json_patch_ctx *ctx, const char *doc,
+                            int len, struct json_out *out) {
+  int i, res;
+  ctx->doc = doc;
+  ctx->depth = 0;
+  ctx->num_setf = 0;
+  ctx->scratch.out.u.buf.len = 0;
+  for (i = ctx->begin; i < ctx->end; i++) {
+    struct json_patch_op *op = &ctx->ops[i];
+    const struct json_token *path = &op->path, *from = &op->from;
+    int want = json_pointer_index(path->ptr, path->len);
+    if (json_patch_same_array(op) &&
+        want >= json_pointer_index(from->ptr, from->len)) {
+      want++;
+    }
+    json_patch_ref_init(&op->target, path->ptr, path->len, -1);
+    json_patch_ref_init(&op->parent, path->ptr,
+                        json_pointer_parent_len(path->ptr, path->len), want);
+    json_patch_ref_init(&op->source, from->ptr,
+                        from->ptr == NULL ? -1 : from->len, -1);
+  }
+  if ((res = json_walk(doc, len, json_patch_resolve_cb, ctx)) < 0) return res;
+  for (i = ctx->begin; i < ctx->end; i++) {
+    if ((res = json_patch_build(ctx, &ctx->ops[i])) != 0) return res;
+  }
+  return json_patch_apply(ctx, doc, len, out);
+}
+
+static int json_patch_valid(const struct json_patch_op *op) {
+  int needs_from = op->type == JSON_PATCH_OP_MOVE ||
+                   op->type == JSON_PATCH_OP_COPY;
+  int needs_value = op->type == JSON_PATCH_OP_ADD ||
+                    op->type == JSON_PATCH_OP_REPLACE ||
+                    op->type == JSON_PATCH_OP_TEST;
+  return op->type >= 0 && op->path.ptr != NULL &&
+         json_pointer_valid(op->path.ptr, op->path.len) &&
+         (!needs_from || (op->from.ptr != NULL &&
+                          json_pointer_valid(op->from.ptr, op->from.len))) &&
+         (!needs_value || op->value.ptr != NULL);
+}
+
+/*
+ * Unescape `path` and `from` strings of all operations into one buffer
+ * `*buf`, which the caller must free with json_free().
+ */
+static int json_patch_unescape(struct json_patch_ctx *ctx, char **buf) {
+  int i, j, n = 0, size = 1;
+  for (i = 0; i < ctx->num_ops; i++) {
+    size += ctx->ops[i].path.len + ctx->ops[i].from.len;
+  }
+  if ((*buf = (char *) json_malloc(size)) == NULL) return JSON_NO_MEMORY;
+  for (i = 0; i < ctx->num_ops; i++) {
+    struct json_token *t[2];
+    t[0] = &ctx->ops[i].path;
+    t[1] = &ctx->ops[i].from;
+    for (j = 0; j < 2; j++) {
+      int m;
+      if (t[j]->ptr == NULL) continue;
+      m = json_unescape(t[j]->ptr, t[j]->len, *buf + n, size - n);
+      if (m < 0) return JSON_PATCH_FAILED;
+      t[j]->ptr = *buf + n;
+      t[j]->len = m;
+      n += m;
+    }
+  }
+  return 0;
+}
+
+int json_patch(const char *s, int len, struct json_out *out, const char *patch,
+               int patch_len) WEAK;
+int json_patch(const char *s, int len, struct json_out *out, const char *patch,
+               int patch_len) {
+  struct json_patch_ctx ctx;
+  struct json_grow_out bufs[2];
+  char *ptrs = NULL;
+  int i, j, k, cur = 0, res;
+  memset(&ctx, 0, sizeof(ctx));
+  json_grow_init(&ctx.scratch);
+  json_grow_init(&bufs[0]);
+  json_grow_init(&bufs[1]);
+
+  if ((res = json_walk(patch, patch_len, json_patch_parse_cb, &ctx)) >= 0) {
+    res = ctx.error;
+  }
+  if (res == 0) res = json_patch_unescape(&ctx, &ptrs);
+  for (i = 0; i < ctx.num_ops && res == 0; i++) {
+    if (!json_patch_valid(&ctx.ops[i])) res = JSON_PATCH_FAILED;
+  }
+
+  /*
+   * Split operations into rounds of independent ones, and apply each round
+   * in one pass. Only the last round is printed to `out`, the others go to
+   * temporary buffers.
+   */
+  for (i = 0; res >= 0; i = j, cur = !cur) {
+    for (j = i + 1; j < ctx.num_ops; j++) {
+      for (k = i; k < j && !json_patch_depends(&ctx.ops[k], &ctx.ops[j]); k++) {
+      }
+      if (k < j) break;
+    }
+    ctx.begin = i;
+    ctx.end = j < ctx.num_ops ? j : ctx.num_ops;
+    if (j >= ctx.num_ops) {
+      res = json_patch_round(&ctx, s, len, out);
+      break;
+    }
+    bufs[cur].out.u.buf.len = 0;
+    res = json_patch_round(&ctx, s, len, &bufs[cur].out);
+    if (bufs[cur].failed) res = JSON_NO_MEMORY;
+    s = bufs[cur].out.u.buf.buf;
+    len = (int) bufs[cur].out.u.buf.len;
+  }
+
+  json_free(ctx.ops);
+  json_free(ctx.setf);
+  json_free(ptrs);
+  json_free(ctx.scratch.out.u.buf.buf);
+  json_free(bufs[0].out.u.buf.buf);
+  json_free(bufs[1].out.u.buf.buf);
+  return res < 0 ? res : ctx.num_ops;
+}
+
+/* Print `p,len` with null object members removed, as RFC 7386 requires */
+static int json_merge_strip(struct json_out *out, const char *p, int len) {
+  struct json_member *m = NULL;
+  int i, n, comma = 0;
+  if (len == 0 || p[0] != '{') return json_out_print(out, p, len);
+  if ((n = json_members(p, len, &m)) < 0) return n;
+  json_out_print(out, "{", 1);
+  for (i = 0; i < n; i++) {
+    const char *v;
+    int vlen;
+    if (m[i].val.type == JSON_TYPE_NULL) continue;
+    json_token_text(&m[i].val, &v, &vlen);
+    json_printf(out, "%s\"%.*s\":", comma++ ? "," : "", m[i].key.len,
+                m[i].key.ptr);
+    json_merge_strip(out, v, vlen);
+  }
+  json_free(m);
+  return json_out_print(out, "}", 1);
+}
+
+/*
+ * Merge patch object `p,plen` into the target object `t,tlen`, which is a
+ * part of the document. Keys are matched as strings, so any key is allowed.
+ */
+static int json_merge_object(struct json_patch_ctx *ctx, const char *t,
+                             int tlen, const char *p, int plen) {
+  struct json_grow_out *g = &ctx->scratch;
+  struct json_member *m = NULL, *tm = NULL;
+  int i, j, n, tn, res = 0;
+  if ((n = json_members(p, plen, &m)) <= 0 ||
+      (tn = json_members(t, tlen, &tm)) < 0) {
+    json_free(m);
+    return n <= 0 ? n : tn;
+  }
+
+  for (i = 0; i < n && res == 0; i++) {
+    struct json_patch_ref ref;
+    const char *v, *tv = NULL;
+    int vlen, tvlen = 0, off = (int) g->out.u.buf.len;
+    for (j = 0; j < tn && !json_key_equal(&m[i].key, &tm[j].key); j++) {
+    }
+    memset(&ref, 0, sizeof(ref));
+    if (j < tn) {
+      json_token_text(&tm[j].val, &tv, &tvlen);
+      ref.pos = (int) (tv - ctx->doc);
+      ref.end = ref.pos + tvlen;
+      json_member_span(ctx->doc, ref.pos, tm[j].key.ptr, &ref.start,
+                       &ref.prev);
+    }
+    json_token_text(&m[i].val, &v, &vlen);
+    if (m[i].val.type == JSON_TYPE_NULL) {
+      if (j < tn) res = json_patch_remove(ctx, &ref);
+    } else if (m[i].val.type == JSON_TYPE_OBJECT_END && j < tn &&
+               tm[j].val.type == JSON_TYPE_OBJECT_END) {
+      res = json_merge_object(ctx, tv, tvlen, v, vlen);
+    } else if (j < tn) {
+      json_merge_strip(&g->out, v, vlen);
+      json_printer_grow(&g->out, "", 1);
+      res = json_patch_replace(ctx, &ref, off);
+    } else {
+      /* New member, the key is copied as is */
+      json_printf(&g->out, "\"%.*s\":", m[i].key.len, m[i].key.ptr);
+      json_merge_strip(&g->out, v, vlen);
+      json_printer_grow(&g->out, "", 1);
+      res = json_patch_append(ctx, t, tlen, off);
+    }
+  }
+  json_free(m);
+  json_free(tm);
+  return res;
+}
+
+int json_merge_patch(const char *s, int len, struct json_out *out,
+                     const char *patch, int patch_len) WEAK;
+int json_merge_patch(const char *s, int len, struct json_out *out,
+                     const char *patch, int patch_len) {
+  struct json_patch_ctx ctx;
+  int i = 0, n, res;
+  memset(&ctx, 0, sizeof(ctx));
+  json_grow_init(&ctx.scratch);
+  ctx.doc = s;
+  while (patch_len > 0 && json_isspace(*patch)) patch++, patch_len--;
+  while (i < len && json_isspace(s[i])) i++;
+
+  if ((res = json_walk(patch, patch_len, NULL, NULL)) < 0) {
+    /* Invalid patch */
+  } else if ((n = json_walk(s, len, NULL, NULL)) < 0 && i < len) {
+    res = n;
+  } else if (patch_len > 0 && patch[0] == '{' && i < len && s[i] == '{') {
+    res = json_merge_object(&ctx, s + i, n - i, patch, patch_len);
+  } else {
+    /* Not an object: the patch replaces the whole document */
+    json_merge_strip(&ctx.scratch.out, patch, patch_len);
+    json_printer_grow(&ctx.scratch.out, "", 1);
+    res = json_patch_setf(&ctx, 0, i, i, n < 0 ? i : n, 0);
+  }
+  if (res >= 0) res = json_patch_apply(&ctx, s, len, out);
+  json_free(ctx.setf);
+  json_free(ctx.scratch.out.u.buf.buf);
+  return res;
+}
+
+/*
+ * Structural diff. Each document is validated by one walk that also records
+ * the length of every value, so members are stepped over without parsing
+ * them again, and unchanged regions cost a byte comparison. Objects whose
+ * keys diverge are matched through a hash table of the members of `b`.
+ * Tables start in fixed buffers and grow with the allocator; if it fails,
+ * values are re-scanned and members searched linearly instead.
+ */
+
+/* A value of a document, numbered in the order json_walk() reports them */
+struct json_diff_node {
+  int len;   /* Length of the value */
+  int count; /* Values nested in it; while it is open, the enclosing one */
+};
+
+struct json_diff_tree {
+  struct json_diff_node *nodes; /* NULL if the table did not fit */
+  int num_nodes, max_nodes;
+  int open; /* Innermost open object or array, or -1 */
+  int depth;
+  struct json_diff_node scratch[JSON_DIFF_SCRATCH_SIZE];
+};
+
+/* A member of an object of `b`, chained into a hash table by its key */
+struct json_diff_member {
+  struct json_token key, val;
+  int node;    /* Node of the value, or -1 */
+  int head;    /* First member whose key hashes to this slot, or -1 */
+  int next;    /* Next member with the same hash slot, or -1 */
+  int matched; /* Whether a member of `a` has the same key */
+};
+
+struct json_diff {
+  struct json_out *out;
+  int paths_only;
+  int num_ops;
+  int path_len;
+  char path[JSON_MAX_PATH_LEN];
+  const struct json_diff_node *a_nodes, *b_nodes;
+  int num_scratch; /* Members of `scratch` in use, in LIFO order */
+  struct json_diff_member scratch[JSON_DIFF_SCRATCH_SIZE];
+};
+
+/* Cursor over the members of an object or the elements of an array */
+struct json_diff_iter {
+  const char *cur;
+  const char *end;
+  const struct json_diff_node *nodes; /* NULL to re-scan values */
+  int node;                           /* Node of the next value */
+};
+
+static const char *json_diff_skip(const char *p, const char *end) {
+  while (p < end && json_isspace(*p)) p++;
+  return p;
+}
+
+/* Return the length of the JSON value at `p`, which is known to be valid */
+static int json_diff_value_len(const char *p, const char *end) {
+  struct json_parser f;
+  memset(&f, 0, sizeof(f));
+  f.cur = p;
+  f.end = end;
+  f.limit = JSON_MAX_DEPTH;
+  return json_parse_value(&f) < 0 ? 0 : (int) (f.cur - p);
+}
+
+static void json_diff_tree_cb(void *userdata, const char *name,
+                              size_t name_len, const char *path,
+                              const struct json_token *t) {
+  struct json_diff_tree *tr = (struct json_diff_tree *) userdata;
+  struct json_diff_node *p;
+  int i;
+  if (t->type == JSON_TYPE_OBJECT_END || t->type == JSON_TYPE_ARRAY_END) {
+    tr->depth--;
+    if (tr->nodes == NULL) return;
+    i = tr->open;
+    tr->open = tr->nodes[i].count;
+    tr->nodes[i].len = t->len;
+    tr->nodes[i].count = tr->num_nodes - i - 1;
+    return;
+  } else if (name == NULL && tr->depth > 0) {
+    return; /* A key, reported when the path is truncated */
+  }
+  if (tr->nodes != NULL && tr->num_nodes == tr->max_nodes) {
+    size_t size = tr->max_nodes * 2 * sizeof(*p);
+    if (tr->nodes == tr->scratch) {
+      p = (struct json_diff_node *) json_malloc(size);
+      if (p != NULL) memcpy(p, tr->scratch, sizeof(tr->scratch));
+    } else {
+      p = (struct json_diff_node *) json_realloc(tr->nodes, size);
+      if (p == NULL) json_free(tr->nodes);
+    }
+    tr->nodes = p;
+    tr->max_nodes *= 2;
+  }
+  i = tr->num_nodes++;
+  if (t->ptr == NULL) {
+    tr->depth++;
+    if (tr->nodes == NULL) return;
+    tr->nodes[i].count = tr->open;
+    tr->open = i;
+  } else if (tr->nodes != NULL) {
+    const char *v;
+    json_token_text(t, &v, &tr->nodes[i].len);
+    tr->nodes[i].count = 0;
+  }
+  (void) name_len;
+  (void) path;
+}
+
+/* Validate document `s,len`, recording its values into `tr` */
+static int json_diff_tree_init(struct json_diff_tree *tr, const char *s,
+                               int len) {
+  tr->nodes = tr->scratch;
+  tr->max_nodes = JSON_DIFF_SCRATCH_SIZE;
+  tr->num_nodes = tr->depth = 0;
+  tr->open = -1;
+  return json_walk(s, len, json_diff_tree_cb, tr);
+}
+
+static void json_diff_tree_free(struct json_diff_tree *tr) {
+  if (tr->nodes != tr->scratch) json_free(tr->nodes);
+}
+
+/* Length of the value at `p`, which is `node` of `nodes` unless NULL */
+static int json_diff_len(const struct json_diff_node *nodes, int node,
+                         const char *p, const char *end) {
+  return nodes != NULL ? nodes[node].len : json_diff_value_len(p, end);
+}
+
+static void json_diff_iter_init(struct json_diff_iter *it, const char *s,
+                                int len, const struct json_diff_node *nodes,
+                                int node) {
+  it->cur = s + 1;
+  it->end = s + len - 1;
+  it->nodes = nodes;
+  it->node = node + 1;
+}
+
+/*
+ * Advance to the next member. `key` is NULL for arrays, for objects it
+ * receives the key without quotes. `node` receives the node of the value.
+ * Return 0 at the end of the container.
+ */
+static int json_diff_next(struct json_diff_iter *it, struct json_token *key,
+                          struct json_token *val, int *node) {
+  const char *p = json_diff_skip(it->cur, it->end);
+  if (p >= it->end) return 0;
+  if (key != NULL && *p == '"') {
+    key->ptr = p + 1;
+    key->len = json_diff_value_len(p, it->end) - 2;
+    p = json_diff_skip(p + key->len + 2, it->end);
+    p = json_diff_skip(p + 1, it->end);
+  } else if (key != NULL) {
+    /* Unquoted key */
+    key->ptr = p;
+    while (p < it->end && (*p == '_' || json_isalpha(*p) || json_isdigit(*p))) {
+      p++;
+    }
+    key->len = (int) (p - key->ptr);
+    p = json_diff_skip(json_diff_skip(p, it->end) + 1, it->end);
+  }
+  val->ptr = p;
+  val->len = json_diff_len(it->nodes, it->node, p, it->end);
+  *node = it->node;
+  if (it->nodes != NULL) it->node += it->nodes[it->node].count + 1;
+  p = json_diff_skip(p + val->len, it->end);
+  it->cur = p < it->end && *p == ',' ? p + 1 : p;
+  return 1;
+}
+
+/* Return 1 if keys `a` and `b`, as in JSON text, name the same member */
+static int json_diff_key_equal(const struct json_token *a,
+                               const struct json_token *b) {
+  return (a->len == b->len && memcmp(a->ptr, b->ptr, a->len) == 0) ||
+         json_key_equal(a, b) == 1;
+}
+
+/* FNV-1a hash of the unescaped bytes of key `k` */
+static unsigned int json_diff_hash(const struct json_token *k) {
+  struct json_decoder dec;
+  unsigned int h = 2166136261U;
+  int c;
+  json_decoder_init(&dec, k->ptr, k->len, 0);
+  while ((c = json_decoder_next(&dec)) >= 0 && c < 256) {
+    h = (h ^ (unsigned int) c) * 16777619U;
+  }
+  return h;
+}
+
+/*
+ * Collect the rest of the members of `it` into a hash table, taken from
+ * the scratch of `d` or from the allocator. Return the number of members,
+ * or JSON_NO_MEMORY.
+ */
+static int json_diff_index(struct json_diff *d, struct json_diff_iter it,
+                           struct json_diff_member **members) {
+  struct json_diff_member *m = d->scratch + d->num_scratch, *p;
+  int i, n = 0, max = JSON_DIFF_SCRATCH_SIZE - d->num_scratch;
+  struct json_token k, v;
+  unsigned int h;
+  while (json_diff_next(&it, &k, &v, &i)) {
+    if (n == max) {
+      size_t size = (max < 8 ? 16 : max * 2) * sizeof(*m);
+      if (m == d->scratch + d->num_scratch) {
+        p = (struct json_diff_member *) json_malloc(size);
+        if (p != NULL && n > 0) memcpy(p, m, n * sizeof(*m));
+      } else {
+        p = (struct json_diff_member *) json_realloc(m, size);
+        if (p == NULL) json_free(m);
+      }
+      if (p == NULL) return JSON_NO_MEMORY;
+      m = p;
+      max = (int) (size / sizeof(*m));
+    }
+    m[n].key = k;
+    m[n].val = v;
+    m[n].node = it.nodes != NULL ? i : -1;
+    m[n].head = -1;
+    m[n].matched = 0;
+    n++;
+  }
+  /* Chain in reverse, so that the first of duplicate keys is found first */
+  for (i = n - 1; i >= 0; i--) {
+    h = json_diff_hash(&m[i].key) % (unsigned int) n;
+    m[i].next = m[h].head;
+    m[h].head = i;
+  }
+  if (m == d->scratch + d->num_scratch) d->num_scratch += n;
+  *members = m;
+  return n;
+}
+
+static void json_diff_index_free(struct json_diff *d,
+                                 struct json_diff_member *m, int n) {
+  if (m == d->scratch + d->num_scratch - n) {
+    d->num_scratch -= n;
+  } else {
+    json_free(m);
+  }
+}
+
+/*
+ * Find member `key` among `m,n` and mark all members with that key as
+ * matched. Return the first one, or NULL.
+ */
+static struct json_diff_member *json_diff_lookup(struct json_diff_member *m,
+                                                 int n,
+                                                 const struct json_token *key) {
+  struct json_diff_member *found = NULL;
+  int i;
+  if (n == 0) return NULL;
+  for (i = m[json_diff_hash(key) % (unsigned int) n].head; i >= 0;
+       i = m[i].next) {
+    if (!json_diff_key_equal(&m[i].key, key)) continue;
+    if (found == NULL) found = &m[i];
+    m[i].matched = 1;
+  }
+  return found;
+}
+
+/* Find member `key` among the rest of the members of `it` */
+static int json_diff_find(struct json_diff_iter it,
+                          const struct json_token *key,
+                          struct json_token *val, int *node) {
+  struct json_token k;
+  while (json_diff_next(&it, &k, val, node)) {
+    if (json_diff_key_equal(&k, key)) return 1;
+  }
+  return 0;
+}
+
+/*
+ * Append the key `s,len`, escaped as in JSON text, to the JSON Pointer.
+ * Return the previous pointer length, or -1 if it does not fit.
+ */
+static int json_diff_push(struct json_diff *d, const char *s, int len) {
+  char key[JSON_MAX_PATH_LEN];
+  int i, n = d->path_len, size = (int) sizeof(d->path) - 2;
+  int key_len = json_unescape(s, len, key, sizeof(key));
+  if (key_len < 0 || key_len > (int) sizeof(key) || n >= size) return -1;
+  d->path[d->path_len++] = '/';
+  for (i = 0; i < key_len && d->path_len < size; i++) {
+    if (key[i] == '~' || key[i] == '/') {
+      d->path[d->path_len++] = '~';
+      d->path[d->path_len++] = key[i] == '~' ? '0' : '1';
+    } else {
+      d->path[d->path_len++] = key[i];
+    }
+  }
+  return i < key_len ? -1 : n;
+}
+
+static int json_diff_push_index(struct json_diff *d, int idx) {
+  char buf[20];
+  return json_diff_push(d, buf, snprintf(buf, sizeof(buf), "%d", idx));
+}
+
+static void json_diff_emit(struct json_diff *d, const char *op,
+                           const char *val, int len) {
+  struct json_out *out = d->out;
+  if (d->num_ops++ > 0) json_out_print(out, ",", 1);
+  if (d->paths_only) {
+    json_printf(out, "%.*Q", d->path_len, d->path);
+    return;
+  }
+  json_out_print(out, "{\"op\":\"", 7);
+  json_out_print(out, op, strlen(op));
+  json_out_print(out, "\",\"path\":", 9);
+  json_printf(out, "%.*Q", d->path_len, d->path);
+  if (val != NULL) {
+    json_out_print(out, ",\"value\":", 9);
+    json_out_print(out, val, len);
+  }
+  json_out_print(out, "}", 1);
+}
+
+static int json_diff_value(struct json_diff *d, const char *a, int alen,
+                           int na, const char *b, int blen, int nb);
+
+/* Diff a member or an element whose pointer token is already pushed */
+static int json_diff_child(struct json_diff *d, int n,
+                           const struct json_token *a, int na,
+                           const struct json_token *b, int nb) {
+  int res;
+  if (n < 0) return JSON_DEPTH_LIMIT;
+  res = json_diff_value(d, a->ptr, a->len, na, b->ptr, b->len, nb);
+  d->path_len = n;
+  return res;
+}
+
+/* Emit a removal of the member whose pointer token is already pushed */
+static int json_diff_remove(struct json_diff *d, int n) {
+  if (n < 0) return JSON_DEPTH_LIMIT;
+  json_diff_emit(d, "remove", NULL, 0);
+  d->path_len = n;
+  return 0;
+}
+
+static int json_diff_add(struct json_diff *d, const struct json_token *key,
+                         const struct json_token *val) {
+  int n = json_diff_push(d, key->ptr, key->len);
+  if (n < 0) return JSON_DEPTH_LIMIT;
+  json_diff_emit(d, "add", val->ptr, val->len);
+  d->path_len = n;
+  return 0;
+}
+
+static int json_diff_object(struct json_diff *d, const char *a, int alen,
+                            int na, const char *b, int blen, int nb) {
+  struct json_diff_iter ia, ib, ra, rb;
+  struct json_diff_member *m, *mb;
+  struct json_token ka, kb, va, vb;
+  int i, n, num, res = 0;
+  json_diff_iter_init(&ia, a, alen, d->a_nodes, na);
+  json_diff_iter_init(&ib, b, blen, d->b_nodes, nb);
+
+  /* Fast path: both objects list the same keys in the same order */
+  for (;;) {
+    ra = ia;
+    rb = ib;
+    if (!json_diff_next(&ia, &ka, &va, &na) ||
+        !json_diff_next(&ib, &kb, &vb, &nb) ||
+        !json_diff_key_equal(&ka, &kb)) {
+      break;
+    }
+    n = json_diff_push(d, ka.ptr, ka.len);
+    if ((res = json_diff_child(d, n, &va, na, &vb, nb)) < 0) return res;
+  }
+
+  /* The keys diverged: match the rest of the members by name */
+  ia = ra;
+  ib = rb;
+  if ((num = json_diff_index(d, rb, &m)) >= 0) {
+    while (res >= 0 && json_diff_next(&ia, &ka, &va, &na)) {
+      n = json_diff_push(d, ka.ptr, ka.len);
+      if ((mb = json_diff_lookup(m, num, &ka)) != NULL) {
+        res = json_diff_child(d, n, &va, na, &mb->val, mb->node);
+      } else {
+        res = json_diff_remove(d, n);
+      }
+    }
+    for (i = 0; res >= 0 && i < num; i++) {
+      if (!m[i].matched) res = json_diff_add(d, &m[i].key, &m[i].val);
+    }
+    json_diff_index_free(d, m, num);
+    return res;
+  }
+
+  /* Out of memory: search the members linearly */
+  while (res >= 0 && json_diff_next(&ia, &ka, &va, &na)) {
+    n = json_diff_push(d, ka.ptr, ka.len);
+    if (json_diff_find(rb, &ka, &vb, &nb)) {
+      res = json_diff_child(d, n, &va, na, &vb, nb);
     } else {
-      fputc('\n', fp);
+      res = json_diff_remove(d, n);
     }
-    fclose(fp);
   }
-  free(s);
+  while (res >= 0 && json_diff_next(&ib, &kb, &vb, &nb)) {
+    if (!json_diff_find(ra, &kb, &va, &na)) res = json_diff_add(d, &kb, &vb);
+  }
+  return res;
+}
+
+/*
+ * Arrays are compared element by element. Extra elements of `a` are removed
+ * from the position where `b` ends, extra elements of `b` are appended.
+ */
+static int json_diff_array(struct json_diff *d, const char *a, int alen,
+                           int na, const char *b, int blen, int nb) {
+  struct json_diff_iter ia, ib;
+  struct json_token va, vb;
+  int i, n, ha, hb, res = 0, b_len = -1;
+  json_diff_iter_init(&ia, a, alen, d->a_nodes, na);
+  json_diff_iter_init(&ib, b, blen, d->b_nodes, nb);
+  for (i = 0; res >= 0; i++) {
+    ha = json_diff_next(&ia, NULL, &va, &na);
+    hb = json_diff_next(&ib, NULL, &vb, &nb);
+    if (!ha && !hb) break;
+    if (!hb && b_len < 0) b_len = i;
+    n = json_diff_push_index(d, ha && !hb && !d->paths_only ? b_len : i);
+    if (ha && hb) {
+      res = json_diff_child(d, n, &va, na, &vb, nb);
+    } else if (n < 0) {
+      res = JSON_DEPTH_LIMIT;
+    } else {
+      json_diff_emit(d, ha ? "remove" : "add", hb ? vb.ptr : NULL,
+                     hb ? vb.len : 0);
+      d->path_len = n;
+    }
+  }
+  return res;
+}
+
+static int json_diff_value(struct json_diff *d, const char *a, int alen,
+                           int na, const char *b, int blen, int nb) {
+  if (alen == blen && memcmp(a, b, alen) == 0) return 0;
+  if (a[0] == '{' && b[0] == '{') {
+    return json_diff_object(d, a, alen, na, b, blen, nb);
+  }
+  if (a[0] == '[' && b[0] == '[') {
+    return json_diff_array(d, a, alen, na, b, blen, nb);
+  }
+  json_diff_emit(d, "replace", b, blen);
+  return 0;
+}
+
+static int json_diff_doc(const char *a, int alen, const char *b, int blen,
+                         struct json_out *out, int paths_only) {
+  struct json_diff d;
+  struct json_diff_tree ta, tb;
+  const char *ea = a + alen, *eb = b + blen;
+  int res;
+  if ((res = json_diff_tree_init(&ta, a, alen)) >= 0) {
+    res = json_diff_tree_init(&tb, b, blen);
+    if (res < 0) json_diff_tree_free(&tb);
+  }
+  if (res < 0) {
+    json_diff_tree_free(&ta);
+    return res;
+  }
+  memset(&d, 0, sizeof(d));
+  d.out = out;
+  d.paths_only = paths_only;
+  d.a_nodes = ta.nodes;
+  d.b_nodes = tb.nodes;
+  a = json_diff_skip(a, ea);
+  b = json_diff_skip(b, eb);
+  json_out_print(out, "[", 1);
+  res = json_diff_value(&d, a, json_diff_len(d.a_nodes, 0, a, ea), 0, b,
+                        json_diff_len(d.b_nodes, 0, b, eb), 0);
+  json_out_print(out, "]", 1);
+  json_diff_tree_free(&ta);
+  json_diff_tree_free(&tb);
+  return res < 0 ? res : d.num_ops;
+}
+
+int json_diff(const char *a, int alen, const char *b, int blen,
+              struct json_out *out) WEAK;
+int json_diff(const char *a, int alen, const char *b, int blen,
+              struct json_out *out) {
+  return json_diff_doc(a, alen, b, blen, out, 0);
+}
+
+int json_diff_paths(const char *a, int alen, const char *b, int blen,
+                    struct json_out *out) WEAK;
+int json_diff_paths(const char *a, int alen, const char *b, int blen,
+                    struct json_out *out) {
+  return json_diff_doc(a, alen, b, blen, out, 1);
+}
+
+/*
+ * Streaming reformatter. The input is fed in chunks of any size and the
+ * state between chunks is a few integers plus one bit per open container,
+ * so files can be reformatted in bounded memory. Bytes that are printed
+ * unchanged are collected into runs and printed with one call, so compact
+ * input is copied to compact output in large pieces. The grammar is the one
+ * of json_walk(), including its error codes.
+ */
+enum json_pretty_state {
+  JSON_PRETTY_VALUE,      /* A value is expected */
+  JSON_PRETTY_NEXT,       /* A member, an element or the closing bracket */
+  JSON_PRETTY_COMMA,      /* An optional comma after a member or element */
+  JSON_PRETTY_KEY,        /* A key */
+  JSON_PRETTY_COLON,      /* A colon after a key */
+  JSON_PRETTY_IDENT,      /* Inside an unquoted key */
+  JSON_PRETTY_STRING,     /* Inside a string or a quoted key */
+  JSON_PRETTY_ESCAPE,     /* After a backslash */
+  JSON_PRETTY_HEX,        /* Inside \uXXXX */
+  JSON_PRETTY_UTF8,       /* Inside a multi-byte UTF-8 character */
+  JSON_PRETTY_LITERAL,    /* Inside true, false or null */
+  JSON_PRETTY_SIGN,       /* After the minus of a number */
+  JSON_PRETTY_ZERO,       /* After a leading zero, 0x may follow */
+  JSON_PRETTY_HEX_FIRST,  /* After 0x */
+  JSON_PRETTY_HEX_DIGITS, /* Inside a hex number */
+  JSON_PRETTY_INT,        /* Inside the integer part */
+  JSON_PRETTY_FRAC_FIRST, /* After the decimal point */
+  JSON_PRETTY_FRAC,       /* Inside the fraction */
+  JSON_PRETTY_EXP_SIGN,   /* After e or E */
+  JSON_PRETTY_EXP_FIRST,  /* After the sign of the exponent */
+  JSON_PRETTY_EXP,        /* Inside the exponent */
+  JSON_PRETTY_DONE        /* The top-level value is complete */
+};
+
+struct json_pretty {
+  struct json_out *out;
+  int indent; /* Spaces per level, 0 for compact output */
+  enum json_pretty_state state;
+  int depth;           /* Number of open containers */
+  int first;           /* The innermost container has no members yet */
+  int is_key;          /* The string being copied is a key */
+  int sub;             /* Bytes left in an escape or a UTF-8 char */
+  int hex_ok;          /* All \uXXXX digits so far are valid */
+  const char *literal; /* Rest of the literal being matched */
+  int err;
+  size_t consumed; /* Bytes up to the end of the top-level value */
+
+  /* Valid during json_pretty_feed() only */
+  const char *run;   /* Start of the bytes to print unchanged */
+  const char *comma; /* A comma at the end of the run, not printed yet */
+
+  unsigned char objects[(JSON_MAX_DEPTH + 7) / 8]; /* 1 for {, 0 for [ */
+};
+
+static void json_pretty_init(struct json_pretty *p, struct json_out *out,
+                             int indent) {
+  memset(p, 0, sizeof(*p));
+  p->out = out;
+  p->indent = indent;
+}
+
+static int json_pretty_in_object(const struct json_pretty *p) {
+  int i = p->depth - 1;
+  return p->depth > 0 && (p->objects[i / 8] >> (i % 8)) & 1;
+}
+
+/* Print the run of unchanged bytes that ends at `end` */
+static void json_pretty_flush(struct json_pretty *p, const char *end) {
+  if (p->run != NULL && end > p->run) {
+    json_out_print(p->out, p->run, end - p->run);
+  }
+  p->run = NULL;
+  p->comma = NULL;
+}
+
+/* Leave out the byte at `cur`. A comma at the end of the run is held back */
+static void json_pretty_skip(struct json_pretty *p, const char *cur) {
+  json_pretty_flush(p, p->comma != NULL ? p->comma : cur);
+}
+
+/* Print the byte at `cur` unchanged */
+static void json_pretty_copy(struct json_pretty *p, const char *cur) {
+  if (p->run == NULL) p->run = cur;
+}
+
+/* Print `str` before the byte at `cur` */
+static void json_pretty_insert(struct json_pretty *p, const char *cur,
+                               const char *str, int len) {
+  json_pretty_flush(p, cur);
+  json_out_print(p->out, str, len);
+}
+
+/* Print a newline and indentation for `level`, in as few calls as possible */
+static void json_pretty_newline(struct json_pretty *p, const char *cur,
+                                int level) {
+  static const char spaces[] = "\n                                ";
+  int n = level * p->indent, chunk = (int) sizeof(spaces) - 2;
+  if (p->indent <= 0) return;
+  json_pretty_insert(p, cur, spaces, 1 + (n < chunk ? n : chunk));
+  for (n -= chunk; n > 0; n -= chunk) {
+    json_out_print(p->out, spaces + 1, n < chunk ? n : chunk);
+  }
+}
+
+/* Start a member or an element of the innermost container at `cur` */
+static void json_pretty_member(struct json_pretty *p, const char *cur) {
+  if (!p->first && p->comma == NULL) json_pretty_insert(p, cur, ",", 1);
+  p->comma = NULL;
+  p->first = 0;
+  json_pretty_newline(p, cur, p->depth);
+}
+
+static void json_pretty_value_done(struct json_pretty *p) {
+  p->state = p->depth == 0 ? JSON_PRETTY_DONE : JSON_PRETTY_COMMA;
+}
+
+/* Handle the first byte of a value */
+static void json_pretty_value(struct json_pretty *p, const char *cur) {
+  int ch = *(const unsigned char *) cur;
+  if (p->depth + 1 >= JSON_MAX_DEPTH) {
+    p->err = JSON_DEPTH_LIMIT;
+    return;
+  }
+  json_pretty_copy(p, cur);
+  switch (ch) {
+    case '{':
+#if JSON_ENABLE_ARRAY
+    case '[':
+#endif
+      if (ch == '{') {
+        p->objects[p->depth / 8] |= (unsigned char) (1 << (p->depth % 8));
+      } else {
+        p->objects[p->depth / 8] &= (unsigned char) ~(1 << (p->depth % 8));
+      }
+      p->depth++;
+      p->first = 1;
+      p->state = JSON_PRETTY_NEXT;
+      break;
+    case '"':
+      p->is_key = 0;
+      p->state = JSON_PRETTY_STRING;
+      break;
+    case 't':
+    case 'f':
+    case 'n':
+      p->literal = ch == 't' ? "rue" : ch == 'f' ? "alse" : "ull";
+      p->state = JSON_PRETTY_LITERAL;
+      break;
+    case '-':
+      p->state = JSON_PRETTY_SIGN;
+      break;
+    case '0':
+      p->state = JSON_PRETTY_ZERO;
+      break;
+    default:
+      p->state = JSON_PRETTY_INT;
+      if (!json_isdigit(ch)) p->err = JSON_STRING_INVALID;
+      break;
+  }
+}
+
+/*
+ * Advance a number by one byte, return 0 if the byte ends it. Invalid
+ * numbers set `err`.
+ */
+static int json_pretty_number(struct json_pretty *p, int ch) {
+  enum json_pretty_state next = p->state;
+  switch (p->state) {
+    case JSON_PRETTY_SIGN:
+      next = ch == '0' ? JSON_PRETTY_ZERO : JSON_PRETTY_INT;
+      if (!json_isdigit(ch)) p->err = JSON_STRING_INVALID;
+      break;
+    case JSON_PRETTY_ZERO:
+      if (ch == 'x') {
+        next = JSON_PRETTY_HEX_FIRST;
+        break;
+      }
+      p->state = JSON_PRETTY_INT;
+      return json_pretty_number(p, ch);
+    case JSON_PRETTY_HEX_FIRST:
+      next = JSON_PRETTY_HEX_DIGITS;
+      if (!json_isxdigit(ch)) p->err = JSON_STRING_INVALID;
+      break;
+    case JSON_PRETTY_HEX_DIGITS:
+      if (!json_isxdigit(ch)) return 0;
+      break;
+    case JSON_PRETTY_INT:
+    case JSON_PRETTY_FRAC:
+      if (ch == '.' && p->state == JSON_PRETTY_INT) {
+        next = JSON_PRETTY_FRAC_FIRST;
+      } else if (ch == 'e' || ch == 'E') {
+        next = JSON_PRETTY_EXP_SIGN;
+      } else if (!json_isdigit(ch)) {
+        return 0;
+      }
+      break;
+    case JSON_PRETTY_FRAC_FIRST:
+    case JSON_PRETTY_EXP_FIRST:
+      next = p->state == JSON_PRETTY_FRAC_FIRST ? JSON_PRETTY_FRAC
+                                                : JSON_PRETTY_EXP;
+      if (!json_isdigit(ch)) p->err = JSON_STRING_INVALID;
+      break;
+    case JSON_PRETTY_EXP_SIGN:
+      if (ch == '+' || ch == '-') {
+        next = JSON_PRETTY_EXP_FIRST;
+        break;
+      }
+      p->state = JSON_PRETTY_EXP_FIRST;
+      return json_pretty_number(p, ch);
+    default:
+      if (!json_isdigit(ch)) return 0;
+      break;
+  }
+  p->state = next;
+  return 1;
+}
+
+/* Feed the next chunk of the document */
+static void json_pretty_feed(struct json_pretty *p, const char *s,
+                             size_t len) {
+  const char *cur = s, *end = s + len;
+  p->comma = NULL;
+  p->run = p->state >= JSON_PRETTY_IDENT && p->state < JSON_PRETTY_DONE
+               ? s
+               : NULL;
+
+  while (cur < end && p->err == 0 && p->state != JSON_PRETTY_DONE) {
+    int ch = *(const unsigned char *) cur;
+    switch (p->state) {
+      case JSON_PRETTY_VALUE:
+        if (json_isspace(ch)) {
+          json_pretty_skip(p, cur);
+        } else {
+          json_pretty_value(p, cur);
+        }
+        break;
+      case JSON_PRETTY_NEXT:
+      case JSON_PRETTY_COMMA:
+        if (json_isspace(ch)) {
+          json_pretty_skip(p, cur);
+        } else if (ch == ',' && p->state == JSON_PRETTY_COMMA) {
+          json_pretty_copy(p, cur);
+          p->comma = cur;
+          p->state = JSON_PRETTY_NEXT;
+        } else if (ch == (json_pretty_in_object(p) ? '}' : ']')) {
+          /* A trailing comma is dropped */
+          if (p->comma != NULL) json_pretty_flush(p, p->comma);
+          if (!p->first) json_pretty_newline(p, cur, p->depth - 1);
+          json_pretty_copy(p, cur);
+          p->depth--;
+          p->first = 0;
+          json_pretty_value_done(p);
+        } else {
+          json_pretty_member(p, cur);
+          p->state = json_pretty_in_object(p) ? JSON_PRETTY_KEY
+                                              : JSON_PRETTY_VALUE;
+          continue;
+        }
+        break;
+      case JSON_PRETTY_KEY:
+        if (ch == '"') {
+          json_pretty_copy(p, cur);
+          p->is_key = 1;
+          p->state = JSON_PRETTY_STRING;
+        } else if (json_isalpha(ch)) {
+          json_pretty_insert(p, cur, "\"", 1);
+          json_pretty_copy(p, cur);
+          p->state = JSON_PRETTY_IDENT;
+        } else {
+          p->err = JSON_STRING_INVALID;
+        }
+        break;
+      case JSON_PRETTY_COLON:
+        if (json_isspace(ch)) {
+          json_pretty_skip(p, cur);
+        } else if (ch == ':') {
+          json_pretty_copy(p, cur);
+          if (p->indent > 0) json_pretty_insert(p, cur + 1, " ", 1);
+          p->state = JSON_PRETTY_VALUE;
+        } else {
+          p->err = JSON_STRING_INVALID;
+        }
+        break;
+      case JSON_PRETTY_IDENT:
+        while (cur < end && (*cur == '_' || json_isalpha(*cur) ||
+                             json_isdigit(*cur))) {
+          cur++;
+        }
+        if (cur < end) {
+          json_pretty_insert(p, cur, "\"", 1);
+          p->state = JSON_PRETTY_COLON;
+        }
+        continue;
+      case JSON_PRETTY_STRING:
+        /* Skip the longest run that needs no checks */
+        while (cur < end && *(const unsigned char *) cur >= 32 &&
+               *(const unsigned char *) cur < 0x80 && *cur != '"' &&
+               *cur != '\\') {
+          cur++;
+        }
+        if (cur == end) continue;
+        ch = *(const unsigned char *) cur;
+        if (ch < 32) {
+          p->err = JSON_STRING_INVALID;
+        } else if (ch == '\\') {
+          p->state = JSON_PRETTY_ESCAPE;
+        } else if (ch >= 0x80) {
+          p->sub = json_get_utf8_char_len((unsigned char) ch) - 1;
+          p->state = JSON_PRETTY_UTF8;
+        } else if (p->is_key) {
+          p->state = JSON_PRETTY_COLON;
+        } else {
+          json_pretty_value_done(p);
+        }
+        break;
+      case JSON_PRETTY_ESCAPE:
+        p->state = JSON_PRETTY_STRING;
+        if (ch == 'u') {
+          p->state = JSON_PRETTY_HEX;
+          p->sub = 4;
+          p->hex_ok = 1;
+        } else if (strchr("\"\\/bfnrt", ch) == NULL || ch == '\0') {
+          p->err = JSON_STRING_INVALID;
+        }
+        break;
+      case JSON_PRETTY_HEX:
+        if (!json_isxdigit(ch)) p->hex_ok = 0;
+        if (--p->sub > 0) break;
+        p->state = JSON_PRETTY_STRING;
+        if (!p->hex_ok) p->err = JSON_STRING_INVALID;
+        break;
+      case JSON_PRETTY_UTF8:
+        if (--p->sub <= 0) p->state = JSON_PRETTY_STRING;
+        break;
+      case JSON_PRETTY_LITERAL:
+        if (ch != *p->literal) {
+          p->err = JSON_STRING_INVALID;
+        } else if (*++p->literal == '\0') {
+          json_pretty_value_done(p);
+        }
+        break;
+      default:
+        if (!json_pretty_number(p, ch)) {
+          json_pretty_value_done(p);
+          continue;
+        }
+        break;
+    }
+    cur++;
+  }
+
+  if (p->err == 0) json_pretty_skip(p, cur);
+  p->consumed += cur - s;
+}
+
+/*
+ * Finish the document. Return the number of bytes up to the end of the
+ * top-level value, or negative error.
+ */
+static ptrdiff_t json_pretty_end(struct json_pretty *p) {
+  if (p->err != 0) return p->err;
+  switch (p->state) {
+    case JSON_PRETTY_ZERO:
+    case JSON_PRETTY_HEX_DIGITS:
+    case JSON_PRETTY_INT:
+    case JSON_PRETTY_FRAC:
+    case JSON_PRETTY_EXP:
+      json_pretty_value_done(p);
+      break;
+    case JSON_PRETTY_VALUE:
+    case JSON_PRETTY_NEXT:
+    case JSON_PRETTY_COMMA:
+      if (p->depth + 1 >= JSON_MAX_DEPTH &&
+          (p->state == JSON_PRETTY_VALUE || !json_pretty_in_object(p))) {
+        return JSON_DEPTH_LIMIT;
+      }
+      break;
+    default:
+      break;
+  }
+  if (p->state != JSON_PRETTY_DONE) return JSON_STRING_INCOMPLETE;
+  return (ptrdiff_t) p->consumed;
+}
+
+static int json_reformat_member_cmp(const void *a, const void *b) {
+  const struct json_member *x = (const struct json_member *) a;
+  const struct json_member *y = (const struct json_member *) b;
+  int n = memcmp(x->key.ptr, y->key.ptr,
+                 x->key.len < y->key.len ? x->key.len : y->key.len);
+  if (n == 0) n = x->key.len - y->key.len;
+  /* Keep duplicate keys in document order */
+  return n != 0 ? n : x->key.ptr < y->key.ptr ? -1 : 1;
+}
+
+/*
+ * Feed the valid value `s,len` to the reformatter with object members
+ * sorted by key. The value is fed piece by piece, with members in the new
+ * order, so the output is formatted by the same state machine.
+ */
+static int json_reformat_sorted(struct json_pretty *p, const char *s,
+                                int len) {
+  struct json_diff_iter it;
+  struct json_member *m;
+  struct json_token key, val;
+  int i, node, n = 0, res = 0, is_object = s[0] == '{';
+  if (s[0] != '{' && s[0] != '[') {
+    json_pretty_feed(p, s, len);
+    return 0;
+  }
+  json_diff_iter_init(&it, s, len, NULL, 0);
+  while (json_diff_next(&it, is_object ? &key : NULL, &val, &node)) n++;
+  m = (struct json_member *) json_malloc((n > 0 ? n : 1) * sizeof(*m));
+  if (m == NULL) return JSON_NO_MEMORY;
+  json_diff_iter_init(&it, s, len, NULL, 0);
+  for (i = 0; i < n; i++) {
+    json_diff_next(&it, is_object ? &m[i].key : NULL, &m[i].val, &node);
+  }
+  if (is_object) qsort(m, n, sizeof(*m), json_reformat_member_cmp);
+
+  json_pretty_feed(p, s, 1);
+  for (i = 0; i < n && res == 0; i++) {
+    if (i > 0) json_pretty_feed(p, ",", 1);
+    if (is_object) {
+      /* Quoted keys are fed with the quotes */
+      int q = m[i].key.ptr[m[i].key.len] == '"';
+      json_pretty_feed(p, m[i].key.ptr - q, m[i].key.len + 2 * q);
+      json_pretty_feed(p, ":", 1);
+    }
+    res = json_reformat_sorted(p, m[i].val.ptr, m[i].val.len);
+  }
+  json_pretty_feed(p, s + len - 1, 1);
+  json_free(m);
   return res;
 }
 
+int json_reformat(const char *s, int len, struct json_out *out,
+                  const struct json_reformat_opts *opts) WEAK;
+int json_reformat(const char *s, int len, struct json_out *out,
+                  const struct json_reformat_opts *opts) {
+  struct json_pretty p;
+  int res = 0;
+  if (s == NULL || len < 0) return JSON_STRING_INVALID;
+  json_pretty_init(&p, out, opts == NULL ? 2 : opts->indent);
+  if (opts != NULL && opts->sort_keys) {
+    /* Whole values are moved around, so the input must be valid first */
+    const char *v = json_diff_skip(s, s + len);
+    int n = json_walk(s, len, NULL, NULL);
+    if (n < 0) return n;
+    res = json_reformat_sorted(&p, v, json_diff_value_len(v, s + len));
+    if (res == 0) res = (int) json_pretty_end(&p);
+    return res < 0 ? res : n;
+  }
+  json_pretty_feed(&p, s, len);
+  return (int) json_pretty_end(&p);
+}
+
+ptrdiff_t json_prettify_sz(const char *s, size_t len,
+                           struct json_out *out) WEAK;
+ptrdiff_t json_prettify_sz(const char *s, size_t len, struct json_out *out) {
+  struct json_pretty p;
+  if (s == NULL) return JSON_STRING_INVALID;
+  json_pretty_init(&p, out, 2);
+  json_pretty_feed(&p, s, len);
+  return json_pretty_end(&p);
+}
+
+int json_prettify(const char *s, int len, struct json_out *out) WEAK;
+int json_prettify(const char *s, int len, struct json_out *out) {
+  return json_reformat(s, len, out, NULL);
+}
+
+int json_minify(const char *s, int len, struct json_out *out) WEAK;
+int json_minify(const char *s, int len, struct json_out *out) {
+  struct json_reformat_opts opts = {0, 0};
+  return json_reformat(s, len, out, &opts);
+}
+
+/*
+ * Create a new file next to `file_name`, named `file_name` with the first
+ * ".N.tmp" suffix that is not taken yet. On POSIX systems the file is
+ * created exclusively, with the permission bits of `file_name`.
+ */
+#define JSON_PRETTIFY_TMP_SUFFIX 16
+static FILE *json_prettify_tmp(const char *file_name, char *tmp_name) {
+  size_t name_len = strlen(file_name);
+  unsigned i;
+  memcpy(tmp_name, file_name, name_len);
+  for (i = 0; i < 100; i++) {
+    FILE *fp;
+#if JSON_POSIX_FILES
+    struct stat st;
+    int fd;
+#endif
+    snprintf(tmp_name + name_len, JSON_PRETTIFY_TMP_SUFFIX, ".%u.tmp", i);
+#if JSON_POSIX_FILES
+    if ((fd = open(tmp_name, O_WRONLY | O_CREAT | O_EXCL, 0600)) < 0) {
+      if (errno == EEXIST) continue;
+      return NULL;
+    }
+    if (stat(file_name, &st) != 0 || fchmod(fd, st.st_mode & 0777) != 0 ||
+        (fp = fdopen(fd, "wb")) == NULL) {
+      close(fd);
+      remove(tmp_name);
+      return NULL;
+    }
+#else
+    if ((fp = fopen(tmp_name, "rb")) != NULL) {
+      fclose(fp); /* Taken */
+      continue;
+    }
+    fp = fopen(tmp_name, "wb");
+#endif
+    return fp;
+  }
+  return NULL;
+}
+
+int json_prettify_file(const char *file_name) WEAK;
+int json_prettify_file(const char *file_name) {
+  /* The state, the temporary file name and the read buffer share one block */
+  struct json_pretty *p = (struct json_pretty *) json_malloc(
+      sizeof(*p) + JSON_PRETTIFY_BUF_SIZE + strlen(file_name) +
+      JSON_PRETTIFY_TMP_SUFFIX);
+  char *buf = (char *) (p + 1), *tmp_name = buf + JSON_PRETTIFY_BUF_SIZE;
+  FILE *fp = NULL, *tmp = NULL;
+  ptrdiff_t res = -1;
+
+  if (p != NULL && (fp = fopen(file_name, "rb")) != NULL &&
+      (tmp = json_prettify_tmp(file_name, tmp_name)) != NULL) {
+    struct json_out out = JSON_OUT_FILE(tmp);
+    size_t n;
+    json_pretty_init(p, &out, 2);
+    while (p->state != JSON_PRETTY_DONE && p->err == 0 &&
+           (n = fread(buf, 1, JSON_PRETTIFY_BUF_SIZE, fp)) > 0) {
+      json_pretty_feed(p, buf, n);
+    }
+    res = ferror(fp) ? -1 : json_pretty_end(p);
+    if (res >= 0) fputc('\n', tmp);
+    if (fclose(tmp) != 0 && res >= 0) res = -1;
+    fclose(fp);
+    fp = NULL;
+    /* Replace the file only if the whole document was written */
+#ifdef _WIN32
+    if (res >= 0) remove(file_name);
+#endif
+    if (res < 0 || rename(tmp_name, file_name) != 0) {
+      remove(tmp_name);
+      if (res >= 0) res = -1;
+    }
+  }
+  if (fp != NULL) fclose(fp);
+  json_free(p);
+  return res > INT_MAX ? INT_MAX : (int) res;
+}
+
 struct next_data {
   void *handle;            // Passed handle. Changed if a next entry is found
   const char *path;        // Path to the iterated object/array
@@ -1474,10 +4843,184 @@ void *json_next_elem(const char *s, int len, void *handle, const char *path,
   return json_next(s, len, handle, path, NULL, val, idx);
 }
 
+/* States of json_next_token() besides negative error codes */
+enum json_pull_state {
+  JSON_PULL_START,  /* Before the top-level value */
+  JSON_PULL_OPENED, /* After the start of an object or array */
+  JSON_PULL_MEMBER, /* After a member of an object or array */
+  JSON_PULL_DONE    /* After the top-level value */
+};
+
+static int json_pull_cur(struct json_pull *p) {
+  while (p->cur < p->end && json_isspace(*p->cur)) p->cur++;
+  return p->cur >= p->end ? END_OF_STRING : *(unsigned char *) p->cur;
+}
+
+/* Same as json_append_to_path() */
+static void json_pull_append(struct json_pull *p, const char *str,
+                             size_t size) {
+  size_t left = sizeof(p->path) - p->path_len - 1;
+  if (size > left) size = left;
+  memcpy(p->path + p->path_len, str, size);
+  p->path_len += size;
+  p->path[p->path_len] = '\0';
+}
+
+static void json_pull_truncate(struct json_pull *p, size_t len) {
+  p->path_len = len;
+  p->path[len] = '\0';
+}
+
+/* value = 'null' | 'true' | 'false' | number | string | array | object */
+static int json_pull_value(struct json_pull *p, struct json_token *t) {
+  struct json_pull_frame *fr;
+  ptrdiff_t n = 0;
+  int ch = json_pull_cur(p);
+
+  t->ptr = p->cur;
+  switch (ch) {
+    case '"':
+      EXPECT((n = json_string_len(p->cur + 1, p->end, 0)) >= 0, (int) n);
+      t->ptr++;
+      t->type = JSON_TYPE_STRING;
+      p->cur += n + 2;
+      break;
+    case '{':
+#if JSON_ENABLE_ARRAY
+    case '[':
+#endif
+      EXPECT(p->depth < JSON_PULL_MAX_DEPTH, JSON_DEPTH_LIMIT);
+      fr = &p->frames[p->depth++];
+      fr->start = p->cur++;
+      fr->outer_len = p->path_len;
+      fr->index = 0;
+      fr->type = (char) ch;
+      t->ptr = NULL;
+      t->len = 0;
+      t->type = ch == '{' ? JSON_TYPE_OBJECT_START : JSON_TYPE_ARRAY_START;
+      p->state = JSON_PULL_OPENED;
+      return 1;
+    case 'n':
+    case 't':
+    case 'f': {
+      const char *lit = ch == 'n' ? "null" : ch == 't' ? "true" : "false";
+      for (; lit[n] != '\0'; n++) {
+        EXPECT(n < p->end - p->cur, JSON_STRING_INCOMPLETE);
+        EXPECT(p->cur[n] == lit[n], JSON_STRING_INVALID);
+      }
+      t->type = ch == 'n' ? JSON_TYPE_NULL
+                          : ch == 't' ? JSON_TYPE_TRUE : JSON_TYPE_FALSE;
+      p->cur += n;
+      break;
+    }
+    default:
+      if (ch == '-' || json_isdigit(ch)) {
+        EXPECT((n = json_number_len(p->cur, p->end)) >= 0, (int) n);
+        t->type = JSON_TYPE_NUMBER;
+        p->cur += n;
+        break;
+      }
+      return ch == END_OF_STRING ? JSON_STRING_INCOMPLETE : JSON_STRING_INVALID;
+  }
+  t->len = (int) n;
+  p->state = p->depth > 0 ? JSON_PULL_MEMBER : JSON_PULL_DONE;
+  return 1;
+}
+
+/* The next member of the innermost object or array, or its end */
+static int json_pull_member(struct json_pull *p, struct json_token *t) {
+  struct json_pull_frame *fr = &p->frames[p->depth - 1];
+  const char *key;
+  ptrdiff_t n;
+  int ch;
+
+  if (p->state == JSON_PULL_OPENED) {
+    if (fr->type == '{') json_pull_append(p, ".", 1);
+    fr->base_len = p->path_len;
+  } else {
+    json_pull_truncate(p, fr->base_len);
+    if (json_pull_cur(p) == ',') p->cur++;
+  }
+
+  ch = json_pull_cur(p);
+  if (ch == (fr->type == '{' ? '}' : ']')) {
+    p->cur++;
+    json_pull_truncate(p, fr->outer_len);
+    t->ptr = fr->start;
+    t->len = (int) (p->cur - fr->start);
+    t->type = fr->type == '{' ? JSON_TYPE_OBJECT_END : JSON_TYPE_ARRAY_END;
+    p->depth--;
+    p->state = p->depth > 0 ? JSON_PULL_MEMBER : JSON_PULL_DONE;
+    return 1;
+  }
+
+  if (fr->type == '[') {
+    char buf[20];
+    snprintf(buf, sizeof(buf), "[%d]", fr->index++);
+    json_pull_append(p, buf, strlen(buf));
+    p->name = p->path + strlen(p->path) - strlen(buf) + 1 /*opening brace*/;
+    p->name_len = strlen(buf) - 2 /*braces*/;
+    return json_pull_value(p, t);
+  }
+
+  /* pair = key ':' value, key = identifier | string */
+  key = p->cur;
+  if (json_isalpha(ch)) {
+    n = json_identifier_len(key, p->end);
+    p->cur += n;
+  } else if (ch == '"') {
+    EXPECT((n = json_string_len(++key, p->end, 0)) >= 0, (int) n);
+    p->cur = key + n + 1;
+  } else {
+    return ch == END_OF_STRING ? JSON_STRING_INCOMPLETE : JSON_STRING_INVALID;
+  }
+  p->name = key;
+  p->name_len = (size_t) n;
+  json_pull_append(p, key, (size_t) n);
+  ch = json_pull_cur(p);
+  EXPECT(ch == ':', ch == END_OF_STRING ? JSON_STRING_INCOMPLETE
+                                        : JSON_STRING_INVALID);
+  p->cur++;
+  return json_pull_value(p, t);
+}
+
+void json_pull_init(struct json_pull *p, const char *s, int len) WEAK;
+void json_pull_init(struct json_pull *p, const char *s, int len) {
+  p->name = NULL;
+  p->name_len = 0;
+  p->path[0] = '\0';
+  p->cur = s;
+  p->end = s + (len < 0 ? 0 : len);
+  p->path_len = 0;
+  p->depth = 0;
+  p->state = JSON_PULL_START;
+}
+
+int json_next_token(struct json_pull *p, struct json_token *token) WEAK;
+int json_next_token(struct json_pull *p, struct json_token *token) {
+  int res;
+
+  if (p->state < 0) return p->state;
+  if (p->state == JSON_PULL_DONE) return 0;
+  p->name = NULL;
+  p->name_len = 0;
+  if (p->state != JSON_PULL_START) {
+    res = json_pull_member(p, token);
+  } else if (p->cur == NULL) {
+    res = JSON_STRING_INVALID;
+  } else if (p->cur == p->end) {
+    res = JSON_STRING_INCOMPLETE;
+  } else {
+    res = json_pull_value(p, token);
+  }
+  if (res < 0) p->state = res;
+  return res;
+}
+
 static int json_sprinter(struct json_out *out, const char *str, size_t len) {
   size_t old_len = out->u.buf.buf == NULL ? 0 : strlen(out->u.buf.buf);
   size_t new_len = len + old_len;
-  char *p = (char *) realloc(out->u.buf.buf, new_len + 1);
+  char *p = (char *) json_realloc(out->u.buf.buf, new_len + 1);
   if (p != NULL) {
     memcpy(p + old_len, str, len);
     p[new_len] = '\0';
@@ -1491,7 +5034,10 @@ char *json_vasprintf(const char *fmt, va_list ap) {
   struct json_out out;
   memset(&out, 0, sizeof(out));
   out.printer = json_sprinter;
-  json_vprintf(&out, fmt, ap);
+  if (json_vprintf(&out, fmt, ap) < 0) {
+    json_free(out.u.buf.buf);
+    return NULL;
+  }
   return out.u.buf.buf;
 }
 
@@ -1504,3 +5050,5 @@ char *json_asprintf(const char *fmt, ...) {
   va_end(ap);
   return result;
 }
+
+#endif /* CS_FROZEN_FROZEN_C_ */
@@ -35,6 +35,28 @@ enum { false = 0, true = 1 };
 #include <stdbool.h>
 #endif
 
+/*
+ * Header-only mode: with FROZEN_HEADER_ONLY defined to 1 before every
+ * inclusion of frozen.h, the implementation is compiled into each including
+ * file as static inline functions, so the compiler can inline the API and
+ * specialize it for a caller's callbacks. Alternatively, define
+ * FROZEN_IMPLEMENTATION in exactly one file to compile the implementation
+ * there with regular linkage, as if frozen.c were built separately.
+ */
+#ifndef FROZEN_HEADER_ONLY
+#define FROZEN_HEADER_ONLY 0
+#endif
+
+#ifndef JSON_API
+#if !FROZEN_HEADER_ONLY
+#define JSON_API
+#elif defined(_MSC_VER) && !defined(__cplusplus)
+#define JSON_API static __inline
+#else
+#define JSON_API static inline
+#endif
+#endif
+
 /* JSON token type */
 enum json_token_type {
   JSON_TYPE_INVALID = 0, /* memsetting to 0 should create INVALID value */
@@ -68,6 +90,8 @@ struct json_token {
 #define JSON_STRING_INVALID -1
 #define JSON_STRING_INCOMPLETE -2
 #define JSON_DEPTH_LIMIT -3
+#define JSON_NO_MEMORY -4
+#define JSON_PATCH_FAILED -5
 
 /*
  * Callback-based SAX-like API.
@@ -104,27 +128,112 @@ typedef void (*json_walk_callback_t)(void *callback_data, const char *name,
  * see `json_walk_callback_t`.
  * Return number of processed bytes, or a negative error code.
  */
-int json_walk(const char *json_string, int json_string_length,
-              json_walk_callback_t callback, void *callback_data);
+JSON_API int json_walk(const char *json_string, int json_string_length,
+                       json_walk_callback_t callback, void *callback_data);
+
+/*
+ * Like `struct json_token`, but with a `size_t` length. Used by the `_sz`
+ * functions, which accept strings longer than INT_MAX.
+ */
+struct json_token_sz {
+  const char *ptr;           /* Points to the beginning of the value */
+  size_t len;                /* Value length */
+  enum json_token_type type; /* Type of the token */
+};
+
+typedef void (*json_walk_sz_callback_t)(void *callback_data, const char *name,
+                                        size_t name_len, const char *path,
+                                        const struct json_token_sz *token);
+
+/*
+ * Like `json_walk()`, but for a string of any size.
+ * Return number of processed bytes, or a negative error code.
+ */
+JSON_API ptrdiff_t json_walk_sz(const char *json_string,
+                                size_t json_string_length,
+                                json_walk_sz_callback_t callback,
+                                void *callback_data);
 
 /*
  * Extensible argument passing interface
  */
 
+/*
+ * Statistics of one json_walk_args() call, see `struct frozen_args`.
+ * Collected only if frozen is built with JSON_ENABLE_STATS=1.
+ */
+struct json_walk_stats {
+  unsigned long tokens[JSON_TYPES_CNT]; /* Values and container ends by type */
+  unsigned long callbacks;              /* Callback invocations */
+  unsigned long truncated_paths; /* Paths cut at JSON_MAX_PATH_LEN - 1 */
+  size_t max_path_len;           /* Longest path, after truncation */
+  size_t whitespace;             /* Whitespace bytes skipped */
+  int max_depth;                 /* Deepest value nesting, 1 for a scalar */
+};
+
 struct frozen_args {
   json_walk_callback_t callback;
   void *callback_data;
   int limit;
+  int strict_utf8; /* If non-0, malformed UTF-8 in strings is an error */
+  struct json_walk_stats *stats; /* If not NULL, filled out by the walk */
 };
 
-int json_walk_args(const char *json_string, int json_string_length,
-		   const struct frozen_args *args);
+JSON_API int json_walk_args(const char *json_string, int json_string_length,
+                            const struct frozen_args *args);
 
 #define INIT_FROZEN_ARGS(ptr) do {			\
 		memset((ptr), 0, sizeof(*(ptr)));	\
 		(ptr)->limit = JSON_MAX_DEPTH;		\
 	} while(0)
 
+/*
+ * Memory allocator interface. Frozen allocates memory only in a few places:
+ * json_fread(), json_asprintf(), json_prettify_file(), json_mmap_open()
+ * without JSON_ENABLE_MMAP, the %Q, %V and %H conversions of json_scanf()
+ * and long conversions in json_printf().
+ * All of them go through the allocator set by `json_set_allocator()`.
+ * Every function receives the allocator's `user_data`.
+ */
+struct json_allocator {
+  void *(*malloc_fn)(size_t size, void *user_data);
+  void *(*realloc_fn)(void *ptr, size_t size, void *user_data);
+  void (*free_fn)(void *ptr, void *user_data);
+  void *user_data;
+};
+
+/*
+ * Set the allocator used by all subsequent frozen calls. The structure is
+ * copied. Passing NULL restores the default `malloc()`, `realloc()` and
+ * `free()`, or no allocator at all if built with JSON_ENABLE_HEAP=0.
+ * Memory that frozen returns to the caller must be released with `free_fn`
+ * of the allocator that was active when it was returned.
+ * The setting is global and not synchronised: switch allocators only while
+ * no other thread is inside frozen.
+ */
+JSON_API void json_set_allocator(const struct json_allocator *allocator);
+
+/*
+ * Counters of frozen's allocator and printer calls, see
+ * `json_take_call_stats()`.
+ */
+struct json_call_stats {
+  unsigned long allocs;        /* Calls to the allocator's malloc and realloc */
+  unsigned long frees;         /* Calls to the allocator's free */
+  size_t alloc_bytes;          /* Bytes requested by those allocations */
+  unsigned long printer_calls; /* Calls to `struct json_out` printers */
+  size_t printed_bytes;        /* Bytes passed to the printers */
+};
+
+/*
+ * Copy the counters accumulated since the previous call into `stats`, and
+ * reset them. Calling it before and after an API call gives the cost of
+ * that call, e.g. the memory taken by a json_scanf() with %Q. The counters
+ * are global like the allocator, and are collected only if frozen is built
+ * with JSON_ENABLE_STATS=1; otherwise `*stats` is all zeros.
+ */
+JSON_API void json_take_call_stats(struct json_call_stats *stats);
+
 /*
  * JSON generation API.
  * struct json_out abstracts output, allowing alternative printing plugins.
@@ -142,8 +251,8 @@ struct json_out {
   } u;
 };
 
-extern int json_printer_buf(struct json_out *, const char *, size_t);
-extern int json_printer_file(struct json_out *, const char *, size_t);
+JSON_API int json_printer_buf(struct json_out *, const char *, size_t);
+JSON_API int json_printer_file(struct json_out *, const char *, size_t);
 
 #define JSON_OUT_BUF(buf, len) \
   {                            \
@@ -174,16 +283,22 @@ typedef int (*json_printf_callback_t)(struct json_out *, va_list *ap);
  * Return number of bytes printed. If the return value is bigger than the
  * supplied buffer, that is an indicator of overflow. In the overflow case,
  * overflown bytes are not printed.
+ * Return JSON_NO_MEMORY if a conversion does not fit into
+ * JSON_PRINTF_BUF_SIZE bytes and the allocator fails to provide a buffer
+ * (always the case with JSON_ENABLE_HEAP=0 and no allocator installed).
+ * Return JSON_STRING_INVALID if a conversion passed to the system printf,
+ * like `%-08.3f`, is longer than 18 characters.
+ * Output produced up to that point is left in `out`.
  */
-int json_printf(struct json_out *, const char *fmt, ...);
-int json_vprintf(struct json_out *, const char *fmt, va_list ap);
+JSON_API int json_printf(struct json_out *, const char *fmt, ...);
+JSON_API int json_vprintf(struct json_out *, const char *fmt, va_list ap);
 
 /*
  * Same as json_printf, but prints to a file.
  * File is created if does not exist. File is truncated if already exists.
  */
-int json_fprintf(const char *file_name, const char *fmt, ...);
-int json_vfprintf(const char *file_name, const char *fmt, va_list ap);
+JSON_API int json_fprintf(const char *file_name, const char *fmt, ...);
+JSON_API int json_vfprintf(const char *file_name, const char *fmt, va_list ap);
 
 /*
  * Print JSON into an allocated 0-terminated string.
@@ -196,15 +311,15 @@ int json_vfprintf(const char *file_name, const char *fmt, va_list ap);
  *   free(str);
  * ```
  */
-char *json_asprintf(const char *fmt, ...);
-char *json_vasprintf(const char *fmt, va_list ap);
+JSON_API char *json_asprintf(const char *fmt, ...);
+JSON_API char *json_vasprintf(const char *fmt, va_list ap);
 
 /*
  * Helper %M callback that prints contiguous C arrays.
  * Consumes void *array_ptr, size_t array_size, size_t elem_size, char *fmt
- * Return number of bytes printed.
+ * Return number of bytes printed, or negative error.
  */
-int json_printf_array(struct json_out *, va_list *ap);
+JSON_API int json_printf_array(struct json_out *, va_list *ap);
 
 /*
  * Scan JSON string `str`, performing scanf-like conversions according to `fmt`.
@@ -216,7 +331,8 @@ int json_printf_array(struct json_out *, va_list *ap);
  *    - %B: consumes `int *` (or `char *`, if `sizeof(bool) == sizeof(char)`),
  *       expects boolean `true` or `false`.
  *    - %Q: consumes `char **`, expects quoted, JSON-encoded string. Scanned
- *       string is malloc-ed, caller must free() the string.
+ *       string is malloc-ed, caller must free() the string. `\uXXXX` escapes
+ *       are decoded to UTF-8.
  *    - %V: consumes `char **`, `int *`. Expects base64-encoded string.
  *       Result string is base64-decoded, malloced and NUL-terminated.
  *       The length of result string is stored in `int *` placeholder.
@@ -226,6 +342,14 @@ int json_printf_array(struct json_out *, va_list *ap);
  *       Result string is hex-decoded, malloced and NUL-terminated.
  *       The length of the result string is stored in `int *` placeholder.
  *       Caller must free() the result.
+ *    - %.*Q, %.*V, %.*H: same as %Q, %V and %H, but decode into a
+ *       caller-supplied buffer instead of a malloc-ed one.
+ *       Consume `int *`, `char *`. On entry, `int *` holds the buffer size;
+ *       on return, it holds the length of the decoded result, or -1 for
+ *       `null`. The conversion is counted only if the NUL-terminated
+ *       result fits into the buffer; otherwise the returned length tells
+ *       how big the buffer must be (minus the NUL). A negative size on
+ *       entry, e.g. -1 left by `null`, is treated as 0.
  *    - %M: consumes custom scanning function pointer and
  *       `void *user_data` parameter - see json_scanner_t definition.
  *    - %T: consumes `struct json_token *`, fills it out with matched token.
@@ -233,47 +357,181 @@ int json_printf_array(struct json_out *, va_list *ap);
  * Return number of elements successfully scanned & converted.
  * Negative number means scan error.
  */
-int json_scanf(const char *str, int str_len, const char *fmt, ...);
-int json_vscanf(const char *str, int str_len, const char *fmt, va_list ap);
+JSON_API int json_scanf(const char *str, int str_len, const char *fmt, ...);
+JSON_API int json_vscanf(const char *str, int str_len, const char *fmt,
+                         va_list ap);
 
 /* json_scanf's %M handler  */
 typedef void (*json_scanner_t)(const char *str, int len, void *user_data);
 
+/*
+ * Like `json_scanf()`, but for a string of any size. The length
+ * placeholders of %Q, %V, %H and their %.* forms are `ptrdiff_t *` instead
+ * of `int *`, %T consumes `struct json_token_sz *` and %M consumes a
+ * `json_scanner_sz_t` function.
+ */
+JSON_API int json_scanf_sz(const char *str, size_t str_len, const char *fmt,
+                           ...);
+JSON_API int json_vscanf_sz(const char *str, size_t str_len, const char *fmt,
+                            va_list ap);
+
+/* json_scanf_sz's %M handler */
+typedef void (*json_scanner_sz_t)(const char *str, size_t len,
+                                  void *user_data);
+
 /*
  * Helper function to scan array item with given path and index.
  * Fills `token` with the matched JSON token.
  * Return -1 if no array element found, otherwise non-negative token length.
  */
-int json_scanf_array_elem(const char *s, int len, const char *path, int index,
-                          struct json_token *token);
+JSON_API int json_scanf_array_elem(const char *s, int len, const char *path,
+                                   int index, struct json_token *token);
+
+/* Type of a struct member bound to a JSON value, see `struct json_field` */
+enum json_field_type {
+  JSON_FIELD_BOOL,   /* bool, from true or false */
+  JSON_FIELD_INT,    /* int, from a number without fraction or exponent */
+  JSON_FIELD_INT64,  /* int64_t, likewise */
+  JSON_FIELD_DOUBLE, /* double, from any number; not in JSON_MINIMAL mode */
+  JSON_FIELD_STRING, /* char[size], unescaped and NUL-terminated */
+  JSON_FIELD_TOKEN,  /* struct json_token, any value */
+  JSON_FIELD_OBJECT  /* Nested struct, described by `fields` */
+};
+
+/*
+ * Descriptor of a struct member: JSON key `name` maps to the member at
+ * `offset`. An array of descriptors describes a struct for
+ * `json_scanf_struct()` and `json_printf_struct()`. Use `JSON_FIELD()` and
+ * `JSON_FIELD_STRUCT()` to fill them out.
+ */
+struct json_field {
+  const char *name;
+  size_t offset;
+  enum json_field_type type;
+  size_t size;                     /* Size of the member */
+  const struct json_field *fields; /* JSON_FIELD_OBJECT: the nested struct */
+  int num_fields;
+};
+
+#define JSON_FIELD(type, member, field_type)                      \
+  {                                                               \
+    #member, offsetof(type, member), field_type,                  \
+        sizeof(((type *) 0)->member), NULL, 0                     \
+  }
+
+#define JSON_FIELD_STRUCT(type, member, fields)                   \
+  {                                                               \
+    #member, offsetof(type, member), JSON_FIELD_OBJECT,           \
+        sizeof(((type *) 0)->member), fields,                     \
+        (int) (sizeof(fields) / sizeof((fields)[0]))              \
+  }
+
+/*
+ * Values of `json_scanf_struct()` that do not match their descriptor: the
+ * JSON type differs, a number does not fit, or a string does not fit into
+ * its buffer. Such members are left unchanged.
+ */
+struct json_struct_error {
+  const struct json_field *field; /* First mismatching field, or NULL */
+  struct json_token token;        /* Its value */
+  int num_errors;                 /* Number of mismatching values */
+};
+
+/*
+ * Decode a JSON object into the struct at `dst`, described by `num_fields`
+ * descriptors, in a single walk. Keys without a descriptor and `null` values
+ * are skipped, and members whose keys are missing are left unchanged. If
+ * `err` is not NULL, it receives the mismatching values.
+ * Return the number of members decoded, not counting JSON_FIELD_OBJECT
+ * members themselves, or a negative error code if `s` is invalid.
+ *
+ * Example:
+ *   struct point { int x, y; };
+ *   struct shape { char name[16]; struct point pos; bool visible; };
+ *   static const struct json_field point_fields[] = {
+ *       JSON_FIELD(struct point, x, JSON_FIELD_INT),
+ *       JSON_FIELD(struct point, y, JSON_FIELD_INT)};
+ *   static const struct json_field shape_fields[] = {
+ *       JSON_FIELD(struct shape, name, JSON_FIELD_STRING),
+ *       JSON_FIELD_STRUCT(struct shape, pos, point_fields),
+ *       JSON_FIELD(struct shape, visible, JSON_FIELD_BOOL)};
+ *   struct shape sh;
+ *   json_scanf_struct("{name: \"a\", pos: {x: 1, y: 2}}", 30, shape_fields,
+ *                     3, &sh, NULL);  // 3
+ */
+JSON_API int json_scanf_struct(const char *s, int len,
+                               const struct json_field *fields,
+                               int num_fields, void *dst,
+                               struct json_struct_error *err);
+
+/*
+ * Encode the struct at `src`, described by `num_fields` descriptors, as a
+ * JSON object with the keys in descriptor order. Non-finite doubles and
+ * empty JSON_FIELD_TOKEN members are printed as `null`.
+ * Return the number of bytes printed, or negative error.
+ */
+JSON_API int json_printf_struct(struct json_out *out,
+                                const struct json_field *fields,
+                                int num_fields, const void *src);
 
 /*
  * Unescape JSON-encoded string src,slen into dst, dlen.
- * src and dst may overlap.
+ * `\uXXXX` escapes, including surrogate pairs, are decoded to UTF-8; an
+ * unpaired surrogate is an error. src and dst may overlap.
  * If destination buffer is too small (or zero-length), result string is not
  * written but the length is counted nevertheless (similar to snprintf).
  * Return the length of unescaped string in bytes.
  */
-int json_unescape(const char *src, int slen, char *dst, int dlen);
+JSON_API int json_unescape(const char *src, int slen, char *dst, int dlen);
+
+/*
+ * Like `json_unescape()`, but for a string of any size.
+ * Return the length of unescaped string in bytes, or a negative error code.
+ */
+JSON_API ptrdiff_t json_unescape_sz(const char *src, size_t slen, char *dst,
+                                    size_t dlen);
 
 /*
  * Escape a string `str`, `str_len` into the printer `out`.
  * Return the number of bytes printed.
  */
-int json_escape(struct json_out *out, const char *str, size_t str_len);
+JSON_API int json_escape(struct json_out *out, const char *str, size_t str_len);
 
 /*
  * Read the whole file in memory.
  * Return malloc-ed file content, or NULL on error. The caller must free().
  */
-char *json_fread(const char *file_name);
+JSON_API char *json_fread(const char *file_name);
+
+/* Read-only view of a file, see `json_mmap_open()` */
+struct json_mmap {
+  const char *ptr; /* File content, not NUL-terminated */
+  size_t len;      /* File size */
+  int type;        /* Private: how `ptr` is released */
+};
+
+/*
+ * Open file `file_name` as a read-only view `m` without copying it. Where
+ * JSON_ENABLE_MMAP is set, the file is memory-mapped with a sequential
+ * access hint, otherwise it is read into memory from the allocator.
+ * `m->ptr,m->len` can be passed to json_walk(), json_scanf() and the other
+ * functions directly. Files larger than 2 GB must be passed to the
+ * `_sz` functions, e.g. json_walk_sz(), which take a `size_t` length.
+ * Return 0 on success, -1 if the file cannot be opened or mapped, or
+ * JSON_NO_MEMORY. The view must be released with `json_mmap_close()`.
+ */
+JSON_API int json_mmap_open(struct json_mmap *m, const char *file_name);
+
+/* Release a view opened by `json_mmap_open()` */
+JSON_API void json_mmap_close(struct json_mmap *m);
 
 /*
  * Update given JSON string `s,len` by changing the value at given `json_path`.
  * The result is saved to `out`. If `json_fmt` == NULL, that deletes the key.
  * If path is not present, missing keys are added. Array path without an
  * index pushes a value to the end of an array.
- * Return 1 if the string was changed, 0 otherwise.
+ * Return 1 if the string was changed, 0 otherwise, or negative error if
+ * printing the value fails, e.g. JSON_NO_MEMORY.
  *
  * Example:  s is a JSON string { "a": 1, "b": [ 2 ] }
  *   json_setf(s, len, out, ".a", "7");     // { "a": 7, "b": [ 2 ] }
@@ -281,24 +539,198 @@ char *json_fread(const char *file_name);
  *   json_setf(s, len, out, ".b[]", "7");   // { "a": 1, "b": [ 2,7 ] }
  *   json_setf(s, len, out, ".b", NULL);    // { "a": 1 }
  */
-int json_setf(const char *s, int len, struct json_out *out,
-              const char *json_path, const char *json_fmt, ...);
+JSON_API int json_setf(const char *s, int len, struct json_out *out,
+                       const char *json_path, const char *json_fmt, ...);
 
-int json_vsetf(const char *s, int len, struct json_out *out,
-               const char *json_path, const char *json_fmt, va_list ap);
+JSON_API int json_vsetf(const char *s, int len, struct json_out *out,
+                        const char *json_path, const char *json_fmt,
+                        va_list ap);
+
+/* Like `json_setf()`, but for a string of any size */
+JSON_API int json_setf_sz(const char *s, size_t len, struct json_out *out,
+                          const char *json_path, const char *json_fmt, ...);
+JSON_API int json_vsetf_sz(const char *s, size_t len, struct json_out *out,
+                           const char *json_path, const char *json_fmt,
+                           va_list ap);
+
+/*
+ * A single mutation for `json_setf_batch()`: set the value at `json_path`
+ * to the JSON text `value`, or delete the key if `value` is NULL.
+ */
+struct json_setf_op {
+  const char *json_path;
+  const char *value;
+  int applied; /* Set by json_setf_batch() to 1 if the mutation was made */
+
+  /* Private, used by json_setf_batch() */
+  int matched;    /* Matched part of json_path */
+  ptrdiff_t pos;  /* Offset of the mutated value begin */
+  ptrdiff_t end;  /* Offset of the mutated value end */
+  ptrdiff_t prev; /* Offset of the previous token end */
+  int found;      /* Whether json_path is present */
+  int index;      /* Position in the ops array */
+};
+
+#define JSON_SETF_OP(json_path, value) \
+  { json_path, value, 0, 0, 0, 0, 0, 0, 0 }
+
+/*
+ * Apply `num_ops` mutations to the JSON string `s,len` in one walk and one
+ * output pass, saving the result to `out`. Each mutation behaves like the
+ * respective `json_setf()` call, with paths referring to the original string.
+ * New keys added at the same place are emitted in path order, and missing
+ * objects or arrays shared by several paths are created once. A mutation
+ * inside a value that is changed or deleted by another one is skipped.
+ * Return the number of mutations made, or negative error if `s` is invalid.
+ *
+ * Example:  s is a JSON string { "a": 1, "b": [ 2 ] }
+ *   struct json_setf_op ops[] = {
+ *     JSON_SETF_OP(".a", NULL), JSON_SETF_OP(".b[]", "3"),
+ *     JSON_SETF_OP(".c.d", "4"), JSON_SETF_OP(".c.e", "5")};
+ *   json_setf_batch(s, len, out, ops, 4);
+ *   // { "b": [ 2,3 ],"c":{"d":4,"e":5} }
+ */
+JSON_API int json_setf_batch(const char *s, int len, struct json_out *out,
+                             struct json_setf_op *ops, int num_ops);
+
+/*
+ * Like `json_setf()`, but update the JSON string `s,len` in place.
+ * `s` must point to a writable buffer of `size` bytes.
+ * If the new value is not longer than the old one, it overwrites the old
+ * value and the rest is padded with spaces. A deleted key and value are
+ * replaced with spaces. In these cases the length of the string does not
+ * change.
+ * Otherwise, the whole string is rewritten via a temporary buffer of `size`
+ * bytes and is NUL-terminated.
+ * Return the new length of the string, or JSON_NO_MEMORY if the result does
+ * not fit into `size` bytes or the temporary buffer cannot be allocated.
+ * In that case `s` is left unchanged.
+ *
+ * Example:  s is a JSON string { "a": 123, "b": [ 2 ] }
+ *   json_setf_inplace(s, len, size, ".a", "%d", 7);
+ *   // { "a": 7  , "b": [ 2 ] }
+ *   json_setf_inplace(s, len, size, ".b", NULL);
+ *   // { "a": 123             }
+ */
+JSON_API int json_setf_inplace(char *s, int len, int size,
+                               const char *json_path, const char *json_fmt,
+                               ...);
+
+JSON_API int json_vsetf_inplace(char *s, int len, int size,
+                                const char *json_path, const char *json_fmt,
+                                va_list ap);
+
+/*
+ * Apply RFC 6902 JSON Patch `patch,patch_len` to the JSON string `s,len`,
+ * saving the result to `out`. The patch is an array of operations: add,
+ * remove, replace, move, copy and test. Operations that do not depend on
+ * each other are applied together in one pass, like `json_setf_batch()`.
+ * Adding to an array index past the end is an error, and `-` appends.
+ * Return the number of operations, or JSON_PATCH_FAILED if the patch is
+ * malformed, a path does not exist or a test fails. Nothing is printed to
+ * `out` on error.
+ *
+ * Example:  s is a JSON string { "a": 1, "b": [ 2 ] }
+ *   json_patch(s, len, out, p, strlen(p));  // { "a": 1, "b": [ 2,3 ] }
+ *   where p is [{"op":"test","path":"/a","value":1},
+ *               {"op":"add","path":"/b/-","value":3}]
+ */
+JSON_API int json_patch(const char *s, int len, struct json_out *out,
+                        const char *patch, int patch_len);
+
+/*
+ * Apply RFC 7386 JSON Merge Patch `patch,patch_len` to the JSON string
+ * `s,len` in one pass, saving the result to `out`. Members of the patch
+ * replace the ones in `s`, objects are merged recursively, and null values
+ * delete members. Return the number of changes, or negative error.
+ *
+ * Example:  s is a JSON string { "a": 1, "b": { "c": 2 } }
+ *   json_merge_patch(s, len, out, p, strlen(p));  // { "b": { "c": 3 } }
+ *   where p is {"a":null,"b":{"c":3}}
+ */
+JSON_API int json_merge_patch(const char *s, int len, struct json_out *out,
+                              const char *patch, int patch_len);
+
+/*
+ * Compare JSON strings `a,alen` and `b,blen` and print to `out` an RFC 6902
+ * JSON Patch that turns `a` into `b`, suitable for `json_patch()`. Both
+ * documents are parsed once and walked in lockstep, and identical values
+ * are skipped by comparing their bytes. Array elements are compared by
+ * index, and objects whose keys come in a different order are matched by
+ * the unescaped key through a hash table. The indexes live in
+ * JSON_DIFF_SCRATCH_SIZE-entry stack buffers and grow with the allocator;
+ * without memory, json_diff() re-scans values and searches members
+ * linearly, producing the same patch more slowly.
+ * Return the number of operations, or negative error.
+ *
+ * Example:
+ *   json_diff(a, strlen(a), b, strlen(b), out);
+ *   // for a = {"a":1,"b":[2,3]} and b = {"a":1,"b":[2,4],"c":5} prints
+ *   // [{"op":"replace","path":"/b/1","value":4},
+ *   //  {"op":"add","path":"/c","value":5}]
+ */
+JSON_API int json_diff(const char *a, int alen, const char *b, int blen,
+                       struct json_out *out);
+
+/*
+ * Like `json_diff()`, but print a JSON array of the JSON Pointers of the
+ * changed values instead of a patch, e.g. ["/b/1","/c"].
+ */
+JSON_API int json_diff_paths(const char *a, int alen, const char *b, int blen,
+                             struct json_out *out);
 
 /*
  * Pretty-print JSON string `s,len` into `out`.
  * Return number of processed bytes in `s`.
  */
-int json_prettify(const char *s, int len, struct json_out *out);
+JSON_API int json_prettify(const char *s, int len, struct json_out *out);
+
+/*
+ * Like `json_prettify()`, but for a string of any size.
+ * Return number of processed bytes in `s`, or a negative error code.
+ */
+JSON_API ptrdiff_t json_prettify_sz(const char *s, size_t len,
+                                    struct json_out *out);
+
+/*
+ * Print JSON string `s,len` into `out` without any whitespace.
+ * Return number of processed bytes in `s`.
+ */
+JSON_API int json_minify(const char *s, int len, struct json_out *out);
+
+/* Options of `json_reformat()` */
+struct json_reformat_opts {
+  int indent;    /* Spaces per nesting level, 0 prints everything on one line */
+  int sort_keys; /* If non-0, object members are sorted by key */
+};
+
+/*
+ * Reformat JSON string `s,len` into `out` according to `opts`; NULL means
+ * json_prettify() formatting. Parts of the input that do not change, like
+ * strings and numbers, are copied in whole runs. Keys are sorted by their
+ * bytes as they appear in `s`, and duplicate keys keep their order; sorting
+ * allocates memory for each object.
+ * Return number of processed bytes in `s`, or negative error.
+ *
+ * Example:
+ *   struct json_reformat_opts opts = {4, 1};
+ *   json_reformat("{b:1,a:[]}", 10, out, &opts);
+ *   // prints {\n    "a": [],\n    "b": 1\n}
+ */
+JSON_API int json_reformat(const char *s, int len, struct json_out *out,
+                           const struct json_reformat_opts *opts);
 
 /*
  * Prettify JSON file `file_name`.
- * Return number of processed bytes, or negative number of error.
- * On error, file content is not modified.
+ * The file is read in chunks of JSON_PRETTIFY_BUF_SIZE bytes and the result
+ * is written to a new file in the same directory, `file_name` with the first
+ * free ".N.tmp" suffix, which then replaces the file, so memory use does not
+ * depend on the file size. Existing files are never overwritten. On POSIX
+ * systems the permission bits of the file are kept, but not its owner.
+ * Return number of processed bytes (capped at INT_MAX), or negative number of
+ * error. On error, file content is not modified.
  */
-int json_prettify_file(const char *file_name);
+JSON_API int json_prettify_file(const char *file_name);
 
 /*
  * Iterate over an object at given JSON `path`.
@@ -316,20 +748,27 @@ int json_prettify_file(const char *file_name);
  * }
  * ```
  */
-void *json_next_key(const char *s, int len, void *handle, const char *path,
-                    struct json_token *key, struct json_token *val);
+JSON_API void *json_next_key(const char *s, int len, void *handle,
+                             const char *path, struct json_token *key,
+                             struct json_token *val);
 
 /*
  * Iterate over an array at given JSON `path`.
  * Similar to `json_next_key`, but fills array index `idx` instead of `key`.
  */
-void *json_next_elem(const char *s, int len, void *handle, const char *path,
-                     int *idx, struct json_token *val);
+JSON_API void *json_next_elem(const char *s, int len, void *handle,
+                              const char *path, int *idx,
+                              struct json_token *val);
 
 #ifndef JSON_MAX_PATH_LEN
 #define JSON_MAX_PATH_LEN 256
 #endif
 
+/* Deepest nesting of JSON_FIELD_OBJECT members in json_scanf_struct() */
+#ifndef JSON_MAX_STRUCT_DEPTH
+#define JSON_MAX_STRUCT_DEPTH 16
+#endif
+
 #ifndef JSON_MAX_DEPTH
 #define JSON_MAX_DEPTH 9000
 #endif
@@ -338,6 +777,55 @@ void *json_next_elem(const char *s, int len, void *handle, const char *path,
 #define JSON_MINIMAL 0
 #endif
 
+/*
+ * With JSON_ENABLE_HEAP=0, frozen never calls malloc(), realloc() or free().
+ * Allocating paths fail unless an allocator is installed with
+ * `json_set_allocator()`; use the %.*Q, %.*V and %.*H conversions of
+ * json_scanf() and JSON_OUT_BUF / JSON_OUT_FILE outputs instead.
+ */
+#ifndef JSON_ENABLE_HEAP
+#define JSON_ENABLE_HEAP 1
+#endif
+
+/*
+ * Stack buffer for json_printf() conversions that are delegated to the
+ * system printf, e.g. %d or %f. Longer results need the allocator.
+ */
+#ifndef JSON_PRINTF_BUF_SIZE
+#if JSON_ENABLE_HEAP
+#define JSON_PRINTF_BUF_SIZE 21
+#else
+#define JSON_PRINTF_BUF_SIZE 64
+#endif
+#endif
+
+/* Read buffer of json_prettify_file(), allocated with the allocator */
+#ifndef JSON_PRETTIFY_BUF_SIZE
+#define JSON_PRETTIFY_BUF_SIZE 4096
+#endif
+
+/*
+ * Values and object members json_diff() indexes on the stack before it
+ * takes memory from the allocator
+ */
+#ifndef JSON_DIFF_SCRATCH_SIZE
+#define JSON_DIFF_SCRATCH_SIZE 64
+#endif
+
+/* Collect `struct json_walk_stats` in json_walk_args() */
+#ifndef JSON_ENABLE_STATS
+#define JSON_ENABLE_STATS 0
+#endif
+
+/* Use the platform's memory mapping in json_mmap_open() */
+#ifndef JSON_ENABLE_MMAP
+#if defined(__unix__) || defined(__APPLE__) || defined(_WIN32)
+#define JSON_ENABLE_MMAP 1
+#else
+#define JSON_ENABLE_MMAP 0
+#endif
+#endif
+
 #ifndef JSON_ENABLE_BASE64
 #define JSON_ENABLE_BASE64 !JSON_MINIMAL
 #endif
@@ -346,8 +834,69 @@ void *json_next_elem(const char *s, int len, void *handle, const char *path,
 #define JSON_ENABLE_HEX !JSON_MINIMAL
 #endif
 
+/* Deepest nesting of objects and arrays in json_next_token() */
+#ifndef JSON_PULL_MAX_DEPTH
+#define JSON_PULL_MAX_DEPTH 32
+#endif
+
+/* An object or array entered by json_next_token() */
+struct json_pull_frame {
+  const char *start; /* Opening brace */
+  size_t outer_len;  /* Path length of the container */
+  size_t base_len;   /* Path length of its members, without key or index */
+  int index;         /* Index of the next array element */
+  char type;         /* '{' or '[' */
+};
+
+/*
+ * State of the pull tokenizer, see `json_next_token()`. After each token,
+ * `name`, `name_len` and `path` are set like the respective arguments of
+ * `json_walk_callback_t`, and are valid until the next call.
+ */
+struct json_pull {
+  const char *name;
+  size_t name_len;
+  char path[JSON_MAX_PATH_LEN];
+
+  /* Private */
+  const char *cur;
+  const char *end;
+  size_t path_len;
+  int depth;
+  int state;
+  struct json_pull_frame frames[JSON_PULL_MAX_DEPTH];
+};
+
+/* Start tokenizing JSON string `s,len` with `json_next_token()` */
+JSON_API void json_pull_init(struct json_pull *p, const char *s, int len);
+
+/*
+ * Fill `token` with the next token of the string passed to
+ * `json_pull_init()`. Tokens come in the same order and with the same names
+ * and paths as the callbacks of `json_walk()`, but the caller asks for each
+ * one, so it can stop at any point without parsing the rest.
+ * Objects and arrays may nest up to JSON_PULL_MAX_DEPTH levels.
+ * Return 1 if `token` is filled out, 0 after the last token, or a negative
+ * error code; once the end or an error is reached, every further call
+ * returns the same.
+ *
+ * Example:
+ *   struct json_pull p;
+ *   struct json_token t;
+ *   json_pull_init(&p, s, len);
+ *   while (json_next_token(&p, &t) > 0) {
+ *     if (strcmp(p.path, ".method") == 0) break;
+ *   }
+ */
+JSON_API int json_next_token(struct json_pull *p, struct json_token *token);
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
 
+#if (FROZEN_HEADER_ONLY || defined(FROZEN_IMPLEMENTATION)) && \
+    !defined(CS_FROZEN_FROZEN_C_)
+#include "frozen.c"
+#endif
+
 #endif /* CS_FROZEN_FROZEN_H_ */
@@ -0,0 +1,388 @@
+/*
+ * Copyright (c) 2004-2013 Sergey Lyubka <valenok@gmail.com>
+ * Copyright (c) 2018 Cesanta Software Limited
+ * All rights reserved
+ *
+ * Licensed under the Apache License, Version 2.0 (the ""License"");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an ""AS IS"" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Header-only C++17 interface to frozen. Tokens are `std::string_view`s
+ * into the parsed string, values are extracted with type-checked templates
+ * instead of scanf-style format strings, and walk callbacks are functors.
+ * With C++20 coroutines, `tokens()` yields tokens lazily instead.
+ * The C API in frozen.h stays available; build frozen.c as usual, or use
+ * the header-only mode of frozen.h, which also lets the compiler inline a
+ * functor into the walker.
+ */
+
+#ifndef CS_FROZEN_FROZEN_HPP_
+#define CS_FROZEN_FROZEN_HPP_
+
+#if __cplusplus < 201703L && !(defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+#error "frozen.hpp requires C++17"
+#endif
+
+#include "frozen.h"
+
+#include <charconv>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+#if __cplusplus >= 202002L && __has_include(<coroutine>)
+#include <coroutine>
+#include <exception>
+#include <iterator>
+#define FROZEN_HAVE_COROUTINES 1
+#endif
+
+namespace frozen {
+
+/*
+ * A JSON token: `value` points into the parsed string. For strings it is
+ * the contents between the quotes, still escaped; for objects and arrays it
+ * is the whole container, and `type` is `JSON_TYPE_OBJECT_END` or
+ * `JSON_TYPE_ARRAY_END`, like the `%T` conversion of `json_scanf()`.
+ */
+struct token {
+  std::string_view value;
+  enum json_token_type type;
+};
+
+/*
+ * FNV-1a hash of a path like ".a.b[2]", usable in constant expressions,
+ * e.g. to dispatch on the `path` of a `walk()` callback with `switch`:
+ *
+ *   switch (frozen::hash(path)) {
+ *     case frozen::hash(".id"): ...
+ *     case ".name"_hash: ...
+ *   }
+ *
+ * Paths with equal hashes are not necessarily equal; compare the strings
+ * when a collision matters.
+ */
+constexpr std::uint64_t hash(std::string_view s) noexcept {
+  std::uint64_t h = 0xcbf29ce484222325ULL;
+  for (char c : s) {
+    h = (h ^ static_cast<unsigned char>(c)) * 0x100000001b3ULL;
+  }
+  return h;
+}
+
+inline namespace literals {
+/* `".a.b"_hash` is `frozen::hash(".a.b")` */
+constexpr std::uint64_t operator""_hash(const char *s,
+                                        std::size_t len) noexcept {
+  return hash(std::string_view(s, len));
+}
+}  // namespace literals
+
+namespace detail {
+
+template <class F>
+void walk_cb(void *callback_data, const char *name, size_t name_len,
+             const char *path, const struct json_token_sz *tok) {
+  F &f = *static_cast<F *>(callback_data);
+  f(name == nullptr ? std::string_view() : std::string_view(name, name_len),
+    std::string_view(path),
+    token{tok->ptr == nullptr ? std::string_view()
+                              : std::string_view(tok->ptr, tok->len),
+          tok->type});
+}
+
+}  // namespace detail
+
+/*
+ * Parse `json`, calling `f(name, path, token)` for every token, as
+ * `json_walk()` does; `name` and `path` are `std::string_view`s and `token`
+ * is a `frozen::token`. `f` must not throw unless frozen.c is compiled as
+ * C++. Return number of processed bytes, or a negative error code.
+ */
+template <class F>
+ptrdiff_t walk(std::string_view json, F &&f) {
+  using functor = std::remove_reference_t<F>;
+  return json_walk_sz(json.data(), json.size(), detail::walk_cb<functor>,
+                      const_cast<void *>(static_cast<const void *>(&f)));
+}
+
+/*
+ * Find the value at path `p` in `json`, e.g. `find(json, ".a.b[2]")`. If the
+ * path occurs more than once, the last value wins, as in `json_scanf()`.
+ * Return nothing if the path is not found or `json` is invalid.
+ */
+inline std::optional<token> find(std::string_view json, std::string_view p) {
+  std::optional<token> res;
+  ptrdiff_t n = walk(json, [&](std::string_view, std::string_view path,
+                               const token &t) {
+    if (t.value.data() != nullptr && path == p) res = t;
+  });
+  if (n < 0) res.reset();
+  return res;
+}
+
+/*
+ * Convert a token to `T`:
+ *  - `bool` from `true` or `false`;
+ *  - integral types from numbers without fraction or exponent that fit;
+ *  - `float`, `double` and `long double` from any number;
+ *  - `std::string` from a string, unescaped;
+ *  - `std::string_view` from a string, still escaped, without copying;
+ *  - `frozen::token` from any value.
+ * Return nothing if the token has a different type or does not fit.
+ */
+template <class T>
+std::optional<T> as(const token &t) {
+  if constexpr (std::is_same_v<T, token>) {
+    return t;
+  } else if constexpr (std::is_same_v<T, bool>) {
+    if (t.type == JSON_TYPE_TRUE) return true;
+    if (t.type == JSON_TYPE_FALSE) return false;
+    return std::nullopt;
+  } else if constexpr (std::is_integral_v<T>) {
+    T v{};
+    const char *end = t.value.data() + t.value.size();
+    if (t.type != JSON_TYPE_NUMBER) return std::nullopt;
+    auto r = std::from_chars(t.value.data(), end, v);
+    if (r.ec != std::errc() || r.ptr != end) return std::nullopt;
+    return v;
+  } else if constexpr (std::is_floating_point_v<T>) {
+    /* Copy into tmp buffer in order to 0-terminate it, as json_scanf() does */
+    char buf[64];
+    if (t.type != JSON_TYPE_NUMBER || t.value.size() >= sizeof(buf)) {
+      return std::nullopt;
+    }
+    std::memcpy(buf, t.value.data(), t.value.size());
+    buf[t.value.size()] = '\0';
+    return static_cast<T>(std::strtold(buf, nullptr));
+  } else if constexpr (std::is_same_v<T, std::string_view>) {
+    if (t.type != JSON_TYPE_STRING) return std::nullopt;
+    return t.value;
+  } else if constexpr (std::is_same_v<T, std::string>) {
+    std::string s;
+    if (t.type != JSON_TYPE_STRING) return std::nullopt;
+    /* Unescaped string is never longer than the escaped one */
+    s.resize(t.value.size());
+    ptrdiff_t n =
+        json_unescape_sz(t.value.data(), t.value.size(), &s[0], s.size());
+    if (n < 0) return std::nullopt;
+    s.resize(static_cast<size_t>(n));
+    return s;
+  } else {
+    static_assert(!sizeof(T), "frozen::as: unsupported type");
+  }
+}
+
+/*
+ * Find the value at path `p` in `json` and convert it to `T`, e.g.
+ * `frozen::get<int64_t>(json, ".a.b")`; see `find()` and `as()`.
+ */
+template <class T>
+std::optional<T> get(std::string_view json, std::string_view p) {
+  std::optional<token> t = find(json, p);
+  if (!t) return std::nullopt;
+  return as<T>(*t);
+}
+
+/*
+ * Descriptors of struct `T` for `decode()` and `encode()`, declared with
+ * `FROZEN_SCHEMA()` at global scope. Member types are deduced from the
+ * struct: `bool`, `int`, `int64_t`, `double`, `char[N]`, `json_token` and
+ * structs that have a schema themselves.
+ *
+ *   struct point { int x, y; };
+ *   FROZEN_SCHEMA(point, FROZEN_FIELD(point, x), FROZEN_FIELD(point, y));
+ */
+template <class T>
+struct schema;
+
+#define FROZEN_FIELD(type, member) \
+  frozen::detail::field<decltype(type::member)>(#member, offsetof(type, member))
+
+#define FROZEN_SCHEMA(type, ...)                                 \
+  template <>                                                    \
+  struct frozen::schema<type> {                                  \
+    static constexpr struct json_field fields[] = {__VA_ARGS__}; \
+  }
+
+namespace detail {
+
+template <class M>
+constexpr struct json_field field(const char *name, size_t offset) {
+  enum json_field_type type = JSON_FIELD_OBJECT;
+  if constexpr (std::is_same_v<M, bool>) {
+    type = JSON_FIELD_BOOL;
+  } else if constexpr (std::is_same_v<M, int>) {
+    type = JSON_FIELD_INT;
+  } else if constexpr (std::is_same_v<M, std::int64_t>) {
+    type = JSON_FIELD_INT64;
+  } else if constexpr (std::is_same_v<M, double>) {
+    type = JSON_FIELD_DOUBLE;
+  } else if constexpr (std::is_same_v<std::remove_extent_t<M>, char>) {
+    type = JSON_FIELD_STRING;
+  } else if constexpr (std::is_same_v<M, struct json_token>) {
+    type = JSON_FIELD_TOKEN;
+  } else {
+    constexpr auto &nested = schema<M>::fields;
+    return {name,   offset, type, sizeof(M), nested,
+            static_cast<int>(sizeof(nested) / sizeof(nested[0]))};
+  }
+  return {name, offset, type, sizeof(M), nullptr, 0};
+}
+
+template <class T>
+constexpr int num_fields() {
+  return static_cast<int>(sizeof(schema<T>::fields) /
+                          sizeof(schema<T>::fields[0]));
+}
+
+}  // namespace detail
+
+/*
+ * Decode a JSON object into `dst` with `json_scanf_struct()`.
+ * Return the number of members decoded, or a negative error code.
+ */
+template <class T>
+int decode(std::string_view json, T &dst,
+           struct json_struct_error *err = nullptr) {
+  return json_scanf_struct(json.data(), static_cast<int>(json.size()),
+                           schema<T>::fields, detail::num_fields<T>(), &dst,
+                           err);
+}
+
+/*
+ * Encode `src` as a JSON object with `json_printf_struct()`.
+ * Return the number of bytes printed, or negative error.
+ */
+template <class T>
+int encode(struct json_out *out, const T &src) {
+  return json_printf_struct(out, schema<T>::fields, detail::num_fields<T>(),
+                            &src);
+}
+
+#ifdef FROZEN_HAVE_COROUTINES
+
+/*
+ * Lazily produced sequence of `T`, for use in a range-based `for` loop.
+ * Each element is produced when the loop asks for it; leaving the loop
+ * early destroys the coroutine, so the rest is never computed.
+ */
+template <class T>
+class generator {
+ public:
+  struct promise_type {
+    const T *value = nullptr;
+    int result = 0;
+
+    generator get_return_object() noexcept {
+      return generator(
+          std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    std::suspend_always final_suspend() noexcept { return {}; }
+    std::suspend_always yield_value(const T &v) noexcept {
+      value = &v;
+      return {};
+    }
+    void return_value(int r) noexcept { result = r; }
+    void unhandled_exception() noexcept { std::terminate(); }
+  };
+
+  class iterator {
+   public:
+    using iterator_category = std::input_iterator_tag;
+    using value_type = T;
+    using difference_type = std::ptrdiff_t;
+
+    explicit iterator(std::coroutine_handle<promise_type> h) : h_(h) {}
+    const T &operator*() const { return *h_.promise().value; }
+    const T *operator->() const { return h_.promise().value; }
+    iterator &operator++() {
+      h_.resume();
+      return *this;
+    }
+    void operator++(int) { ++*this; }
+    bool operator==(std::default_sentinel_t) const { return h_.done(); }
+
+   private:
+    std::coroutine_handle<promise_type> h_;
+  };
+
+  generator(generator &&other) noexcept : h_(other.h_) { other.h_ = {}; }
+  generator(const generator &) = delete;
+  generator &operator=(const generator &) = delete;
+  ~generator() {
+    if (h_) h_.destroy();
+  }
+
+  iterator begin() {
+    h_.resume();
+    return iterator(h_);
+  }
+  std::default_sentinel_t end() const noexcept { return {}; }
+
+  /*
+   * Return value of the coroutine once the sequence is exhausted, e.g. a
+   * negative error code; 0 before that.
+   */
+  int result() const { return h_.done() ? h_.promise().result : 0; }
+
+ private:
+  explicit generator(std::coroutine_handle<promise_type> h) : h_(h) {}
+  std::coroutine_handle<promise_type> h_;
+};
+
+/* A token of `tokens()`, with its name and path as in `walk()` */
+struct event {
+  std::string_view name;
+  std::string_view path;
+  struct token value;
+};
+
+/*
+ * Tokenize `json` lazily with `json_next_token()`: tokens are parsed as the
+ * loop asks for them, and breaking out of the loop stops parsing. `name` and
+ * `path` of an event are valid until the next one. Once the loop is over,
+ * `result()` of the generator is 0 or a negative error code.
+ *
+ *   for (const frozen::event &e : frozen::tokens(json)) {
+ *     if (e.path == ".method") return e.value.value;
+ *   }
+ */
+inline generator<event> tokens(std::string_view json) {
+  struct json_pull p;
+  struct json_token t;
+  int n;
+  json_pull_init(&p, json.data(), static_cast<int>(json.size()));
+  while ((n = json_next_token(&p, &t)) > 0) {
+    co_yield event{
+        p.name == nullptr ? std::string_view()
+                          : std::string_view(p.name, p.name_len),
+        std::string_view(p.path),
+        token{t.ptr == nullptr
+                  ? std::string_view()
+                  : std::string_view(t.ptr, static_cast<size_t>(t.len)),
+              t.type}};
+  }
+  co_return n;
+}
+
+#endif /* FROZEN_HAVE_COROUTINES */
+
+}  // namespace frozen
+
+#endif /* CS_FROZEN_FROZEN_HPP_ */
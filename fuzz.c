@@ -0,0 +1,608 @@
+/*
+ * Copyright (c) 2013 Cesanta Software Limited
+ * All rights reserved
+ *
+ * This library is dual-licensed: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation. For the terms of this
+ * license, see <http: *www.gnu.org/licenses/>.
+ *
+ * You are free to use this library under the terms of the GNU General
+ * Public License, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * Alternatively, you can license this library under a commercial
+ * license, as set out in <http://cesanta.com/products.html>.
+ */
+
+/*
+ * Fuzz harnesses. Each build fuzzes one target, selected with
+ * -DFUZZ_TARGET=name:
+ *
+ *   walk      json_walk(), json_walk_sz() and strict json_walk_args(),
+ *             checking every token passed to the callback, and
+ *             json_next_token(), which must return the same tokens
+ *   scanf     json_scanf() with most conversions, json_scanf_array_elem(),
+ *             json_next_key(), json_next_elem(), and json_scanf_struct()
+ *             followed by json_printf_struct(), which must round trip
+ *   setf      json_setf() and json_setf_inplace() with a few paths;
+ *             replacing or deleting a value must keep valid JSON valid
+ *   unescape  json_unescape() against json_unescape_sz(), and json_escape()
+ *             followed by json_unescape(), which must round trip
+ *   prettify  json_prettify() and json_minify(), which must keep valid JSON
+ *             valid and agree with each other
+ *   diff      SSE2 fast paths against the scalar code they replace
+ *
+ * With libFuzzer, build with -DFUZZ_LIBFUZZER -fsanitize=fuzzer (see
+ * `make fuzz`). Otherwise the file has its own main():
+ *
+ *   fuzz [-t target] [-n mutations] [-s seed] file ...
+ *
+ * runs the target (FUZZ_TARGET, unless given with -t) on each file, then on
+ * `mutations` random mutations of them. An input that fails is saved to the
+ * file fuzz-crash; with ASAN_OPTIONS=abort_on_error=1, so are inputs that
+ * fail sanitizer checks. It is also an AFL target:
+ * afl-fuzz -i fuzz_corpus -o out ./fuzz @@
+ * `make fuzz-check` runs every target over fuzz_corpus/ with ASan and UBSan.
+ *
+ * fuzz_corpus/ holds small documents that cover the grammar. bench.c takes
+ * the same files as additional corpora.
+ */
+
+#include "frozen.c"
+
+#ifndef FUZZ_TARGET
+#define FUZZ_TARGET walk
+#endif
+
+#define FUZZ_STR2(a) #a
+#define FUZZ_STR(a) FUZZ_STR2(a)
+
+#define FUZZ_MAX_LEN 65536
+
+#define CHECK(expr)                                                        \
+  do {                                                                     \
+    if (!(expr)) {                                                         \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+              #expr);                                                      \
+      abort();                                                             \
+    }                                                                      \
+  } while (0)
+
+/* Printer that grows `out->u.buf.buf` as needed; free it when done */
+static int fuzz_printer(struct json_out *out, const char *buf, size_t len) {
+  size_t need = out->u.buf.len + len + 1;
+  if (need > out->u.buf.size) {
+    size_t size = need * 2;
+    char *p = (char *) realloc(out->u.buf.buf, size);
+    CHECK(p != NULL);
+    out->u.buf.buf = p;
+    out->u.buf.size = size;
+  }
+  memcpy(out->u.buf.buf + out->u.buf.len, buf, len);
+  out->u.buf.len += len;
+  out->u.buf.buf[out->u.buf.len] = '\0';
+  return (int) len;
+}
+
+#define FUZZ_OUT     \
+  {                  \
+    fuzz_printer, {  \
+      { NULL, 0, 0 } \
+    }                \
+  }
+
+/* Return the length of the valid JSON document at the start of `s,len` */
+static int fuzz_valid(const char *s, int len) {
+  return len > 0 ? json_walk(s, len, NULL, NULL) : -1;
+}
+
+struct fuzz_walk {
+  const char *s;
+  int len, n;
+  struct json_pull *pull; /* Must return the same tokens, if not NULL */
+};
+
+/*
+ * Next token of json_next_token(). Return 2 instead of 1 at a truncated path,
+ * where json_walk() reports keys too.
+ */
+static int fuzz_pull_next(struct json_pull *p, struct json_token *t) {
+  int n = json_next_token(p, t);
+  return n == 1 && strlen(p->path) >= JSON_MAX_PATH_LEN - 1 ? 2 : n;
+}
+
+/*
+ * Compare the next token of json_next_token() with a json_walk() callback,
+ * up to a truncated path or the depth limit of json_next_token().
+ */
+static void fuzz_pull_cmp(struct fuzz_walk *w, const char *name,
+                          size_t name_len, const char *path,
+                          const struct json_token *t) {
+  struct json_token pt;
+  int n = 2;
+  if (strlen(path) < JSON_MAX_PATH_LEN - 1) n = fuzz_pull_next(w->pull, &pt);
+  if (n == 2 || n == JSON_DEPTH_LIMIT) {
+    w->pull = NULL;
+    return;
+  }
+  CHECK(n == 1);
+  CHECK(pt.ptr == t->ptr && pt.len == t->len && pt.type == t->type);
+  CHECK(strcmp(w->pull->path, path) == 0);
+  CHECK((w->pull->name == NULL) == (name == NULL));
+  CHECK(w->pull->name_len == name_len);
+  CHECK(name == NULL || memcmp(w->pull->name, name, name_len) == 0);
+}
+
+static void fuzz_walk_cb(void *data, const char *name, size_t name_len,
+                         const char *path, const struct json_token *t) {
+  struct fuzz_walk *w = (struct fuzz_walk *) data;
+  const char *end = w->s + w->len;
+  size_t path_len = strlen(path);
+  CHECK(path_len < JSON_MAX_PATH_LEN);
+  /* Array indices are named by a part of `path` */
+  CHECK(name_len == 0 || (name >= w->s && name + name_len <= end) ||
+        (name >= path && name + name_len <= path + path_len));
+  CHECK(t->type > JSON_TYPE_INVALID && t->type < JSON_TYPES_CNT);
+  CHECK(t->len >= 0);
+  CHECK(t->ptr == NULL || (t->ptr >= w->s && t->ptr + t->len <= end));
+  if (w->pull != NULL) fuzz_pull_cmp(w, name, name_len, path, t);
+  w->n++;
+}
+
+static void fuzz_walk_sz_cb(void *data, const char *name, size_t name_len,
+                            const char *path, const struct json_token_sz *t) {
+  struct fuzz_walk *w = (struct fuzz_walk *) data;
+  (void) name;
+  (void) name_len;
+  (void) path;
+  (void) t;
+  w->n++;
+}
+
+static void fuzz_walk(const char *s, int len) {
+  static struct json_pull pull;
+  struct fuzz_walk w = {s, len, 0, &pull}, w_sz = {s, len, 0, NULL};
+  struct frozen_args args;
+  struct json_token t;
+  int n, res, strict;
+
+  json_pull_init(&pull, s, len);
+  n = json_walk(s, len, fuzz_walk_cb, &w);
+  CHECK(n <= len);
+  if (w.pull != NULL) {
+    res = fuzz_pull_next(&pull, &t);
+    CHECK(res == (n < 0 ? n : 0) || res == JSON_DEPTH_LIMIT);
+  }
+  CHECK(json_walk_sz(s, (size_t) len, fuzz_walk_sz_cb, &w_sz) == n);
+  CHECK(w_sz.n == w.n);
+
+  /* Strict UTF-8 checks only add errors */
+  INIT_FROZEN_ARGS(&args);
+  args.strict_utf8 = 1;
+  strict = json_walk_args(s, len, &args);
+  CHECK(n >= 0 || strict < 0);
+  CHECK(strict < 0 || strict == n);
+}
+
+static void fuzz_scanner(const char *str, int len, void *user_data) {
+  CHECK(len >= 0 && str != NULL);
+  (*(int *) user_data)++;
+}
+
+struct fuzz_inner {
+  int a;
+  struct json_token d;
+};
+
+struct fuzz_struct {
+  int a;
+  char b[4];
+  bool c;
+  int64_t f;
+#if !JSON_MINIMAL
+  double j;
+#endif
+  struct json_token d;
+  struct fuzz_inner o;
+};
+
+static const struct json_field fuzz_inner_fields[] = {
+    JSON_FIELD(struct fuzz_inner, a, JSON_FIELD_INT),
+    JSON_FIELD(struct fuzz_inner, d, JSON_FIELD_TOKEN),
+};
+
+static const struct json_field fuzz_struct_fields[] = {
+    JSON_FIELD(struct fuzz_struct, a, JSON_FIELD_INT),
+    JSON_FIELD(struct fuzz_struct, b, JSON_FIELD_STRING),
+    JSON_FIELD(struct fuzz_struct, c, JSON_FIELD_BOOL),
+    JSON_FIELD(struct fuzz_struct, f, JSON_FIELD_INT64),
+#if !JSON_MINIMAL
+    JSON_FIELD(struct fuzz_struct, j, JSON_FIELD_DOUBLE),
+#endif
+    JSON_FIELD(struct fuzz_struct, d, JSON_FIELD_TOKEN),
+    JSON_FIELD_STRUCT(struct fuzz_struct, o, fuzz_inner_fields),
+};
+
+/* A decoded struct encodes to valid JSON, which decodes to the same */
+static void fuzz_struct(const char *s, int len) {
+  const struct json_field *fields = fuzz_struct_fields;
+  int n = (int) (sizeof(fuzz_struct_fields) / sizeof(fuzz_struct_fields[0]));
+  struct fuzz_struct a, b;
+  struct json_out out1 = FUZZ_OUT, out2 = FUZZ_OUT;
+  struct json_struct_error err;
+
+  memset(&a, 0, sizeof(a));
+  if (json_scanf_struct(s, len, fields, n, &a, &err) < 0) return;
+  CHECK(err.num_errors == 0 || err.field != NULL);
+  CHECK(err.num_errors == 0 ||
+        (err.token.ptr >= s && err.token.ptr + err.token.len <= s + len));
+  json_printf_struct(&out1, fields, n, &a);
+  CHECK(fuzz_valid(out1.u.buf.buf, (int) out1.u.buf.len) > 0);
+  memset(&b, 0, sizeof(b));
+  CHECK(json_scanf_struct(out1.u.buf.buf, (int) out1.u.buf.len, fields, n,
+                          &b, NULL) >= 0);
+  json_printf_struct(&out2, fields, n, &b);
+  CHECK(out1.u.buf.len == out2.u.buf.len &&
+        memcmp(out1.u.buf.buf, out2.u.buf.buf, out1.u.buf.len) == 0);
+  free(out1.u.buf.buf);
+  free(out2.u.buf.buf);
+}
+
+static void fuzz_scanf(const char *s, int len) {
+  struct json_token t, key, val;
+  char *q = NULL, buf[16];
+  int i = 0, b = 0, m = 0, buf_len = (int) sizeof(buf), idx;
+  long long ll = 0;
+  void *h = NULL;
+#if !JSON_MINIMAL
+  char *v = NULL, *x = NULL;
+  int v_len = 0, x_len = 0;
+  double d = 0;
+  json_scanf(s, len, "{a:%d, b:%Q, c:%B, d:%T, e:%M, f:%lld, g:%.*Q, h:%V, "
+             "i:%H, j:%f}",
+             &i, &q, &b, &t, fuzz_scanner, &m, &ll, &buf_len, buf, &v, &v_len,
+             &x_len, &x, &d);
+  free(v);
+  free(x);
+#else
+  json_scanf(s, len, "{a:%d, b:%Q, c:%B, d:%T, e:%M, f:%lld, g:%.*Q}", &i, &q,
+             &b, &t, fuzz_scanner, &m, &ll, &buf_len, buf);
+#endif
+  free(q);
+
+  for (idx = 0; json_scanf_array_elem(s, len, "", idx, &t) > 0; idx++) {
+    CHECK(t.ptr >= s && t.ptr + t.len <= s + len);
+  }
+  while ((h = json_next_key(s, len, h, "", &key, &val)) != NULL) {
+    CHECK(val.ptr >= s && val.ptr + val.len <= s + len);
+  }
+  while ((h = json_next_elem(s, len, h, "", &idx, &val)) != NULL) {
+    /* Members of an object come with index -1 */
+    CHECK(idx >= -1 && val.ptr >= s && val.ptr + val.len <= s + len);
+  }
+  fuzz_struct(s, len);
+}
+
+/* json_setf_inplace() on a copy of `s,len`; `check` that it stays valid */
+static void fuzz_setf_inplace(const char *s, int len, const char *path,
+                              const char *fmt, int check) {
+  int size = len + 64, n;
+  char *buf = (char *) malloc(size);
+  memcpy(buf, s, len);
+  buf[len] = '\0';
+  n = fmt == NULL ? json_setf_inplace(buf, len, size, path, NULL)
+                  : json_setf_inplace(buf, len, size, path, fmt, 42, "x");
+  CHECK(n < size);
+  if (check) CHECK(n >= 0 && fuzz_valid(buf, n) > 0);
+  free(buf);
+}
+
+static void fuzz_setf(const char *s, int len) {
+  static const char *paths[] = {"", ".a", ".a.b", ".a[0]", ".a[]", "[1]"};
+  int valid = fuzz_valid(s, len) == len;
+  size_t i;
+  for (i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+    struct json_out set = FUZZ_OUT, del = FUZZ_OUT;
+    int replaced = json_setf(s, len, &set, paths[i], "[%d,%Q]", 42, "x");
+    int deleted = json_setf(s, len, &del, paths[i], NULL);
+    /*
+     * Paths that do not fit the document, like .a[0] with an object at .a,
+     * have no defined result: check only replacement and deletion of
+     * existing values.
+     */
+    if (valid && replaced) {
+      CHECK(fuzz_valid(set.u.buf.buf, (int) set.u.buf.len) > 0);
+    }
+    if (valid && deleted && del.u.buf.len > 0) {
+      CHECK(fuzz_valid(del.u.buf.buf, (int) del.u.buf.len) > 0);
+    }
+    fuzz_setf_inplace(s, len, paths[i], "%d", valid && replaced);
+    fuzz_setf_inplace(s, len, paths[i], "[%d,%Q]", valid && replaced);
+    fuzz_setf_inplace(s, len, paths[i], NULL,
+                      valid && deleted && del.u.buf.len > 0);
+    free(set.u.buf.buf);
+    free(del.u.buf.buf);
+  }
+}
+
+static void fuzz_unescape(const char *s, int len) {
+  struct json_out esc = FUZZ_OUT;
+  char *dst = (char *) malloc(len + 1);
+  int n = json_unescape(s, len, dst, len + 1);
+  CHECK(n <= len);
+  CHECK(json_unescape_sz(s, (size_t) len, dst, (size_t) len + 1) == n);
+  CHECK(json_unescape(s, len, NULL, 0) == n);
+
+  /* Anything escaped unescapes back to itself */
+  json_escape(&esc, s, (size_t) len);
+  CHECK(esc.u.buf.len >= (size_t) len);
+  dst = (char *) realloc(dst, esc.u.buf.len + 1);
+  CHECK(json_unescape(esc.u.buf.buf, (int) esc.u.buf.len, dst,
+                      (int) esc.u.buf.len + 1) == len);
+  CHECK(memcmp(dst, s, len) == 0);
+  free(esc.u.buf.buf);
+  free(dst);
+}
+
+static void fuzz_prettify(const char *s, int len) {
+  struct json_out pretty = FUZZ_OUT, min = FUZZ_OUT, min2 = FUZZ_OUT;
+  int n = fuzz_valid(s, len);
+  json_prettify(s, len, &pretty);
+  json_minify(s, len, &min);
+  if (n > 0) {
+    CHECK(fuzz_valid(pretty.u.buf.buf, (int) pretty.u.buf.len) > 0);
+    CHECK(fuzz_valid(min.u.buf.buf, (int) min.u.buf.len) > 0);
+    json_minify(pretty.u.buf.buf, (int) pretty.u.buf.len, &min2);
+    CHECK(min2.u.buf.len == min.u.buf.len);
+    CHECK(memcmp(min2.u.buf.buf, min.u.buf.buf, min.u.buf.len) == 0);
+  }
+  free(pretty.u.buf.buf);
+  free(min.u.buf.buf);
+  free(min2.u.buf.buf);
+}
+
+#if JSON_ENABLE_HEX
+static void fuzz_diff_hex(const char *s, int len) {
+  struct json_out out = FUZZ_OUT;
+  char *dst = (char *) malloc(len + 1);
+  int i;
+  hexenc(&out, (const unsigned char *) s, len);
+  CHECK(out.u.buf.len == (size_t) len * 2);
+  for (i = 0; i < len; i++) {
+    CHECK(out.u.buf.buf[i * 2] == hex_tab[(unsigned char) s[i] >> 4]);
+    CHECK(out.u.buf.buf[i * 2 + 1] == hex_tab[s[i] & 0xf]);
+  }
+  /* Any input decodes the same way as with hexdec(), hex or not */
+  hexdec_buf(s, (size_t) len / 2, dst);
+  for (i = 0; i < len / 2; i++) CHECK(dst[i] == (char) hexdec(s + i * 2));
+  free(out.u.buf.buf);
+  free(dst);
+}
+#endif
+
+#if JSON_ENABLE_BASE64
+static void fuzz_diff_base64(const char *s, int len) {
+  struct json_out out = FUZZ_OUT;
+  char *dst;
+  int i, j;
+  b64enc(&out, (const unsigned char *) s, len);
+  CHECK(out.u.buf.len == (size_t) (len + 2) / 3 * 4);
+  for (i = 0, j = 0; i + 3 <= len; i += 3, j += 4) {
+    const unsigned char *p = (const unsigned char *) s + i;
+    CHECK(out.u.buf.buf[j] == b64_tab[p[0] >> 2]);
+    CHECK(out.u.buf.buf[j + 1] == b64_tab[(p[0] & 3) << 4 | p[1] >> 4]);
+    CHECK(out.u.buf.buf[j + 2] == b64_tab[(p[1] & 15) << 2 | p[2] >> 6]);
+    CHECK(out.u.buf.buf[j + 3] == b64_tab[p[2] & 63]);
+  }
+  dst = (char *) malloc(len + 1);
+  CHECK(b64dec(out.u.buf.buf, out.u.buf.len, dst) == (size_t) len);
+  CHECK(memcmp(dst, s, len) == 0);
+  free(out.u.buf.buf);
+  free(dst);
+}
+#endif
+
+static void fuzz_diff(const char *s, int len) {
+  int off;
+  /* Fast paths load 16 bytes at a time: try every alignment */
+  for (off = 0; off < 16 && off <= len; off++) {
+    const char *p = s + off;
+    int n = len - off, i;
+#if JSON_ENABLE_SIMD
+    ptrdiff_t run = json_str_run(p, n);
+    CHECK(run >= 0 && run <= n && (run % 16 == 0 || run < n));
+    for (i = 0; i < run; i++) {
+      unsigned char ch = (unsigned char) p[i];
+      CHECK(ch >= 32 && ch < 0x80 && ch != '"' && ch != '\\');
+    }
+    if (run % 16 != 0) {
+      unsigned char ch = (unsigned char) p[run];
+      CHECK(ch < 32 || ch >= 0x80 || ch == '"' || ch == '\\');
+    }
+#endif
+    for (i = 0; i < n && json_esc_tab[(unsigned char) p[i]] == 0;) i++;
+    CHECK(json_esc_run(p, (size_t) n) == (size_t) i);
+    for (i = 0; i < n && p[i] != '\\';) i++;
+    CHECK(json_unesc_run(p, (size_t) n) == (size_t) i);
+  }
+#if JSON_ENABLE_HEX
+  fuzz_diff_hex(s, len);
+#endif
+#if JSON_ENABLE_BASE64
+  fuzz_diff_base64(s, len);
+#endif
+}
+
+static const struct {
+  const char *name;
+  void (*fn)(const char *s, int len);
+} s_targets[] = {
+    {"walk", fuzz_walk},         {"scanf", fuzz_scanf},
+    {"setf", fuzz_setf},         {"unescape", fuzz_unescape},
+    {"prettify", fuzz_prettify}, {"diff", fuzz_diff},
+};
+
+#define NUM_TARGETS (sizeof(s_targets) / sizeof(s_targets[0]))
+
+static void (*s_target)(const char *s, int len);
+
+static int fuzz_set_target(const char *name) {
+  size_t i;
+  for (i = 0; i < NUM_TARGETS; i++) {
+    if (strcmp(s_targets[i].name, name) == 0) s_target = s_targets[i].fn;
+  }
+  return s_target != NULL ? 0 : -1;
+}
+
+int LLVMFuzzerTestOneInput(const unsigned char *data, size_t size);
+int LLVMFuzzerTestOneInput(const unsigned char *data, size_t size) {
+  /* A copy, so that ASan catches reads past the end */
+  char *s;
+  if (size > FUZZ_MAX_LEN) return 0;
+  if (s_target == NULL && fuzz_set_target(FUZZ_STR(FUZZ_TARGET)) != 0) {
+    abort();
+  }
+  s = (char *) malloc(size > 0 ? size : 1);
+  memcpy(s, data, size);
+  s_target(s, (int) size);
+  free(s);
+  return 0;
+}
+
+#ifndef FUZZ_LIBFUZZER
+#include <signal.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+static unsigned long s_rand = 1;
+static const char *s_cur;
+static size_t s_cur_len;
+
+/*
+ * Save the input that failed; sanitizers abort with abort_on_error=1.
+ * The heap may be broken by then, so stdio is avoided where possible.
+ */
+static void fuzz_on_abort(int sig) {
+  if (s_cur != NULL) {
+#ifndef _WIN32
+    int fd = open("fuzz-crash", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0 && write(fd, s_cur, s_cur_len) == (ssize_t) s_cur_len) {
+      static const char msg[] = "input saved to fuzz-crash\n";
+      (void) !write(2, msg, sizeof(msg) - 1);
+    }
+    if (fd >= 0) close(fd);
+#else
+    FILE *fp = fopen("fuzz-crash", "wb");
+    if (fp != NULL) {
+      fwrite(s_cur, 1, s_cur_len, fp);
+      fclose(fp);
+    }
+#endif
+  }
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+
+static unsigned long fuzz_rand(unsigned long n) {
+  s_rand ^= s_rand << 13;
+  s_rand ^= s_rand >> 7;
+  s_rand ^= s_rand << 17;
+  return (s_rand & 0xffffffffUL) % n;
+}
+
+/* Mutate `buf,len` in place, return the new length */
+static size_t fuzz_mutate(char *buf, size_t len, const char *other,
+                          size_t other_len) {
+  static const char dict[] = "{}[]\",:\\ 0123456789.eE+-tfnu\x01\x80\xc3\xed";
+  size_t pos = len > 0 ? fuzz_rand(len) : 0, n;
+  switch (fuzz_rand(4)) {
+    case 0: /* Replace a byte */
+      if (len > 0) buf[pos] = dict[fuzz_rand(sizeof(dict) - 1)];
+      break;
+    case 1: /* Insert a byte */
+      if (len < FUZZ_MAX_LEN) {
+        memmove(buf + pos + 1, buf + pos, len - pos);
+        buf[pos] = (char) fuzz_rand(256);
+        len++;
+      }
+      break;
+    case 2: /* Delete a range */
+      n = fuzz_rand(len - pos + 1);
+      memmove(buf + pos, buf + pos + n, len - pos - n);
+      len -= n;
+      break;
+    default: /* Splice in a part of another input */
+      n = other_len > 0 ? fuzz_rand(other_len) : 0;
+      if (n > FUZZ_MAX_LEN - len) n = FUZZ_MAX_LEN - len;
+      memmove(buf + pos + n, buf + pos, len - pos);
+      memcpy(buf + pos, other + fuzz_rand(other_len - n + 1), n);
+      len += n;
+      break;
+  }
+  return len;
+}
+
+int main(int argc, char *argv[]) {
+  struct json_mmap m;
+  char **inputs, *buf;
+  size_t *lens;
+  const char *target = FUZZ_STR(FUZZ_TARGET);
+  unsigned long i, mutations = 0;
+  int j, num_inputs = 0;
+
+  signal(SIGABRT, fuzz_on_abort);
+  inputs = (char **) malloc(sizeof(*inputs) * argc);
+  lens = (size_t *) malloc(sizeof(*lens) * argc);
+  for (j = 1; j < argc; j++) {
+    if (strcmp(argv[j], "-n") == 0 && j + 1 < argc) {
+      mutations = strtoul(argv[++j], NULL, 10);
+    } else if (strcmp(argv[j], "-s") == 0 && j + 1 < argc) {
+      s_rand = strtoul(argv[++j], NULL, 10) | 1;
+    } else if (strcmp(argv[j], "-t") == 0 && j + 1 < argc &&
+               num_inputs == 0 && fuzz_set_target(argv[j + 1]) == 0) {
+      target = argv[++j];
+    } else if (json_mmap_open(&m, argv[j]) == 0) {
+      /* Inputs may contain NUL bytes */
+      inputs[num_inputs] = (char *) malloc(m.len > 0 ? m.len : 1);
+      memcpy(inputs[num_inputs], m.ptr, m.len);
+      lens[num_inputs] = m.len;
+      json_mmap_close(&m);
+      s_cur = inputs[num_inputs];
+      s_cur_len = lens[num_inputs];
+      LLVMFuzzerTestOneInput((const unsigned char *) inputs[num_inputs],
+                             lens[num_inputs]);
+      num_inputs++;
+    } else {
+      fprintf(stderr,
+              "Usage: %s [-t target] [-n mutations] [-s seed] file ...\n",
+              argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  buf = (char *) malloc(FUZZ_MAX_LEN);
+  for (i = 0; i < mutations && num_inputs > 0; i++) {
+    int a = (int) fuzz_rand(num_inputs), b = (int) fuzz_rand(num_inputs);
+    size_t len = lens[a], k, rounds = 1 + fuzz_rand(8);
+    memcpy(buf, inputs[a], len);
+    for (k = 0; k < rounds; k++) {
+      len = fuzz_mutate(buf, len, inputs[b], lens[b]);
+    }
+    s_cur = buf;
+    s_cur_len = len;
+    LLVMFuzzerTestOneInput((const unsigned char *) buf, len);
+  }
+  s_cur = NULL;
+  printf("%s: %d inputs, %lu mutations OK\n", target, num_inputs, mutations);
+
+  for (j = 0; j < num_inputs; j++) free(inputs[j]);
+  free(inputs);
+  free(lens);
+  free(buf);
+  return EXIT_SUCCESS;
+}
+#endif /* FUZZ_LIBFUZZER */
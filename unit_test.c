@@ -28,6 +28,10 @@
 
 #include "frozen.c"
 
+#if defined(__cplusplus) && __cplusplus >= 201703L
+#include "frozen.hpp"
+#endif
+
 #include <float.h>
 #include <math.h>
 #include <stdio.h>
@@ -60,6 +64,15 @@ const char *tok_type_names[] = {
 
 static int static_num_tests = 0;
 
+static void count_cb(void *data, const char *name, size_t name_len,
+                     const char *path, const struct json_token *token) {
+  (*(unsigned long *) data)++;
+  (void) name;
+  (void) name_len;
+  (void) path;
+  (void) token;
+}
+
 static const char *test_errors(void) {
   /* clang-format off */
   static const char *invalid_tests[] = {
@@ -77,6 +90,7 @@ static const char *test_errors(void) {
                                            " { a : \"xx",
                                            "{a:12",
                                            "{a:\"\\uf",
+                                           "{a:\"\\",
                                            "{a:\"\\uff",
                                            "{a:\"\\ufff",
                                            "{a:\"\\uffff",
@@ -148,6 +162,92 @@ static const char *test_errors(void) {
     ASSERT(json_walk_args(sl, strlen(sl), args) == JSON_DEPTH_LIMIT);
     ASSERT(json_walk_args(sl, strlen(sl) - 1, args) == JSON_STRING_INCOMPLETE);
   }
+
+  {
+    /* Strict UTF-8, with the sequence at every offset in a 16-byte block */
+    static const struct {
+      const char *seq;
+      int res;
+    } utf8_tests[] = {
+        {"\xd1\x8f", 0},
+        {"\xe2\x82\xac", 0},
+        {"\xf0\x9f\x98\x80", 0},
+        {"\xf4\x8f\xbf\xbf", 0},
+        {"\xd1", JSON_STRING_INVALID},
+        {"\x8f", JSON_STRING_INVALID},
+        {"\xc0\xaf", JSON_STRING_INVALID},
+        {"\xe0\x80\xaf", JSON_STRING_INVALID},
+        {"\xed\xa0\x80", JSON_STRING_INVALID},
+        {"\xf4\x90\x80\x80", JSON_STRING_INVALID},
+        {"\xf5\x80\x80\x80", JSON_STRING_INVALID},
+        {"\xe2\x28\xa1", JSON_STRING_INVALID},
+        {NULL, 0},
+    };
+    struct frozen_args args[1];
+    char buf[64];
+    int j, n;
+
+    INIT_FROZEN_ARGS(args);
+    args->strict_utf8 = 1;
+    for (i = 0; utf8_tests[i].seq != NULL; i++) {
+      for (j = 0; j < 20; j++) {
+        n = snprintf(buf, sizeof(buf), "[\"%.*s%s0123456789abcdefghij\"]", j,
+                     "0123456789abcdefghij", utf8_tests[i].seq);
+        ASSERT(json_walk_args(buf, n, args) ==
+               (utf8_tests[i].res == 0 ? n : utf8_tests[i].res));
+      }
+    }
+    /* The default mode only looks at the first byte */
+    ASSERT(json_walk("\"\xc0\xaf\"", 4, NULL, NULL) == 4);
+    ASSERT(json_walk_args("\"\xe2\x82", 3, args) == JSON_STRING_INCOMPLETE);
+  }
+
+  {
+    const char *s = "{ \"a\": [1, \"x\", {\"b\": null}], \"c\": true }";
+    struct json_walk_stats stats;
+    struct frozen_args args[1];
+    char *deep = (char *) malloc(2 * JSON_MAX_PATH_LEN + 2);
+    unsigned long n = 0;
+
+    INIT_FROZEN_ARGS(args);
+    args->stats = &stats;
+    memset(&stats, 0xff, sizeof(stats));
+    ASSERT(json_walk_args(s, strlen(s), args) == (int) strlen(s));
+#if JSON_ENABLE_STATS
+    ASSERT(stats.tokens[JSON_TYPE_OBJECT_START] == 2);
+    ASSERT(stats.tokens[JSON_TYPE_OBJECT_END] == 2);
+    ASSERT(stats.tokens[JSON_TYPE_ARRAY_END] == 1);
+    ASSERT(stats.tokens[JSON_TYPE_NUMBER] == 1);
+    ASSERT(stats.tokens[JSON_TYPE_STRING] == 1);
+    ASSERT(stats.tokens[JSON_TYPE_NULL] == 1);
+    ASSERT(stats.tokens[JSON_TYPE_TRUE] == 1);
+    ASSERT(stats.callbacks == 0);
+    ASSERT(stats.max_depth == 4);
+    ASSERT(stats.max_path_len == 7); /* .a[2].b */
+    ASSERT(stats.whitespace == 8);
+    ASSERT(stats.truncated_paths == 0);
+#endif
+
+    args->callback = count_cb;
+    args->callback_data = &n;
+    json_walk_args(s, strlen(s), args);
+    ASSERT(n == 10);
+#if JSON_ENABLE_STATS
+    ASSERT(stats.callbacks == 10);
+
+    /* Paths of deep documents are cut */
+    memset(deep, '[', JSON_MAX_PATH_LEN);
+    memset(deep + JSON_MAX_PATH_LEN, ']', JSON_MAX_PATH_LEN);
+    ASSERT(json_walk_args(deep, 2 * JSON_MAX_PATH_LEN, args) ==
+           2 * JSON_MAX_PATH_LEN);
+    ASSERT(stats.max_depth == JSON_MAX_PATH_LEN);
+    ASSERT(stats.max_path_len == JSON_MAX_PATH_LEN - 1);
+    ASSERT(stats.truncated_paths > 0);
+#else
+    ASSERT(stats.callbacks == 0 && stats.max_depth == 0);
+#endif
+    free(deep);
+  }
   return NULL;
 }
 
@@ -346,6 +446,21 @@ static const char *test_json_printf(void) {
     ASSERT(strcmp(buf, "S") == 0);
   }
 
+  {
+    struct json_out out = JSON_OUT_BUF(buf, sizeof(buf));
+    memset(buf, 0, sizeof(buf));
+    ASSERT(json_printf(&out, "[%-08.3f]", 1.5) == 10);
+    ASSERT(strcmp(buf, "[1.500   ]") == 0);
+    /* Over-long conversions are rejected rather than cut */
+  }
+  {
+    struct json_out out = JSON_OUT_BUF(buf, sizeof(buf));
+    memset(buf, 0, sizeof(buf));
+    ASSERT(json_printf(&out, "[%-000000000000000000008d]", 1) ==
+           JSON_STRING_INVALID);
+    ASSERT(strcmp(buf, "[") == 0);
+  }
+
   {
     struct json_out out = JSON_OUT_BUF(buf, sizeof(buf));
     const char *result = "<\"array\">0f";
@@ -490,6 +605,26 @@ static const char *test_callback_api_long_path(void) {
   return NULL;
 }
 
+/* Values of empty keys are reported, the keys themselves are not */
+static const char *test_callback_api_empty_key(void) {
+  const char *s = "{\"\":1,\"a\":{\"\":[2]}}";
+  const char *result =
+      "name:'<null>', path:'', type:OBJECT_START, val:'<null>'\n"
+      "name:'', path:'.', type:NUMBER, val:'1'\n"
+      "name:'a', path:'.a', type:OBJECT_START, val:'<null>'\n"
+      "name:'', path:'.a.', type:ARRAY_START, val:'<null>'\n"
+      "name:'0', path:'.a.[0]', type:NUMBER, val:'2'\n"
+      "name:'<null>', path:'.a.', type:ARRAY_END, val:'[2]'\n"
+      "name:'<null>', path:'.a', type:OBJECT_END, val:'{\"\":[2]}'\n"
+      "name:'<null>', path:'', type:OBJECT_END, "
+      "val:'{\"\":1,\"a\":{\"\":[2]}}'\n";
+
+  char buf[1024] = "";
+  ASSERT(json_walk(s, strlen(s), cb, buf) == (int) strlen(s));
+  ASSERT(strcmp(buf, result) == 0);
+  return NULL;
+}
+
 static void scan_array(const char *str, int len, void *user_data) {
   struct json_token t;
   int i;
@@ -531,6 +666,14 @@ static const char *test_scanf(void) {
       ASSERT(strcmp(c, "abc") == 0);
       free(c);
   }
+  {
+      /* A duplicate key replaces the value, without leaking the first one */
+      const char* str = "{c:\"abc\",c:\"de\"}";
+      char* c = NULL;
+      json_scanf(str, strlen(str), "{c:%Q}", &c);
+      ASSERT(c != NULL && strcmp(c, "de") == 0);
+      free(c);
+  }
   {
       const char* str = "{a:{b:{c:4}},d:\"abc\"}";
       int c = 0;
@@ -680,6 +823,47 @@ static const char *test_scanf(void) {
     free(result);
   }
 
+  {
+    const char *str = "{a: \"hi\\nthere\", b: \"YTI=\", c: \"616263\", d: null}";
+    char a[10], b[4], c[3], d[4];
+    int alen = sizeof(a), blen = sizeof(b), clen = sizeof(c), dlen = sizeof(d);
+    const char *fmt = "{a: %.*Q, b: %.*V, c: %.*H, d: %.*Q}";
+#if JSON_ENABLE_BASE64 && JSON_ENABLE_HEX
+    ASSERT(json_scanf(str, strlen(str), fmt, &alen, a, &blen, b, &clen, c,
+                      &dlen, d) == 2);
+    ASSERT(blen == 2);
+    ASSERT(strcmp(b, "a2") == 0);
+    /* Does not fit, the needed length is reported */
+    ASSERT(clen == 3);
+    clen = 4;
+    ASSERT(json_scanf(str, strlen(str), "{c: %.*H}", &clen, d) == 1);
+    ASSERT(strcmp(d, "abc") == 0);
+#else
+    ASSERT(json_scanf(str, strlen(str), fmt, &alen, a, &blen, b, &clen, c,
+                      &dlen, d) == 1);
+#endif
+    ASSERT(alen == 8);
+    ASSERT(strcmp(a, "hi\nthere") == 0);
+    ASSERT(dlen == -1);
+    alen = 8;
+    ASSERT(json_scanf(str, strlen(str), "{a: %.*Q}", &alen, a) == 0);
+    ASSERT(alen == 8);
+  }
+
+  {
+    /* A length left at -1 by a null value is a buffer of size 0 */
+    char a[10] = "x";
+    int alen = sizeof(a);
+    ASSERT(json_scanf("{a: null}", 9, "{a: %.*Q}", &alen, a) == 0);
+    ASSERT(alen == -1);
+    ASSERT(json_scanf("{a: \"hi\"}", 9, "{a: %.*Q}", &alen, a) == 0);
+    ASSERT(alen == 2);
+    ASSERT(strcmp(a, "x") == 0);
+    alen = sizeof(a);
+    ASSERT(json_scanf("{a: \"hi\"}", 9, "{a: %.*Q}", &alen, a) == 1);
+    ASSERT(strcmp(a, "hi") == 0);
+  }
+
   {
     int a = 0;
     bool b = false;
@@ -746,7 +930,8 @@ static const char *test_json_unescape(void) {
   ASSERT(json_unescape("foo\\", 4, NULL, 0) == JSON_STRING_INCOMPLETE);
   ASSERT(json_unescape("foo\\x", 5, NULL, 0) == JSON_STRING_INVALID);
   ASSERT(json_unescape("\\ueeee", 5, NULL, 0) == JSON_STRING_INCOMPLETE);
-  ASSERT(json_unescape("\\ueeee", 6, NULL, 0) == JSON_STRING_INVALID);
+  ASSERT(json_unescape("\\ueeee", 6, NULL, 0) == 3);
+  ASSERT(json_unescape("\\ueeeg", 6, NULL, 0) == JSON_STRING_INVALID);
   // Simple one-byte escapes should work
   ASSERT(json_unescape("\\u0026", 2, NULL, 0) == JSON_STRING_INCOMPLETE);
   ASSERT(json_unescape("\\u0026", 3, NULL, 0) == JSON_STRING_INCOMPLETE);
@@ -754,6 +939,95 @@ static const char *test_json_unescape(void) {
   ASSERT(json_unescape("\\u0026", 5, NULL, 0) == JSON_STRING_INCOMPLETE);
   ASSERT(json_unescape("\\u0026", 6, buf, sizeof(buf)) == 1);
   ASSERT(buf[0] == '&');
+
+  {
+    /* Multi-byte characters and surrogate pairs are decoded to UTF-8 */
+    const char *s = "a\\u00e9\\u20AC\\ud83d\\ude00 and a long tail\\n";
+    char out[40];
+    int n = json_unescape(s, strlen(s), out, sizeof(out));
+    ASSERT(n == 27);
+    ASSERT(memcmp(out, "a\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80 and", 14) == 0);
+    ASSERT(memcmp(out + 14, " a long tail\n", 13) == 0);
+    /* Only the part that fits is written */
+    memset(out, 0, sizeof(out));
+    ASSERT(json_unescape(s, strlen(s), out, 4) == 27);
+    ASSERT(memcmp(out, "a\xc3\xa9\xe2\0", 5) == 0);
+  }
+
+  {
+    /* Decoding in place */
+    char s[] = "\\\"0123456789abcdefghij\\u00e9\\t0123456789abcdefghij";
+    int n = json_unescape(s, strlen(s), s, sizeof(s));
+    ASSERT(n == 44);
+    ASSERT(memcmp(s, "\"0123456789abcdefghij\xc3\xa9\t0123456789", 34) == 0);
+  }
+
+  ASSERT(json_unescape("\\ud83d", 6, NULL, 0) == JSON_STRING_INCOMPLETE);
+  ASSERT(json_unescape("\\ud83d\\ude0", 11, NULL, 0) ==
+         JSON_STRING_INCOMPLETE);
+  ASSERT(json_unescape("\\ud83d\\u0041", 12, NULL, 0) ==
+         JSON_STRING_INVALID);
+  ASSERT(json_unescape("\\ud83dxxxxxx", 12, NULL, 0) == JSON_STRING_INVALID);
+  ASSERT(json_unescape("\\ude00", 6, NULL, 0) == JSON_STRING_INVALID);
+
+  {
+    char *str = NULL;
+    ASSERT(json_scanf("{a: \"\\u041f\\u0440\\u0438\"}", 25, "{a: %Q}",
+                      &str) == 1);
+    ASSERT(strcmp(str, "\xd0\x9f\xd1\x80\xd0\xb8") == 0);
+    free(str);
+  }
+  return NULL;
+}
+
+static int count_printer_calls(struct json_out *out, const char *str,
+                               size_t len) {
+  (*(int *) out->u.data)++;
+  (void) str;
+  return len;
+}
+
+static const char *test_json_escape(void) {
+  char buf[200];
+  int i, num_calls = 0;
+
+  {
+    struct json_out out = JSON_OUT_BUF(buf, sizeof(buf));
+    const char *s = "a long html <b>fragment</b> \"with\" a\\b\x0f\x1f\x7f\v";
+    const char *r =
+        "a long html <b>fragment</b> \\\"with\\\" a\\\\b\\u000f\\u001f"
+        "\\u007f\\u000b";
+    ASSERT(json_escape(&out, s, strlen(s)) == (int) strlen(r));
+    ASSERT(strcmp(buf, r) == 0);
+  }
+
+  {
+    /* Escapes at every position relative to a 16-byte block */
+    for (i = 0; i < 40; i++) {
+      struct json_out out = JSON_OUT_BUF(buf, sizeof(buf));
+      char s[41], r[42];
+      memset(s, 'x', sizeof(s) - 1);
+      memset(r, 'x', sizeof(r) - 1);
+      r[sizeof(r) - 1] = '\0';
+      s[i] = '\n';
+      r[i] = '\\';
+      r[i + 1] = 'n';
+      json_escape(&out, s, sizeof(s) - 1);
+      ASSERT(memcmp(buf, r, sizeof(r)) == 0);
+    }
+  }
+
+  {
+    /* Clean runs, including UTF-8, are printed in one printer call */
+    struct json_out out = {count_printer_calls, {{NULL, 0, 0}}};
+    const char *s = "The quick brown fox jumps over the lazy dog, \xd1\x8f";
+    out.u.data = &num_calls;
+    json_escape(&out, s, strlen(s));
+    ASSERT(num_calls == 1);
+    json_escape(&out, "abc\ndef", 7);
+    ASSERT(num_calls == 4);
+  }
+
   return NULL;
 }
 
@@ -771,7 +1045,7 @@ static const char *test_parse_string(void) {
   const char *str = " \" foo\\bar\"";
   const int str_len = strlen(str);
   struct json_token t;
-  struct frozen f;
+  struct json_parser f;
   memset(&f, 0, sizeof(f));
   f.end = str + str_len;
   f.cur = str;
@@ -807,6 +1081,150 @@ static int compare_file(const char *file_name, const char *s) {
   return res == 0;
 }
 
+struct alloc_stats {
+  int num_allocs, num_frees;
+  size_t bytes;
+};
+
+static void *counting_malloc(size_t size, void *user_data) {
+  struct alloc_stats *st = (struct alloc_stats *) user_data;
+  st->num_allocs++;
+  st->bytes += size;
+  return malloc(size);
+}
+
+static void *counting_realloc(void *ptr, size_t size, void *user_data) {
+  struct alloc_stats *st = (struct alloc_stats *) user_data;
+  if (ptr == NULL) st->num_allocs++;
+  st->bytes += size;
+  return realloc(ptr, size);
+}
+
+static void counting_free(void *ptr, void *user_data) {
+  ((struct alloc_stats *) user_data)->num_frees++;
+  free(ptr);
+}
+
+#if JSON_ENABLE_HEAP
+#define restore_allocator() json_set_allocator(NULL)
+#else
+/* Frozen has no allocator in this mode, tests that need one use libc */
+static void *libc_malloc(size_t size, void *user_data) {
+  (void) user_data;
+  return malloc(size);
+}
+
+static void *libc_realloc(void *ptr, size_t size, void *user_data) {
+  (void) user_data;
+  return realloc(ptr, size);
+}
+
+static void libc_free(void *ptr, void *user_data) {
+  (void) user_data;
+  free(ptr);
+}
+
+static void restore_allocator(void) {
+  struct json_allocator a = {libc_malloc, libc_realloc, libc_free, NULL};
+  json_set_allocator(&a);
+}
+#endif
+
+static void *failing_malloc(size_t size, void *user_data) {
+  (void) size;
+  (void) user_data;
+  return NULL;
+}
+
+static const char *test_allocator(void) {
+  struct alloc_stats st = {0, 0, 0};
+  struct json_allocator a = {counting_malloc, counting_realloc, counting_free,
+                             NULL};
+  const char *fname = "a.json";
+  char *p, *q = NULL;
+  a.user_data = &st;
+  json_set_allocator(&a);
+
+  p = json_asprintf("{a:%Q}", "hi");
+  ASSERT(p != NULL);
+  ASSERT(st.num_allocs == 1);
+  ASSERT(json_scanf(p, strlen(p), "{a:%Q}", &q) == 1);
+  ASSERT(strcmp(q, "hi") == 0);
+  ASSERT(st.num_allocs == 2);
+  ASSERT(json_fprintf(fname, "%s", p) > 0);
+  counting_free(p, &st);
+  counting_free(q, &st);
+  ASSERT((p = json_fread(fname)) != NULL);
+  ASSERT(st.num_allocs == 3);
+  counting_free(p, &st);
+  ASSERT(json_prettify_file(fname) > 0);
+  ASSERT(st.num_allocs == 4);
+  ASSERT(st.num_frees == 4);
+  remove(fname);
+
+  restore_allocator();
+  p = json_asprintf("%d", 1);
+  ASSERT(st.num_allocs == 4);
+  free(p);
+
+  {
+    /* Long strings and short conversions need no allocations */
+    char buf[100];
+    struct json_out out = JSON_OUT_BUF(buf, sizeof(buf));
+    const char *str = "a string that is longer than the scratch buffer";
+    const char *result =
+        "a string that is longer than the scratch buffer|a s|42";
+    a.malloc_fn = failing_malloc;
+    json_set_allocator(&a);
+    ASSERT(json_printf(&out, "%s|%.*s|%d", str, 3, str, 42) == 54);
+    ASSERT(strcmp(buf, result) == 0);
+    out.u.buf.len = 0;
+    ASSERT(json_printf(&out, "[%.*s]", 100, "abc") == 5);
+    ASSERT(strcmp(buf, "[abc]") == 0);
+    out.u.buf.len = 0;
+    ASSERT(json_printf(&out, "[%100d]", 1) == JSON_NO_MEMORY);
+    ASSERT(strcmp(buf, "[") == 0);
+    /* Callers that sum lengths pass the error on */
+    {
+      int arr[] = {1, 2};
+      out.u.buf.len = 0;
+      ASSERT(json_printf(&out, "{a:%M}", json_printf_array, arr, sizeof(arr),
+                         sizeof(arr[0]), "%100d") == JSON_NO_MEMORY);
+      out.u.buf.len = 0;
+      ASSERT(json_setf("{\"a\":1}", 7, &out, ".a", "%100d", 1) ==
+             JSON_NO_MEMORY);
+      ASSERT(json_asprintf("%100d", 1) == NULL);
+    }
+    ASSERT(st.num_allocs == 4);
+    restore_allocator();
+  }
+  return NULL;
+}
+
+static const char *test_call_stats(void) {
+  struct json_call_stats cs;
+  struct json_out out = {count_printer_calls, {{NULL, 0, 0}}};
+  const char *s = "{\"a\": \"hi\"}";
+  char *q = NULL;
+  int num_calls = 0, n;
+  out.u.data = &num_calls;
+
+  json_take_call_stats(&cs);
+  ASSERT(json_scanf(s, strlen(s), "{a:%Q}", &q) == 1);
+  n = json_printf(&out, "{a:%d, b:%Q}", 1, q);
+  ASSERT(n == 17);
+  free(q);
+  json_take_call_stats(&cs);
+#if JSON_ENABLE_STATS
+  ASSERT(cs.allocs == 1 && cs.alloc_bytes == 3 && cs.frees == 0);
+  ASSERT(cs.printer_calls == (unsigned long) num_calls);
+  ASSERT(cs.printed_bytes == (size_t) n);
+  json_take_call_stats(&cs);
+#endif
+  ASSERT(cs.allocs == 0 && cs.printer_calls == 0 && cs.printed_bytes == 0);
+  return NULL;
+}
+
 static const char *test_fprintf(void) {
   const char *fname = "a.json";
   const char *result = "{\"a\":123}\n";
@@ -821,6 +1239,85 @@ static const char *test_fprintf(void) {
   return NULL;
 }
 
+static const char *test_json_mmap(void) {
+  const char *fname = "a.json";
+  struct json_mmap m;
+  int a = 0;
+  ASSERT(json_fprintf(fname, "{a:%d,b:[1,2]}", 123) > 0);
+  ASSERT(json_mmap_open(&m, fname) == 0);
+  ASSERT(m.len == 20 && memcmp(m.ptr, "{\"a\":123,", 9) == 0);
+  ASSERT(json_walk(m.ptr, (int) m.len, NULL, NULL) == 19);
+  ASSERT(json_scanf(m.ptr, (int) m.len, "{a:%d}", &a) == 1);
+  ASSERT(a == 123);
+  json_mmap_close(&m);
+  ASSERT(m.ptr == NULL && m.len == 0);
+
+  /* Empty files give an empty view */
+  fclose(fopen(fname, "wb"));
+  ASSERT(json_mmap_open(&m, fname) == 0);
+  ASSERT(m.len == 0);
+  json_mmap_close(&m);
+
+  remove(fname);
+  ASSERT(json_mmap_open(&m, fname) == -1);
+  ASSERT(m.len == 0);
+  return NULL;
+}
+
+static void walk_sz_cb(void *data, const char *name, size_t name_len,
+                       const char *path, const struct json_token_sz *t) {
+  size_t *total = (size_t *) data;
+  if (t->type == JSON_TYPE_STRING) *total += t->len;
+  (void) name;
+  (void) name_len;
+  (void) path;
+}
+
+static void scan_sz(const char *str, size_t len, void *user_data) {
+  *(size_t *) user_data = len;
+  (void) str;
+}
+
+static const char *test_json_sz(void) {
+  const char *s = "{\"a\": \"foo\", \"b\": [1, \"ba\\nr\"], \"c\": true}";
+  size_t total = 0, scanned = 0;
+  struct json_token_sz t;
+  ptrdiff_t len = 10;
+  char buf[100], small[10];
+  int c = 0;
+
+  ASSERT(json_walk_sz(s, strlen(s), walk_sz_cb, &total) ==
+         (ptrdiff_t) strlen(s));
+  ASSERT(total == 8);
+  ASSERT(json_walk_sz(s, 5, NULL, NULL) == JSON_STRING_INCOMPLETE);
+
+  ASSERT(json_scanf_sz(s, strlen(s), "{a: %T, b: %M, c: %B}", &t, scan_sz,
+                       &scanned, &c) == 3);
+  ASSERT(t.type == JSON_TYPE_STRING && t.len == 3);
+  ASSERT(memcmp(t.ptr, "foo", 3) == 0);
+  ASSERT(scanned == 12 && c == 1);
+  ASSERT(json_scanf_sz(s, strlen(s), "{a: %.*Q}", &len, small) == 1);
+  ASSERT(len == 3 && strcmp(small, "foo") == 0);
+
+  ASSERT(json_unescape_sz("ba\\nr", 5, buf, sizeof(buf)) == 4);
+  ASSERT(memcmp(buf, "ba\nr", 4) == 0);
+  ASSERT(json_unescape_sz("ba\\", 3, NULL, 0) == JSON_STRING_INCOMPLETE);
+
+  {
+    struct json_out out = JSON_OUT_BUF(buf, sizeof(buf));
+    ASSERT(json_setf_sz(s, strlen(s), &out, ".b[1]", "%d", 2) == 1);
+    ASSERT(strcmp(buf, "{\"a\": \"foo\", \"b\": [1, 2], \"c\": true}") ==
+           0);
+  }
+
+  {
+    struct json_out out = JSON_OUT_BUF(buf, sizeof(buf));
+    ASSERT(json_prettify_sz("[1,2]", 5, &out) == 5);
+    ASSERT(strcmp(buf, "[\n  1,\n  2\n]") == 0);
+  }
+  return NULL;
+}
+
 static const char *test_json_setf(void) {
   char buf[200];
   const char *s1 = "{ \"a\": 123, \"b\": [ 1 ], \"c\": true }";
@@ -875,6 +1372,43 @@ static const char *test_json_setf(void) {
     ASSERT(strcmp(buf, s2) == 0);
   }
 
+  {
+    /* Strings are replaced and deleted together with the quotes */
+    struct json_out out = JSON_OUT_BUF(buf, sizeof(buf));
+    const char *s = "{\"a\":\"x\",\"b\":\"\"}";
+    ASSERT(json_setf(s, strlen(s), &out, ".a", "%d", 1) == 1);
+    ASSERT(strcmp(buf, "{\"a\":1,\"b\":\"\"}") == 0);
+    out.u.buf.len = 0;
+    ASSERT(json_setf(s, strlen(s), &out, ".b", NULL) == 1);
+    ASSERT(strcmp(buf, "{\"a\":\"x\"}") == 0);
+    out.u.buf.len = 0;
+    ASSERT(json_setf(s, strlen(s), &out, ".c", "%Q", "y") == 0);
+    ASSERT(strcmp(buf, "{\"a\":\"x\",\"b\":\"\",\"c\":\"y\"}") == 0);
+  }
+
+  {
+    /* Add to empty object and array */
+    struct json_out out = JSON_OUT_BUF(buf, sizeof(buf));
+    const char *s = "{\"a\":{ },\"b\":[]}";
+    ASSERT(json_setf(s, strlen(s), &out, ".a.x.y", "%d", 1) == 0);
+    ASSERT(strcmp(buf, "{\"a\":{\"x\":{\"y\":1} },\"b\":[]}") == 0);
+    out.u.buf.len = 0;
+    ASSERT(json_setf(s, strlen(s), &out, ".b[]", "%d", 1) == 0);
+    ASSERT(strcmp(buf, "{\"a\":{ },\"b\":[1]}") == 0);
+    out.u.buf.len = 0;
+    ASSERT(json_setf("{}", 2, &out, ".c", "%d", 1) == 0);
+    ASSERT(strcmp(buf, "{\"c\":1}") == 0);
+  }
+
+  {
+    /* Delete array value */
+    struct json_out out = JSON_OUT_BUF(buf, sizeof(buf));
+    const char *s2 = "{ \"a\": 123, \"c\": true }";
+    int res = json_setf(s1, strlen(s1), &out, ".b", NULL);
+    ASSERT(res == 1);
+    ASSERT(strcmp(buf, s2) == 0);
+  }
+
   {
     /* Delete non-existent key */
     struct json_out out = JSON_OUT_BUF(buf, sizeof(buf));
@@ -929,6 +1463,14 @@ static const char *test_json_setf(void) {
     ASSERT(strcmp(buf, s2) == 0);
   }
 
+  {
+    /* Delete the first element right after the bracket */
+    struct json_out out = JSON_OUT_BUF(buf, sizeof(buf));
+    const char *s3 = "{\"a\":[1,2],\"b\":3}";
+    ASSERT(json_setf(s3, strlen(s3), &out, ".a[0]", NULL) == 1);
+    ASSERT(strcmp(buf, "{\"a\":[2],\"b\":3}") == 0);
+  }
+
   {
     /* Create array and push value  */
     struct json_out out = JSON_OUT_BUF(buf, sizeof(buf));
@@ -942,6 +1484,471 @@ static const char *test_json_setf(void) {
   return NULL;
 }
 
+static const char *test_json_setf_batch(void) {
+  char buf[200];
+  const char *s1 = "{ \"a\": 123, \"b\": [ 1 ], \"c\": true }";
+
+  {
+    /* Mixed mutations, same as the sequence of json_setf() calls */
+    struct json_out out = JSON_OUT_BUF(buf, sizeof(buf));
+    const char *s2 = "{ \"a\": 7, \"b\": [ 1,2 ],\"d\":{\"e\":8} }";
+    struct json_setf_op ops[] = {
+        JSON_SETF_OP(".d.e", "8"), JSON_SETF_OP(".c", NULL),
+        JSON_SETF_OP(".b[]", "2"), JSON_SETF_OP(".a", "7")};
+    ASSERT(json_setf_batch(s1, strlen(s1), &out, ops, 4) == 4);
+    ASSERT(strcmp(buf, s2) == 0);
+    ASSERT(strcmp(ops[0].json_path, ".d.e") == 0 && ops[0].applied == 1);
+    ASSERT(strcmp(ops[1].json_path, ".c") == 0 && ops[1].applied == 1);
+  }
+
+  {
+    /* Delete adjacent keys, including the first and the last one */
+    struct json_out out = JSON_OUT_BUF(buf, sizeof(buf));
+    struct json_setf_op ops[] = {JSON_SETF_OP(".a", NULL),
+                                 JSON_SETF_OP(".b", NULL),
+                                 JSON_SETF_OP(".x", NULL)};
+    ASSERT(json_setf_batch(s1, strlen(s1), &out, ops, 3) == 2);
+    ASSERT(strcmp(buf, "{ \"c\": true }") == 0);
+    ASSERT(ops[2].applied == 0);
+  }
+
+  {
+    struct json_out out = JSON_OUT_BUF(buf, sizeof(buf));
+    struct json_setf_op ops[] = {JSON_SETF_OP(".b", NULL),
+                                 JSON_SETF_OP(".c", NULL)};
+    ASSERT(json_setf_batch(s1, strlen(s1), &out, ops, 2) == 2);
+    ASSERT(strcmp(buf, "{ \"a\": 123 }") == 0);
+  }
+
+  {
+    /* Delete all keys and add new ones */
+    struct json_out out = JSON_OUT_BUF(buf, sizeof(buf));
+    struct json_setf_op ops[] = {
+        JSON_SETF_OP(".a", NULL),     JSON_SETF_OP(".b", NULL),
+        JSON_SETF_OP(".c", NULL),     JSON_SETF_OP(".x[]", "1"),
+        JSON_SETF_OP(".x[]", "2"),    JSON_SETF_OP(".y.z", "true"),
+        JSON_SETF_OP(".y.w.v", "[]"), JSON_SETF_OP(".y.w.u", "3")};
+    const char *s2 =
+        "{\"x\":[1,2],\"y\":{\"w\":{\"u\":3,\"v\":[]},\"z\":true} }";
+    ASSERT(json_setf_batch(s1, strlen(s1), &out, ops, 8) == 8);
+    ASSERT(strcmp(buf, s2) == 0);
+  }
+
+  {
+    /* Several insertions into nested object and array */
+    const char *s = "{\"a\":{\"x\":0},\"b\":[0]}";
+    struct json_out out = JSON_OUT_BUF(buf, sizeof(buf));
+    struct json_setf_op ops[] = {JSON_SETF_OP(".b[]", "1"),
+                                 JSON_SETF_OP(".a.y", "2"),
+                                 JSON_SETF_OP(".b[]", "3")};
+    ASSERT(json_setf_batch(s, strlen(s), &out, ops, 3) == 3);
+    ASSERT(strcmp(buf, "{\"a\":{\"x\":0,\"y\":2},\"b\":[0,1,3]}") == 0);
+  }
+
+  {
+    /* Mutations inside a changed value are skipped */
+    struct json_out out = JSON_OUT_BUF(buf, sizeof(buf));
+    struct json_setf_op ops[] = {JSON_SETF_OP(".b[0]", "5"),
+                                 JSON_SETF_OP(".b", "null")};
+    ASSERT(json_setf_batch(s1, strlen(s1), &out, ops, 2) == 1);
+    ASSERT(strcmp(buf, "{ \"a\": 123, \"b\": null, \"c\": true }") == 0);
+    ASSERT(ops[0].applied == 0 && ops[1].applied == 1);
+  }
+
+  {
+    struct json_out out = JSON_OUT_BUF(buf, sizeof(buf));
+    struct json_setf_op ops[] = {JSON_SETF_OP(".a", "1")};
+    ASSERT(json_setf_batch("{", 1, &out, ops, 1) == JSON_STRING_INCOMPLETE);
+    ASSERT(json_setf_batch(s1, strlen(s1), &out, ops, 0) == 0);
+    ASSERT(strcmp(buf, s1) == 0);
+  }
+
+  return NULL;
+}
+
+static const char *test_json_setf_inplace(void) {
+  const char *s1 = "{ \"a\": 123, \"b\": [ 1 ], \"c\": \"xyz\" }";
+  char buf[100];
+  int len = (int) strlen(s1);
+
+  /* Values that fit are overwritten and padded */
+  strcpy(buf, s1);
+  ASSERT(json_setf_inplace(buf, len, sizeof(buf), ".a", "%d", 7) == len);
+  ASSERT(strcmp(buf, "{ \"a\": 7  , \"b\": [ 1 ], \"c\": \"xyz\" }") == 0);
+  ASSERT(json_setf_inplace(buf, len, sizeof(buf), ".b", "%B", 1) == len);
+  ASSERT(strcmp(buf, "{ \"a\": 7  , \"b\": true , \"c\": \"xyz\" }") == 0);
+  ASSERT(json_setf_inplace(buf, len, sizeof(buf), ".c", "%Q", "a") == len);
+  ASSERT(strcmp(buf, "{ \"a\": 7  , \"b\": true , \"c\": \"a\"   }") == 0);
+
+  /* Deleted keys are blanked out */
+  ASSERT(json_setf_inplace(buf, len, sizeof(buf), ".a", NULL) == len);
+  ASSERT(strcmp(buf, "{           \"b\": true , \"c\": \"a\"   }") == 0);
+  ASSERT(json_setf_inplace(buf, len, sizeof(buf), ".c", NULL) == len);
+  ASSERT(strcmp(buf, "{           \"b\": true              }") == 0);
+  ASSERT(json_setf_inplace(buf, len, sizeof(buf), ".x", NULL) == len);
+  strcpy(buf, "123");
+  ASSERT(json_setf_inplace(buf, 3, sizeof(buf), "", NULL) == 3);
+  ASSERT(strcmp(buf, "   ") == 0);
+
+  /* Growing values and new keys rewrite the string */
+  strcpy(buf, s1);
+  ASSERT(json_setf_inplace(buf, len, sizeof(buf), ".a", "%d", 12345) ==
+         len + 2);
+  ASSERT(strcmp(buf, "{ \"a\": 12345, \"b\": [ 1 ], \"c\": \"xyz\" }") == 0);
+  len += 2;
+  ASSERT(json_setf_inplace(buf, len, sizeof(buf), ".c", "%Q", "abcd") ==
+         len + 1);
+  ASSERT(strcmp(buf, "{ \"a\": 12345, \"b\": [ 1 ], \"c\": \"abcd\" }") == 0);
+  len++;
+  ASSERT(json_setf_inplace(buf, len, sizeof(buf), ".d", "%d", 1) == len + 6);
+  ASSERT(strcmp(buf, "{ \"a\": 12345, \"b\": [ 1 ], \"c\": \"abcd\","
+                     "\"d\":1 }") == 0);
+
+  /* Does not fit, or no memory: the string is left unchanged */
+  strcpy(buf, s1);
+  len = (int) strlen(s1);
+  ASSERT(json_setf_inplace(buf, len, len + 1, ".a", "%d", 1234) ==
+         JSON_NO_MEMORY);
+  ASSERT(strcmp(buf, s1) == 0);
+  ASSERT(json_setf_inplace(buf, len, len + 2, ".a", "%d", 1234) == len + 1);
+  {
+    struct json_allocator a = {failing_malloc, NULL, NULL, NULL};
+    json_set_allocator(&a);
+    ASSERT(json_setf_inplace(buf, len + 1, sizeof(buf), ".a", "%d", 12345) ==
+           JSON_NO_MEMORY);
+    ASSERT(json_setf_inplace(buf, len + 1, sizeof(buf), ".a", "%d", 5) ==
+           len + 1);
+    ASSERT(strcmp(buf, "{ \"a\": 5   , \"b\": [ 1 ], \"c\": \"xyz\" }") == 0);
+    restore_allocator();
+  }
+
+  return NULL;
+}
+
+static const char *check_patch(const char *s, const char *patch,
+                               const char *expected, int merge) {
+  static char buf[300];
+  struct json_out out = JSON_OUT_BUF(buf, sizeof(buf));
+  int n = merge ? json_merge_patch(s, strlen(s), &out, patch, strlen(patch))
+                : json_patch(s, strlen(s), &out, patch, strlen(patch));
+  buf[out.u.buf.len] = '\0';
+  if (expected == NULL) {
+    return n == JSON_PATCH_FAILED && buf[0] == '\0' ? NULL : buf;
+  }
+  return n >= 0 && strcmp(buf, expected) == 0 ? NULL : buf;
+}
+
+static const char *test_json_patch(void) {
+  /* Examples from RFC 6902 Appendix A */
+  ASSERT(check_patch("{\"foo\":\"bar\"}",
+                     "[{\"op\":\"add\",\"path\":\"/baz\",\"value\":\"qux\"}]",
+                     "{\"foo\":\"bar\",\"baz\":\"qux\"}", 0) == NULL);
+  ASSERT(check_patch("{\"foo\":[\"bar\",\"baz\"]}",
+                     "[{\"op\":\"add\",\"path\":\"/foo/1\",\"value\":\"qux\"}]",
+                     "{\"foo\":[\"bar\",\"qux\",\"baz\"]}", 0) == NULL);
+  ASSERT(check_patch("{\"baz\":\"qux\",\"foo\":\"bar\"}",
+                     "[{\"op\":\"remove\",\"path\":\"/baz\"}]",
+                     "{\"foo\":\"bar\"}", 0) == NULL);
+  ASSERT(check_patch("{\"foo\":[\"bar\",\"qux\",\"baz\"]}",
+                     "[{\"op\":\"remove\",\"path\":\"/foo/1\"}]",
+                     "{\"foo\":[\"bar\",\"baz\"]}", 0) == NULL);
+  ASSERT(check_patch("{\"baz\":\"qux\",\"foo\":\"bar\"}",
+                     "[{\"op\":\"replace\",\"path\":\"/baz\","
+                     "\"value\":\"boo\"}]",
+                     "{\"baz\":\"boo\",\"foo\":\"bar\"}", 0) == NULL);
+  ASSERT(check_patch("{\"foo\":{\"bar\":\"baz\",\"waldo\":\"fred\"},"
+                     "\"qux\":{\"corge\":\"grault\"}}",
+                     "[{\"op\":\"move\",\"from\":\"/foo/waldo\","
+                     "\"path\":\"/qux/thud\"}]",
+                     "{\"foo\":{\"bar\":\"baz\"},"
+                     "\"qux\":{\"corge\":\"grault\",\"thud\":\"fred\"}}",
+                     0) == NULL);
+  ASSERT(check_patch("{\"foo\":[\"all\",\"grass\",\"cows\",\"eat\"]}",
+                     "[{\"op\":\"move\",\"from\":\"/foo/1\","
+                     "\"path\":\"/foo/3\"}]",
+                     "{\"foo\":[\"all\",\"cows\",\"eat\",\"grass\"]}",
+                     0) == NULL);
+  ASSERT(check_patch("{\"baz\":\"qux\",\"foo\":[\"a\",2,\"c\"]}",
+                     "[{\"op\":\"test\",\"path\":\"/baz\",\"value\":\"qux\"},"
+                     "{\"op\":\"test\",\"path\":\"/foo/1\",\"value\":2}]",
+                     "{\"baz\":\"qux\",\"foo\":[\"a\",2,\"c\"]}", 0) == NULL);
+  ASSERT(check_patch("{\"baz\":\"qux\"}",
+                     "[{\"op\":\"test\",\"path\":\"/baz\",\"value\":\"bar\"}]",
+                     NULL, 0) == NULL);
+  ASSERT(check_patch("{\"foo\":\"bar\"}",
+                     "[{\"op\":\"add\",\"path\":\"/child\","
+                     "\"value\":{\"grandchild\":{}}}]",
+                     "{\"foo\":\"bar\",\"child\":{\"grandchild\":{}}}",
+                     0) == NULL);
+  ASSERT(check_patch("{\"foo\":\"bar\"}",
+                     "[{\"op\":\"add\",\"path\":\"/baz/bat\","
+                     "\"value\":\"qux\"}]",
+                     NULL, 0) == NULL);
+  ASSERT(check_patch("{\"/\":9,\"~1\":10}",
+                     "[{\"op\":\"test\",\"path\":\"/~01\",\"value\":10}]",
+                     "{\"/\":9,\"~1\":10}", 0) == NULL);
+
+  /* Any key can be addressed, and new keys are written as JSON strings */
+  ASSERT(check_patch("{\"a\":1}",
+                     "[{\"op\":\"add\",\"path\":\"/a~1b\",\"value\":2},"
+                     "{\"op\":\"add\",\"path\":\"/\",\"value\":3},"
+                     "{\"op\":\"add\",\"path\":\"/b.c\",\"value\":4},"
+                     "{\"op\":\"add\",\"path\":\"/b[0]\",\"value\":5},"
+                     "{\"op\":\"add\",\"path\":\"/q\\\"x~0\",\"value\":6}]",
+                     "{\"a\":1,\"a/b\":2,\"\":3,\"b.c\":4,\"b[0]\":5,"
+                     "\"q\\\"x~\":6}",
+                     0) == NULL);
+  ASSERT(check_patch("{\"\":1,\"b.c\":{\"[0]\":[1]},\"q\\u0022x\":3}",
+                     "[{\"op\":\"replace\",\"path\":\"/\",\"value\":4},"
+                     "{\"op\":\"add\",\"path\":\"/b.c/[0]/-\",\"value\":2},"
+                     "{\"op\":\"remove\",\"path\":\"/q\\\"x\"}]",
+                     "{\"\":4,\"b.c\":{\"[0]\":[1,2]}}", 0) == NULL);
+
+  {
+    /* Escaped keys and strings are compared without allocations */
+    struct alloc_stats st = {0, 0, 0};
+    struct json_allocator a = {counting_malloc, counting_realloc,
+                               counting_free, NULL};
+    a.user_data = &st;
+    json_set_allocator(&a);
+    ASSERT(json_pointer_names("a~1b", 4, "a\\/b", 4) == 1);
+    ASSERT(json_pointer_names("a~0", 3, "a\\u007e", 7) == 1);
+    ASSERT(json_pointer_names("a~0", 3, "a\\u007f", 7) == 0);
+    ASSERT(json_pointer_names("a~0", 3, "a~", 2) == 1);
+    ASSERT(json_equal("\"\\u00e9\"", 8, "\"\xc3\xa9\"", 4) == 1);
+    ASSERT(json_equal("\"a\\\"\"", 5, "\"a\\\"b\"", 6) == 0);
+    ASSERT(json_equal("\"\\ud83d\\ude00\"", 14, "\"\xf0\x9f\x98\x80\"", 6) ==
+           1);
+    ASSERT(st.num_allocs == 0);
+    restore_allocator();
+  }
+  ASSERT(check_patch("{\"foo\":[\"bar\"]}",
+                     "[{\"op\":\"add\",\"path\":\"/foo/-\","
+                     "\"value\":[\"abc\",\"def\"]}]",
+                     "{\"foo\":[\"bar\",[\"abc\",\"def\"]]}", 0) == NULL);
+
+  /* Dependent operations are applied in order */
+  ASSERT(check_patch("{\"a\":[]}",
+                     "[{\"op\":\"add\",\"path\":\"/a/0\",\"value\":1},"
+                     "{\"op\":\"add\",\"path\":\"/a/0\",\"value\":0},"
+                     "{\"op\":\"add\",\"path\":\"/a/-\",\"value\":2},"
+                     "{\"op\":\"add\",\"path\":\"/a/-\",\"value\":3},"
+                     "{\"op\":\"copy\",\"from\":\"/a\",\"path\":\"/b\"}]",
+                     "{\"a\":[0,1,2,3],\"b\":[0,1,2,3]}", 0) == NULL);
+  ASSERT(check_patch("{ \"a\": [ 1, 2, 3, 4 ], \"b\": { } }",
+                     "[{\"op\":\"move\",\"from\":\"/a/3\",\"path\":\"/a/0\"},"
+                     "{\"op\":\"remove\",\"path\":\"/a/1\"},"
+                     "{\"op\":\"add\",\"path\":\"/b/c\",\"value\":true},"
+                     "{\"op\":\"test\",\"path\":\"\","
+                     "\"value\":{\"b\":{\"c\":true},\"a\":[4,2.0,3]}}]",
+                     "{ \"a\": [ 4, 2, 3 ], \"b\": {\"c\":true } }",
+                     0) == NULL);
+  ASSERT(check_patch("{\"a\":1}",
+                     "[{\"op\":\"replace\",\"path\":\"\",\"value\":[1]}]",
+                     "[1]", 0) == NULL);
+  ASSERT(check_patch("{\"a\":1}", "[]", "{\"a\":1}", 0) == NULL);
+
+  /* Errors */
+  ASSERT(check_patch("{\"a\":1}", "{}", NULL, 0) == NULL);
+  ASSERT(check_patch("{\"a\":1}", "[{\"op\":\"remove\",\"path\":\"/b\"}]", NULL,
+                     0) == NULL);
+  ASSERT(check_patch("{\"a\":1}", "[{\"op\":\"foo\",\"path\":\"/a\"}]", NULL,
+                     0) == NULL);
+  ASSERT(check_patch("{\"a\":[]}",
+                     "[{\"op\":\"add\",\"path\":\"/a/1\",\"value\":1}]", NULL,
+                     0) == NULL);
+  ASSERT(check_patch("{\"a\":{}}",
+                     "[{\"op\":\"move\",\"from\":\"/a\",\"path\":\"/a/b\"}]",
+                     NULL, 0) == NULL);
+  ASSERT(check_patch("{\"a\":[1,2]}",
+                     "[{\"op\":\"add\",\"path\":\"/a/01\",\"value\":0}]", NULL,
+                     0) == NULL);
+  ASSERT(check_patch("{\"a\":1}",
+                     "[{\"op\":\"add\",\"path\":\"/a~2\",\"value\":0}]", NULL,
+                     0) == NULL);
+  return NULL;
+}
+
+static const char *test_json_merge_patch(void) {
+  /* Examples from RFC 7386 Appendix A */
+  ASSERT(check_patch("{\"a\":\"b\"}", "{\"a\":\"c\"}", "{\"a\":\"c\"}", 1) ==
+         NULL);
+  ASSERT(check_patch("{\"a\":\"b\"}", "{\"b\":\"c\"}",
+                     "{\"a\":\"b\",\"b\":\"c\"}", 1) == NULL);
+  ASSERT(check_patch("{\"a\":\"b\"}", "{\"a\":null}", "{}", 1) == NULL);
+  ASSERT(check_patch("{\"a\":\"b\",\"b\":\"c\"}", "{\"a\":null}",
+                     "{\"b\":\"c\"}", 1) == NULL);
+  ASSERT(check_patch("{\"a\":[\"b\"]}", "{\"a\":\"c\"}", "{\"a\":\"c\"}", 1) ==
+         NULL);
+  ASSERT(check_patch("{\"a\":\"c\"}", "{\"a\":[\"b\"]}", "{\"a\":[\"b\"]}",
+                     1) == NULL);
+  ASSERT(check_patch("{\"a\":{\"b\":\"c\"}}",
+                     "{\"a\":{\"b\":\"d\",\"c\":null}}",
+                     "{\"a\":{\"b\":\"d\"}}", 1) == NULL);
+  ASSERT(check_patch("{\"a\":[{\"b\":\"c\"}]}", "{\"a\":[1]}", "{\"a\":[1]}",
+                     1) == NULL);
+  ASSERT(check_patch("[\"a\",\"b\"]", "[\"c\",\"d\"]", "[\"c\",\"d\"]", 1) ==
+         NULL);
+  ASSERT(check_patch("{\"a\":\"b\"}", "[\"c\"]", "[\"c\"]", 1) == NULL);
+  ASSERT(check_patch("{\"a\":\"foo\"}", "null", "null", 1) == NULL);
+  ASSERT(check_patch("{\"a\":\"foo\"}", "\"bar\"", "\"bar\"", 1) == NULL);
+  ASSERT(check_patch("{\"e\":null}", "{\"a\":1}", "{\"e\":null,\"a\":1}", 1) ==
+         NULL);
+  ASSERT(check_patch("[1,2]", "{\"a\":\"b\",\"c\":null}", "{\"a\":\"b\"}", 1) ==
+         NULL);
+  ASSERT(check_patch("{}", "{\"a\":{\"bb\":{\"ccc\":null}}}",
+                     "{\"a\":{\"bb\":{}}}", 1) == NULL);
+
+  /* Keys are matched as strings */
+  ASSERT(check_patch("{\"a\":1}", "{\"b.c\":2,\"b[1]\":3,\"\":4}",
+                     "{\"a\":1,\"b.c\":2,\"b[1]\":3,\"\":4}", 1) == NULL);
+  ASSERT(check_patch("{\"a\":{\"x\":1}}", "{\"a\":{\"y.z\":2}}",
+                     "{\"a\":{\"x\":1,\"y.z\":2}}", 1) == NULL);
+  ASSERT(check_patch("{\"\":1,\"b.c\":2,\"q\\\"x\":3}",
+                     "{\"\":null,\"b.c\":{\"d\":3},\"q\\u0022x\":4}",
+                     "{\"b.c\":{\"d\":3},\"q\\\"x\":4}", 1) == NULL);
+
+  /* Several changes in one pass */
+  ASSERT(check_patch("{ \"title\": \"Goodbye!\", \"author\": { \"givenName\": "
+                     "\"John\", \"familyName\": \"Doe\" }, \"tags\": [ "
+                     "\"example\", \"sample\" ] }",
+                     "{\"title\":\"Hello!\",\"phoneNumber\":\"+01-123\","
+                     "\"author\":{\"familyName\":null},\"tags\":[\"example\"]}",
+                     "{ \"title\": \"Hello!\", \"author\": { \"givenName\": "
+                     "\"John\" }, \"tags\": [\"example\"],"
+                     "\"phoneNumber\":\"+01-123\" }",
+                     1) == NULL);
+  return NULL;
+}
+
+/* Diff `a` and `b`, check the patch and that it turns `a` into `b` */
+static const char *check_diff(const char *a, const char *b,
+                              const char *expected) {
+  static char buf[300], res[300];
+  struct json_out out = JSON_OUT_BUF(buf, sizeof(buf));
+  struct json_out out2 = JSON_OUT_BUF(res, sizeof(res));
+  int n = json_diff(a, strlen(a), b, strlen(b), &out);
+  buf[out.u.buf.len] = '\0';
+  if (n < 0 || strcmp(buf, expected) != 0) return buf;
+  if (json_patch(a, strlen(a), &out2, buf, strlen(buf)) != n) return buf;
+  res[out2.u.buf.len] = '\0';
+  return json_equal(res, strlen(res), b, strlen(b)) == 1 ? NULL : res;
+}
+
+static const char *test_json_diff(void) {
+  char buf[100];
+  struct json_out out = JSON_OUT_BUF(buf, sizeof(buf));
+  const char *a = "{\"a\":1,\"b\":[2,3],\"c\":{\"d\":true}}";
+  const char *b = "{ \"a\": 1, \"b\": [2, 4], \"c\": {\"d\": true}, \"e\": 5 }";
+
+  ASSERT(check_diff(a, a, "[]") == NULL);
+  ASSERT(check_diff(a, b,
+                    "[{\"op\":\"replace\",\"path\":\"/b/1\",\"value\":4},"
+                    "{\"op\":\"add\",\"path\":\"/e\",\"value\":5}]") == NULL);
+  ASSERT(check_diff(b, a,
+                    "[{\"op\":\"replace\",\"path\":\"/b/1\",\"value\":3},"
+                    "{\"op\":\"remove\",\"path\":\"/e\"}]") == NULL);
+  ASSERT(check_diff("1", "\"x\"",
+                    "[{\"op\":\"replace\",\"path\":\"\",\"value\":\"x\"}]") ==
+         NULL);
+  ASSERT(check_diff("{\"a\":[1]}", "{\"a\":{}}",
+                    "[{\"op\":\"replace\",\"path\":\"/a\",\"value\":{}}]") ==
+         NULL);
+
+  /* Keys in a different order are matched by name */
+  ASSERT(check_diff("{\"x\":1,\"y\":2,\"z\":3}", "{\"z\":3,\"x\":1,\"w\":4}",
+                    "[{\"op\":\"remove\",\"path\":\"/y\"},"
+                    "{\"op\":\"add\",\"path\":\"/w\",\"value\":4}]") == NULL);
+
+  /* Array tails are removed and appended */
+  ASSERT(check_diff("[1,2,3,4]", "[1,5]",
+                    "[{\"op\":\"replace\",\"path\":\"/1\",\"value\":5},"
+                    "{\"op\":\"remove\",\"path\":\"/2\"},"
+                    "{\"op\":\"remove\",\"path\":\"/2\"}]") == NULL);
+  ASSERT(check_diff("[[1]]", "[[1,{\"k\":[]}],2]",
+                    "[{\"op\":\"add\",\"path\":\"/0/1\",\"value\":{\"k\":[]}},"
+                    "{\"op\":\"add\",\"path\":\"/1\",\"value\":2}]") == NULL);
+
+  /* Keys are escaped in JSON Pointers */
+  ASSERT(check_diff("{\"a/b\":{\"m~n\":1}}", "{\"a/b\":{\"m~n\":2}}",
+                    "[{\"op\":\"replace\",\"path\":\"/a~1b/m~0n\","
+                    "\"value\":2}]") == NULL);
+  ASSERT(check_diff("{\"\":1}", "{\"\":2}",
+                    "[{\"op\":\"replace\",\"path\":\"/\",\"value\":2}]") ==
+         NULL);
+  ASSERT(check_diff("{\"a\":1}", "{\"a\":1,\"x[0]\":2,\"b.c\":3,\"~/\":4}",
+                    "[{\"op\":\"add\",\"path\":\"/x[0]\",\"value\":2},"
+                    "{\"op\":\"add\",\"path\":\"/b.c\",\"value\":3},"
+                    "{\"op\":\"add\",\"path\":\"/~0~1\",\"value\":4}]") ==
+         NULL);
+  ASSERT(check_diff("{\"q\\\"x\":1,\"s\\/t\":[],\"\\u007e\":{}}",
+                    "{\"q\\\"x\":2,\"s\\/t\":[3],\"\\u007e\":{\"\":4}}",
+                    "[{\"op\":\"replace\",\"path\":\"/q\\\"x\",\"value\":2},"
+                    "{\"op\":\"add\",\"path\":\"/s~1t/0\",\"value\":3},"
+                    "{\"op\":\"add\",\"path\":\"/~0/\",\"value\":4}]") == NULL);
+
+  /* Unquoted keys and optional commas */
+  ASSERT(check_diff("{a:1 b:[1 2]}", "{\"a\":1,\"b\":[1,3]}",
+                    "[{\"op\":\"replace\",\"path\":\"/b/1\",\"value\":3}]") ==
+         NULL);
+
+  /* Keys are matched by their unescaped bytes */
+  ASSERT(check_diff("{\"a\":1,\"b\":2}", "{\"b\":2,\"\\u0061\":1}", "[]") ==
+         NULL);
+  ASSERT(check_diff("{\"a\":1}", "{\"\\u0061\":2}",
+                    "[{\"op\":\"replace\",\"path\":\"/a\",\"value\":2}]") ==
+         NULL);
+
+  {
+    /* Reordered members beyond the stack tables, with and without memory */
+    static char x[2000], y[2000];
+    const char *expected =
+        "[{\"op\":\"replace\",\"path\":\"/k50\",\"value\":-1}]";
+    struct alloc_stats st = {0, 0, 0};
+    struct json_allocator al = {counting_malloc, counting_realloc,
+                                counting_free, NULL};
+    struct json_allocator fail = {failing_malloc, NULL, NULL, NULL};
+    int i, xn = 0, yn = 0;
+    for (i = 0; i < 100; i++) {
+      xn += snprintf(x + xn, sizeof(x) - xn, "%s\"k%d\":%d", i ? "," : "{", i,
+                     i);
+      yn += snprintf(y + yn, sizeof(y) - yn, "%s\"k%d\":%d", i ? "," : "{",
+                     99 - i, 99 - i == 50 ? -1 : 99 - i);
+    }
+    strcpy(x + xn, "}");
+    strcpy(y + yn, "}");
+    ASSERT(json_diff(x, xn + 1, y, yn + 1, &out) == 1);
+    ASSERT(out.u.buf.len == strlen(expected));
+    ASSERT(strncmp(buf, expected, out.u.buf.len) == 0);
+    al.user_data = &st;
+    json_set_allocator(&al);
+    out.u.buf.len = 0;
+    ASSERT(json_diff(x, xn + 1, y, yn + 1, &out) == 1);
+    ASSERT(out.u.buf.len == strlen(expected));
+    ASSERT(strncmp(buf, expected, out.u.buf.len) == 0);
+    ASSERT(st.num_allocs > 0 && st.num_allocs == st.num_frees);
+    json_set_allocator(&fail);
+    out.u.buf.len = 0;
+    ASSERT(json_diff(x, xn + 1, y, yn + 1, &out) == 1);
+    ASSERT(out.u.buf.len == strlen(expected));
+    ASSERT(strncmp(buf, expected, out.u.buf.len) == 0);
+    restore_allocator();
+    out.u.buf.len = 0;
+  }
+
+  ASSERT(json_diff_paths(a, strlen(a), b, strlen(b), &out) == 2);
+  ASSERT(strncmp(buf, "[\"/b/1\",\"/e\"]", out.u.buf.len) == 0);
+  out.u.buf.len = 0;
+  ASSERT(json_diff_paths("[1,2,3]", 7, "[]", 2, &out) == 3);
+  ASSERT(strncmp(buf, "[\"/0\",\"/1\",\"/2\"]", out.u.buf.len) == 0);
+
+  out.u.buf.len = 0;
+  ASSERT(json_diff("{", 1, a, strlen(a), &out) == JSON_STRING_INCOMPLETE);
+  ASSERT(json_diff(a, strlen(a), "[:]", 3, &out) == JSON_STRING_INVALID);
+  ASSERT(out.u.buf.len == 0);
+  return NULL;
+}
+
 static const char *test_prettify(void) {
   const char *fname = "a.json";
   char buf[200];
@@ -995,6 +2002,110 @@ static const char *test_prettify(void) {
     (void) remove(fname);
   }
 
+  {
+    /* Existing files are not overwritten, and the mode is kept */
+    const char *tmp_name = "a.json.0.tmp";
+#if JSON_POSIX_FILES
+    struct stat st;
+#endif
+    json_fprintf(tmp_name, "%d", 1);
+    json_fprintf(fname, "[%d]", 2);
+#if JSON_POSIX_FILES
+    ASSERT(chmod(fname, 0640) == 0);
+#endif
+    ASSERT(json_prettify_file(fname) > 0);
+    ASSERT(compare_file(fname, "[\n  2\n]\n"));
+    ASSERT(compare_file(tmp_name, "1\n"));
+    ASSERT(compare_file("a.json.1.tmp", "") == -1);
+#if JSON_POSIX_FILES
+    ASSERT(stat(fname, &st) == 0 && (st.st_mode & 0777) == 0640);
+#endif
+    remove(tmp_name);
+    remove(fname);
+  }
+
+  {
+    /* Feeding the streaming prettifier byte by byte gives the same result */
+    const char *s =
+        "{\"k\":[-0x1F,2.5e+3,\"a\\u00e9\xc3\xa9\"],b:{\"\":null}}";
+    const char *expected =
+        "{\n  \"k\": [\n    -0x1F,\n    2.5e+3,\n"
+        "    \"a\\u00e9\xc3\xa9\"\n  ],\n  \"b\": {\n    \"\": null\n  }\n}";
+    struct json_out out = JSON_OUT_BUF(buf, sizeof(buf));
+    struct json_pretty p;
+    size_t i;
+    json_pretty_init(&p, &out, 2);
+    for (i = 0; i < strlen(s); i++) json_pretty_feed(&p, s + i, 1);
+    ASSERT(json_pretty_end(&p) == (long) strlen(s));
+    buf[out.u.buf.len] = '\0';
+    ASSERT(strcmp(buf, expected) == 0);
+    out.u.buf.len = 0;
+    ASSERT(json_prettify(s, strlen(s), &out) == (int) strlen(s));
+    ASSERT(out.u.buf.len == strlen(expected));
+    ASSERT(strncmp(buf, expected, out.u.buf.len) == 0);
+    ASSERT(json_prettify("\"\\uZZ", 5, &out) == JSON_STRING_INCOMPLETE);
+    ASSERT(json_prettify("\"\\uZZZZ\"", 8, &out) == JSON_STRING_INVALID);
+  }
+
+  {
+    /* Files larger than the read buffer, no temporary file is left */
+    FILE *fp = fopen(fname, "wb");
+    int i, n = JSON_PRETTIFY_BUF_SIZE / 4 + 10;
+    char *p;
+    ASSERT(fp != NULL);
+    fputc('[', fp);
+    for (i = 0; i < n; i++) fprintf(fp, "%s%d", i > 0 ? "," : "", i % 10);
+    fputs("] trailing", fp);
+    fclose(fp);
+    ASSERT(json_prettify_file(fname) == 2 * n + 1);
+    ASSERT((p = json_fread(fname)) != NULL);
+    ASSERT((int) strlen(p) == 5 * n + 3);
+    ASSERT(strncmp(p, "[\n  0,\n  1,", 11) == 0);
+    ASSERT(strcmp(p + strlen(p) - 3, "\n]\n") == 0);
+    free(p);
+    ASSERT(json_fread("a.json.tmp") == NULL);
+    (void) remove(fname);
+  }
+
+  return NULL;
+}
+
+static const char *test_json_reformat(void) {
+  char buf[200];
+  struct json_out out = JSON_OUT_BUF(buf, sizeof(buf));
+  struct json_reformat_opts opts = {4, 1};
+  const char *s = " { \"b\" : [ 1 , {y:\"a b\", x:null} , ] ,a:true } ";
+  int num_calls = 0;
+
+  ASSERT(json_minify(s, strlen(s), &out) == (int) strlen(s) - 1);
+  buf[out.u.buf.len] = '\0';
+  ASSERT(strcmp(buf, "{\"b\":[1,{\"y\":\"a b\",\"x\":null}],\"a\":true}") == 0);
+
+  out.u.buf.len = 0;
+  ASSERT(json_reformat(s, strlen(s), &out, &opts) == (int) strlen(s) - 1);
+  buf[out.u.buf.len] = '\0';
+  ASSERT(strcmp(buf,
+                "{\n    \"a\": true,\n    \"b\": [\n        1,\n        {\n"
+                "            \"x\": null,\n            \"y\": \"a b\"\n"
+                "        }\n    ]\n}") == 0);
+
+  opts.indent = 0;
+  out.u.buf.len = 0;
+  ASSERT(json_reformat("{b:1,a:2,\"a\":3}", 15, &out, &opts) == 15);
+  buf[out.u.buf.len] = '\0';
+  ASSERT(strcmp(buf, "{\"a\":2,\"a\":3,\"b\":1}") == 0);
+  ASSERT(json_reformat("{b:1", 4, &out, &opts) == JSON_STRING_INCOMPLETE);
+  ASSERT(json_minify("[1,:]", 5, &out) == JSON_STRING_INVALID);
+
+  {
+    /* Compact input is copied to compact output in one printer call */
+    struct json_out cnt = {count_printer_calls, {{NULL, 0, 0}}};
+    const char *c = "{\"a\":[1,2,{\"b\":null}],\"c\":\"d\"}";
+    cnt.u.data = &num_calls;
+    ASSERT(json_minify(c, strlen(c), &cnt) == (int) strlen(c));
+    ASSERT(num_calls == 1);
+  }
+
   return NULL;
 }
 
@@ -1062,6 +2173,34 @@ static const char *test_json_printf_hex(void) {
   ASSERT(s == NULL);
 #endif
   free(s);
+
+#if JSON_ENABLE_HEX
+  {
+    /* Round trip of all lengths around the block sizes */
+    unsigned char data[600];
+    int i, n, len;
+    char *res;
+    for (i = 0; i < (int) sizeof(data); i++) data[i] = (unsigned char) (i * 7);
+    for (n = 0; n < (int) sizeof(data); n += 13) {
+      s = json_asprintf("{a:%H}", n, data);
+      ASSERT(s != NULL);
+      ASSERT((int) strlen(s) == 8 + 2 * n);
+      res = NULL;
+      ASSERT(json_scanf(s, strlen(s), "{a:%H}", &len, &res) == 1);
+      ASSERT(len == n);
+      ASSERT(memcmp(res, data, n) == 0);
+      free(res);
+      free(s);
+    }
+    s = (char *) "{a:\"00FfaB1234567890abcdefABCDEF0123456789\"}";
+    ASSERT(json_scanf(s, strlen(s), "{a:%H}", &len, &res) == 1);
+    ASSERT(len == 19);
+    ASSERT(memcmp(res, "\x00\xff\xab\x12\x34\x56\x78\x90\xab\xcd\xef\xab"
+                       "\xcd\xef\x01\x23\x45\x67\x89",
+                  19) == 0);
+    free(res);
+  }
+#endif
   return NULL;
 }
 
@@ -1074,6 +2213,30 @@ static const char *test_json_printf_base64(void) {
 #endif
   ASSERT(strcmp(s, r) == 0);
   free(s);
+
+#if JSON_ENABLE_BASE64
+  {
+    /* Round trip of all lengths around the block sizes */
+    unsigned char data[600];
+    int i, n, len;
+    char *res;
+    for (i = 0; i < (int) sizeof(data); i++) data[i] = (unsigned char) (i * 7);
+    for (n = 0; n < (int) sizeof(data); n += 7) {
+      s = json_asprintf("{a:%V}", data, n);
+      ASSERT(s != NULL);
+      ASSERT((int) strlen(s) == 8 + (n + 2) / 3 * 4);
+      res = NULL;
+      ASSERT(json_scanf(s, strlen(s), "{a:%V}", &res, &len) == 1);
+      ASSERT(len == n);
+      ASSERT(memcmp(res, data, n) == 0);
+      free(res);
+      free(s);
+    }
+    s = json_asprintf("%V", "\xfb\xff\xbf\x00", 4);
+    ASSERT(strcmp(s, "\"+/+/AA==\"") == 0);
+    free(s);
+  }
+#endif
   return NULL;
 }
 
@@ -1126,11 +2289,252 @@ static const char *test_json_next_elem(void) {
   return NULL;
 }
 
+static const char *test_json_next_token(void) {
+  static const char *docs[] = {
+      "{\"c\":[\"foo\", \"bar\", {\"a\":9, \"b\": \"x\"}], \"mynull\": null, "
+      "\"mytrue\": true, \"myfalse\": false}",
+      " {a:1 b:[1 2,[],{}],c:0x1f,\"d\\\"\":-1.5e3,} ", "\"x\"", "12", "[]",
+      "{a:[1,{b:[", "{a:tru", "{\"a", "{a 1}", "{a:1}}", "[1,x]", "", NULL};
+  struct json_pull p;
+  struct json_token t;
+  char buf1[1024], buf2[1024], deep[JSON_PULL_MAX_DEPTH + 2];
+  int i, res, n;
+
+  /* Same tokens, names, paths and errors as json_walk() */
+  for (i = 0; docs[i] != NULL; i++) {
+    int len = (int) strlen(docs[i]);
+    buf1[0] = buf2[0] = '\0';
+    res = json_walk(docs[i], len, cb, buf1);
+    json_pull_init(&p, docs[i], len);
+    while ((n = json_next_token(&p, &t)) > 0) {
+      cb(buf2, p.name, p.name_len, p.path, &t);
+    }
+    ASSERT(strcmp(buf1, buf2) == 0);
+    ASSERT(n == (res < 0 ? res : 0));
+    ASSERT(json_next_token(&p, &t) == n);
+  }
+
+  /* Stop after the key we need; the rest is never looked at */
+  json_pull_init(&p, "{id:1,method:\"Sys.Reboot\",params:{a:[", 38);
+  while ((n = json_next_token(&p, &t)) > 0 &&
+         strcmp(p.path, ".method") != 0) {
+  }
+  ASSERT(n == 1 && t.type == JSON_TYPE_STRING && t.len == 10);
+  ASSERT(p.name_len == 6 && strncmp(p.name, "method", 6) == 0);
+
+  memset(deep, '[', sizeof(deep));
+  json_pull_init(&p, deep, sizeof(deep));
+  for (i = 0; (n = json_next_token(&p, &t)) > 0; i++) {
+  }
+  ASSERT(n == JSON_DEPTH_LIMIT && i == JSON_PULL_MAX_DEPTH);
+  json_pull_init(&p, NULL, 0);
+  ASSERT(json_next_token(&p, &t) == JSON_STRING_INVALID);
+  return NULL;
+}
+
+struct test_point {
+  int x, y;
+};
+
+struct test_shape {
+  char name[8];
+  struct test_point pos;
+  bool visible;
+  int64_t id;
+#if !JSON_MINIMAL
+  double scale;
+#endif
+  struct json_token tags;
+};
+
+static const struct json_field test_point_fields[] = {
+    JSON_FIELD(struct test_point, x, JSON_FIELD_INT),
+    JSON_FIELD(struct test_point, y, JSON_FIELD_INT),
+};
+
+static const struct json_field test_shape_fields[] = {
+    JSON_FIELD(struct test_shape, name, JSON_FIELD_STRING),
+    JSON_FIELD_STRUCT(struct test_shape, pos, test_point_fields),
+    JSON_FIELD(struct test_shape, visible, JSON_FIELD_BOOL),
+    JSON_FIELD(struct test_shape, id, JSON_FIELD_INT64),
+#if !JSON_MINIMAL
+    JSON_FIELD(struct test_shape, scale, JSON_FIELD_DOUBLE),
+#endif
+    JSON_FIELD(struct test_shape, tags, JSON_FIELD_TOKEN),
+};
+
+static const char *test_json_struct(void) {
+  const struct json_field *fields = test_shape_fields;
+  int n = (int) ARRAY_SIZE(test_shape_fields);
+  char buf[200];
+  struct json_out out = JSON_OUT_BUF(buf, sizeof(buf));
+  struct json_struct_error err;
+  struct test_shape sh;
+  const char *s;
+
+  memset(&sh, 0, sizeof(sh));
+  s = "{name:\"a\\\"b\",x:5,pos:{y:2,x:-1,z:[1]},visible:true,"
+      "id:-9223372036854775808,scale:0.1,tags:[\"t\",{}],u:{pos:{x:7}}}";
+  ASSERT(json_scanf_struct(s, strlen(s), fields, n, &sh, &err) == n + 1);
+  ASSERT(err.num_errors == 0 && err.field == NULL);
+  ASSERT(strcmp(sh.name, "a\"b") == 0);
+  ASSERT(sh.pos.x == -1 && sh.pos.y == 2 && sh.visible);
+  ASSERT(sh.id == INT64_MIN);
+  ASSERT(sh.tags.type == JSON_TYPE_ARRAY_END);
+  ASSERT(strncmp(sh.tags.ptr, "[\"t\",{}]", sh.tags.len) == 0);
+
+  ASSERT(json_printf_struct(&out, fields, n, &sh) > 0);
+#if !JSON_MINIMAL
+  ASSERT(sh.scale == 0.1);
+  ASSERT(strcmp(buf, "{\"name\":\"a\\\"b\",\"pos\":{\"x\":-1,\"y\":2},"
+                     "\"visible\":true,\"id\":-9223372036854775808,"
+                     "\"scale\":0.1,\"tags\":[\"t\",{}]}") == 0);
+#else
+  ASSERT(strcmp(buf, "{\"name\":\"a\\\"b\",\"pos\":{\"x\":-1,\"y\":2},"
+                     "\"visible\":true,\"id\":-9223372036854775808,"
+                     "\"tags\":[\"t\",{}]}") == 0);
+#endif
+  ASSERT(json_scanf_struct(buf, strlen(buf), fields, n, &sh, NULL) == n + 1);
+
+  /* Mismatches leave the members unchanged */
+  s = "{name:\"too long\",pos:{x:2147483648,y:1.5},visible:1,id:null,"
+      "tags:null}";
+  ASSERT(json_scanf_struct(s, strlen(s), fields, n, &sh, &err) == 0);
+  ASSERT(err.num_errors == 4 && err.field == &fields[0]);
+  ASSERT(err.token.type == JSON_TYPE_STRING && err.token.len == 8);
+  ASSERT(strcmp(sh.name, "a\"b") == 0 && sh.pos.x == -1 && sh.pos.y == 2);
+  ASSERT(sh.visible && sh.id == INT64_MIN);
+
+  s = "{name:{a:1},pos:[1],visible:true}";
+  ASSERT(json_scanf_struct(s, strlen(s), fields, n, &sh, &err) == 1);
+  ASSERT(err.num_errors == 2 && err.field == &fields[0]);
+  ASSERT(err.token.type == JSON_TYPE_OBJECT_END && err.token.len == 5);
+
+  s = "{name:\"\\u00e9\",id:9223372036854775808}";
+  ASSERT(json_scanf_struct(s, strlen(s), fields, n, &sh, &err) == 1);
+  ASSERT(strcmp(sh.name, "\xc3\xa9") == 0);
+  ASSERT(err.num_errors == 1 && err.field == &fields[3]);
+
+  ASSERT(json_scanf_struct("[{x:1}]", 7, fields, n, &sh, NULL) == 0);
+  ASSERT(json_scanf_struct("{x:1", 4, fields, n, &sh, NULL) < 0);
+  return NULL;
+}
+
+#if defined(__cplusplus) && __cplusplus >= 201703L
+FROZEN_SCHEMA(test_point, FROZEN_FIELD(test_point, x),
+              FROZEN_FIELD(test_point, y));
+#if !JSON_MINIMAL
+FROZEN_SCHEMA(test_shape, FROZEN_FIELD(test_shape, name),
+              FROZEN_FIELD(test_shape, pos), FROZEN_FIELD(test_shape, visible),
+              FROZEN_FIELD(test_shape, id), FROZEN_FIELD(test_shape, scale),
+              FROZEN_FIELD(test_shape, tags));
+#else
+FROZEN_SCHEMA(test_shape, FROZEN_FIELD(test_shape, name),
+              FROZEN_FIELD(test_shape, pos), FROZEN_FIELD(test_shape, visible),
+              FROZEN_FIELD(test_shape, id), FROZEN_FIELD(test_shape, tags));
+#endif
+
+static const char *test_cpp(void) {
+  using namespace frozen::literals;
+  const char *s = "{a:{b:-42,c:[1,2.5,true]},s:\"x\\ny\",s:\"z\",o:{}}";
+  int ids = 0, others = 0;
+  auto cb = [&](std::string_view name, std::string_view path,
+                const frozen::token &t) {
+    switch (frozen::hash(path)) {
+      case ".a.b"_hash:
+        ids += name == "b" && t.value == "-42";
+        break;
+      case frozen::hash(".a.c[2]"):
+        ids += name == "2" && t.type == JSON_TYPE_TRUE;
+        break;
+      default:
+        others++;
+    }
+  };
+
+  ASSERT(frozen::walk(s, cb) == (ptrdiff_t) strlen(s));
+  ASSERT(ids == 2 && others == 12);
+  ASSERT(frozen::walk("{a:", cb) == JSON_STRING_INCOMPLETE);
+
+  ASSERT(frozen::get<int64_t>(s, ".a.b") == -42);
+  ASSERT(frozen::get<int>(s, ".a.c[0]") == 1);
+  ASSERT(frozen::get<unsigned>(s, ".a.b") == std::nullopt);
+  ASSERT(frozen::get<signed char>("[300]", "[0]") == std::nullopt);
+  ASSERT(frozen::get<int>(s, ".a.c[1]") == std::nullopt);
+  ASSERT(frozen::get<double>(s, ".a.c[1]") == 2.5);
+  ASSERT(frozen::get<float>("[1e2]", "[0]") == 100.0f);
+  ASSERT(frozen::get<bool>(s, ".a.c[2]") == true);
+  ASSERT(frozen::get<bool>(s, ".a.b") == std::nullopt);
+  ASSERT(frozen::get<std::string>(s, ".s") == "z");
+  ASSERT(frozen::get<std::string>("[\"x\\ny\"]", "[0]") == "x\ny");
+  ASSERT(frozen::get<std::string_view>("[\"x\\ny\"]", "[0]") == "x\\ny");
+  ASSERT(frozen::get<std::string>(s, ".a.b") == std::nullopt);
+  ASSERT(frozen::get<int>(s, ".nope") == std::nullopt);
+  ASSERT(frozen::get<int>("{a:1", ".a") == std::nullopt);
+
+  ASSERT(frozen::find(s, ".o")->value == "{}");
+  ASSERT(frozen::find(s, ".o")->type == JSON_TYPE_OBJECT_END);
+  ASSERT(frozen::find(s, ".a.c")->value == "[1,2.5,true]");
+  ASSERT(!frozen::find(s, ".a.c[3]"));
+
+  /* Deduced descriptors are the same as the hand-written ones */
+  for (size_t i = 0; i < ARRAY_SIZE(test_shape_fields); i++) {
+    const struct json_field &a = frozen::schema<test_shape>::fields[i];
+    const struct json_field &b = test_shape_fields[i];
+    ASSERT(strcmp(a.name, b.name) == 0 && a.offset == b.offset &&
+           a.type == b.type && a.size == b.size &&
+           (a.fields == NULL) == (b.fields == NULL) &&
+           a.num_fields == b.num_fields);
+  }
+  test_shape sh = {};
+  char buf[100];
+  struct json_out out = JSON_OUT_BUF(buf, sizeof(buf));
+  ASSERT(frozen::decode("{name:\"x\",pos:{x:1,y:2},id:3}", sh) == 4);
+  ASSERT(sh.pos.y == 2 && sh.id == 3 && strcmp(sh.name, "x") == 0);
+  ASSERT(frozen::encode(&out, sh.pos) == 13);
+  ASSERT(strcmp(buf, "{\"x\":1,\"y\":2}") == 0);
+  return NULL;
+}
+#endif
+
+#ifdef FROZEN_HAVE_COROUTINES
+static const char *test_cpp_tokens(void) {
+  const char *s = "{method:\"get\",params:[1,{a:true}]}";
+  std::string seq;
+  int n = 0;
+
+  auto all = frozen::tokens(s);
+  for (const frozen::event &e : all) {
+    seq += std::string(e.name) + "|" + std::string(e.path) + "|" +
+           std::string(e.value.value) + ";";
+  }
+  ASSERT(all.result() == 0);
+  ASSERT(seq ==
+         "||;method|.method|get;params|.params|;0|.params[0]|1;"
+         "1|.params[1]|;a|.params[1].a|true;|.params[1]|{a:true};"
+         "|.params|[1,{a:true}];||{method:\"get\",params:[1,{a:true}]};");
+
+  /* Stop after the first key; the rest, even if invalid, is not parsed */
+  for (const frozen::event &e : frozen::tokens("{method:\"get\",params:[")) {
+    n++;
+    if (e.path == ".method") break;
+  }
+  ASSERT(n == 2);
+
+  auto bad = frozen::tokens("{a:1,");
+  n = 0;
+  for (const frozen::event &e : bad) n += e.value.type == JSON_TYPE_NUMBER;
+  ASSERT(n == 1 && bad.result() == JSON_STRING_INCOMPLETE);
+  return NULL;
+}
+#endif
+
 static const char *run_all_tests(void) {
   RUN_TEST(test_json_printf_hex);
   RUN_TEST(test_json_printf_base64);
   RUN_TEST(test_json_next);
   RUN_TEST(test_prettify);
+  RUN_TEST(test_json_reformat);
   RUN_TEST(test_eos);
   RUN_TEST(test_scanf);
   RUN_TEST(test_errors);
@@ -1138,17 +2542,38 @@ static const char *run_all_tests(void) {
   RUN_TEST(test_system);
   RUN_TEST(test_callback_api);
   RUN_TEST(test_callback_api_long_path);
+  RUN_TEST(test_callback_api_empty_key);
   RUN_TEST(test_json_unescape);
+  RUN_TEST(test_json_escape);
   RUN_TEST(test_parse_string);
+  RUN_TEST(test_call_stats);
   RUN_TEST(test_fprintf);
+  RUN_TEST(test_json_mmap);
+  RUN_TEST(test_json_sz);
+  RUN_TEST(test_allocator);
   RUN_TEST(test_json_setf);
+  RUN_TEST(test_json_setf_batch);
+  RUN_TEST(test_json_setf_inplace);
+  RUN_TEST(test_json_patch);
+  RUN_TEST(test_json_merge_patch);
+  RUN_TEST(test_json_diff);
   RUN_TEST(test_json_depth);
   RUN_TEST(test_json_next_elem);
+  RUN_TEST(test_json_struct);
+  RUN_TEST(test_json_next_token);
+#if defined(__cplusplus) && __cplusplus >= 201703L
+  RUN_TEST(test_cpp);
+#endif
+#ifdef FROZEN_HAVE_COROUTINES
+  RUN_TEST(test_cpp_tokens);
+#endif
   return NULL;
 }
 
 int main(void) {
-  const char *fail_msg = run_all_tests();
+  const char *fail_msg;
+  restore_allocator();
+  fail_msg = run_all_tests();
   printf("%s, tests run: %d\n", fail_msg ? "FAIL" : "PASS", static_num_tests);
   return fail_msg == NULL ? EXIT_SUCCESS : EXIT_FAILURE;
 }